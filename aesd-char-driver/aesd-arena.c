@@ -0,0 +1,93 @@
+/**
+ * @file aesd-arena.c
+ * @brief A byte ring mapped twice in a row, so entries that wrap its end
+ * still read as one contiguous span
+ *
+ */
+
+#include <linux/errno.h>
+#include <linux/gfp.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+
+#include "aesd-arena.h"
+
+/**
+* Initializes @param arena to an empty ring of @param size bytes, rounded up to a power of two
+* and at least a page.
+* @return 0 on success, -EINVAL for a size of 0 or above AESD_ARENA_MAX_SIZE, -ENOMEM if the
+* pages or mapping could not be allocated
+*/
+int aesd_arena_init(struct aesd_arena *arena, size_t size)
+{
+    size_t rounded = PAGE_SIZE;
+    struct page **mapping;
+    unsigned int i;
+
+    memset(arena, 0, sizeof(struct aesd_arena));
+    if(size == 0 || size > AESD_ARENA_MAX_SIZE){
+        return -EINVAL;
+    }
+    while(rounded < size){
+        rounded <<= 1;
+    }
+
+    arena->page_count = rounded >> PAGE_SHIFT;
+    arena->pages = kvcalloc(arena->page_count, sizeof(struct page *), GFP_KERNEL);
+    if(arena->pages == NULL){
+        goto cleanup;
+    }
+    for(i = 0; i < arena->page_count; ++i){
+        arena->pages[i] = alloc_page(GFP_KERNEL);
+        if(arena->pages[i] == NULL){
+            goto cleanup;
+        }
+    }
+
+    // every page twice, so the second mapping picks up where the first wraps
+    mapping = kvmalloc_array(2 * arena->page_count, sizeof(struct page *), GFP_KERNEL);
+    if(mapping == NULL){
+        goto cleanup;
+    }
+    for(i = 0; i < arena->page_count; ++i){
+        mapping[i] = arena->pages[i];
+        mapping[i + arena->page_count] = arena->pages[i];
+    }
+    arena->data = vmap(mapping, 2 * arena->page_count, VM_MAP, PAGE_KERNEL);
+    kvfree(mapping);
+    if(arena->data == NULL){
+        goto cleanup;
+    }
+
+    arena->size = rounded;
+    arena->mask = rounded - 1;
+    return 0;
+
+cleanup:
+    aesd_arena_destroy(arena);
+    return -ENOMEM;
+}
+
+/**
+* Releases @param arena, leaving it off.  Safe on a zeroed arena, or one that
+* failed to initialize
+*/
+void aesd_arena_destroy(struct aesd_arena *arena)
+{
+    unsigned int i;
+
+    if(arena->data != NULL){
+        vunmap(arena->data);
+    }
+    if(arena->pages != NULL){
+        for(i = 0; i < arena->page_count; ++i){
+            if(arena->pages[i] != NULL){
+                __free_page(arena->pages[i]);
+            }
+        }
+        kvfree(arena->pages);
+    }
+    memset(arena, 0, sizeof(struct aesd_arena));
+}
@@ -0,0 +1,63 @@
+/*
+ * aesd-arena.h
+ *
+ *  @brief Contiguous byte ring the aesdchar device can store its writes in,
+ *  instead of one kmalloc per write
+ */
+
+#ifndef AESD_ARENA_H
+#define AESD_ARENA_H
+
+#include <linux/types.h>
+
+struct page;
+
+/**
+ * Largest arena aesd_arena_init accepts, after rounding
+ */
+#define AESD_ARENA_MAX_SIZE (1ul << 30)
+
+struct aesd_arena
+{
+    /**
+     * The ring's bytes, mapped twice back to back: any span of up to size bytes
+     * starting inside the first mapping is contiguous, even where it wraps
+     */
+    char *data;
+    /**
+     * Bytes in the ring, a power of two and a whole number of pages.  0 when off
+     */
+    size_t size;
+    /**
+     * size - 1, wraps an offset into the ring
+     */
+    size_t mask;
+    /**
+     * The pages behind both mappings, size / PAGE_SIZE of them
+     */
+    struct page **pages;
+    unsigned int page_count;
+};
+
+extern int aesd_arena_init(struct aesd_arena *arena, size_t size);
+
+extern void aesd_arena_destroy(struct aesd_arena *arena);
+
+/**
+ * @return whether @param arena holds the device's data, rather than kmalloc
+ */
+static inline bool aesd_arena_enabled(const struct aesd_arena *arena)
+{
+    return arena->data != NULL;
+}
+
+/**
+ * @return where logical byte @param offset lives in @param arena.  Offsets count every
+ * byte ever stored, as aesd_circular_buffer start_offs do
+ */
+static inline char *aesd_arena_at(const struct aesd_arena *arena, uint64_t offset)
+{
+    return arena->data + (offset & arena->mask);
+}
+
+#endif /* AESD_ARENA_H */
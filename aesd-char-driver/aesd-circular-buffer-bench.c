@@ -0,0 +1,115 @@
+/**
+ * @file aesd-circular-buffer-bench.c
+ * @brief Userspace microbenchmark of circular buffer add and find
+ *
+ * Fills a buffer of each capacity past wrapping, timing every add, then times
+ * lookups of random offsets across everything it holds.  Run with capacities
+ * as arguments, or none for 10, 1K and 1M entries.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "aesd-circular-buffer.h"
+
+#define MAX_ENTRY_SIZE 128
+#define MIN_ADDS (1u << 20)
+#define FINDS (1u << 20)
+
+static const char entryData[MAX_ENTRY_SIZE];
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// xorshift, so every run uses the same entry sizes and offsets
+static uint32_t next_random(uint32_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+static int bench(uint32_t capacity)
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry *entryptr;
+    uint32_t random = 2463534242u;
+    size_t totalSize = 0;
+    size_t checksum = 0;
+    uint64_t start;
+    uint64_t addNs;
+    uint64_t findNs;
+    uint64_t adds;
+    uint64_t finds;
+    uint64_t i;
+
+    if(aesd_circular_buffer_init(&buffer, capacity) != 0){
+        fprintf(stderr, "Could not create a buffer of %u entries\n", capacity);
+        return EXIT_FAILURE;
+    }
+
+    // wrap at least twice, so adds pay for overwriting
+    adds = (uint64_t)buffer.capacity * 2;
+    if(adds < MIN_ADDS){
+        adds = MIN_ADDS;
+    }
+    start = now_ns();
+    for(i = 0; i < adds; ++i){
+        const struct aesd_buffer_entry entry = {
+            .buffptr = entryData,
+            .size = next_random(&random) % MAX_ENTRY_SIZE + 1,
+        };
+        checksum += (size_t)aesd_circular_buffer_add_entry(&buffer, &entry);
+    }
+    addNs = now_ns() - start;
+
+    totalSize = aesd_circular_buffer_size(&buffer);
+
+    finds = FINDS;
+    start = now_ns();
+    for(i = 0; i < finds; ++i){
+        size_t entryOffset = 0;
+        const size_t fpos = ((uint64_t)next_random(&random) << 32 | next_random(&random)) % totalSize;
+        entryptr = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, fpos, &entryOffset);
+        if(entryptr == NULL){
+            fprintf(stderr, "Offset %zu of %zu was not found\n", fpos, totalSize);
+            aesd_circular_buffer_destroy(&buffer);
+            return EXIT_FAILURE;
+        }
+        checksum += entryOffset;
+    }
+    findNs = now_ns() - start;
+
+    printf("%9u entries (%9u slots): add %8.1f ns, find %12.1f ns  (checksum %zx)\n",
+           capacity, buffer.capacity, (double)addNs / adds,
+           (double)findNs / finds, checksum);
+    aesd_circular_buffer_destroy(&buffer);
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+    static const uint32_t defaultCapacities[] = {10, 1024, 1024 * 1024};
+    int i;
+
+    if(argc < 2){
+        for(i = 0; i < (int)(sizeof(defaultCapacities) / sizeof(defaultCapacities[0])); ++i){
+            if(bench(defaultCapacities[i]) != EXIT_SUCCESS){
+                return EXIT_FAILURE;
+            }
+        }
+        return EXIT_SUCCESS;
+    }
+    for(i = 1; i < argc; ++i){
+        if(bench(strtoul(argv[i], NULL, 0)) != EXIT_SUCCESS){
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
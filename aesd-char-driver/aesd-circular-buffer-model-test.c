@@ -0,0 +1,280 @@
+/**
+ * @file aesd-circular-buffer-model-test.c
+ * @brief Userspace model of the driver's lockless readers, checked with many threads
+ *
+ * Writer threads, serialized by a mutex as the driver's writers are by nextLine_mutex,
+ * add lines while reader threads look them up without a lock, the way aesd_read_iter,
+ * aesd_llseek and aesd_ioctl do.  Every byte stored is a function of how many bytes
+ * were added before it, so a reader can tell from the bytes alone whether its snapshot
+ * was consistent.  Runs the kmalloc storage mode, where dropped lines are only freed
+ * once readers are done (here, at the end), and the arena mode, where a writer reuses a
+ * dropped line's bytes at once.  Exits non-zero if any reader saw a torn result.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aesd-circular-buffer.h"
+
+#define WRITERS 2
+#define READERS 8
+#define LINES_PER_WRITER (1u << 18)
+#define CAPACITY 10
+#define MAX_LINE_SIZE 64
+#define ARENA_SIZE 1024
+
+struct model
+{
+    struct aesd_circular_buffer buffer;
+    bool arena; // lines live in arenaData, else each is malloc'd
+    char arenaData[ARENA_SIZE];
+    const char **retired; // dropped malloc'd lines, freed once readers are done
+    size_t retiredCount;
+    pthread_mutex_t writerMutex;
+    bool writersDone;
+    uint64_t reads;
+    uint64_t retries;
+    uint64_t failures;
+};
+
+// xorshift, seeded per thread
+static uint32_t next_random(uint32_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+// the byte stored at @param offset, when it is not the end of its line
+static char expected_byte(uint64_t offset)
+{
+    return 'a' + offset % 26;
+}
+
+static void fail(struct model *model, const char *what, uint64_t offset)
+{
+    if(__atomic_fetch_add(&model->failures, 1, __ATOMIC_RELAXED) < 10){
+        fprintf(stderr, "%s mode: %s at offset %llu\n", model->arena ? "arena" : "kmalloc",
+                what, (unsigned long long)offset);
+    }
+}
+
+static void write_line(struct model *model, size_t size)
+{
+    struct aesd_buffer_entry entry;
+    const uint64_t start = model->buffer.end_offs;
+    const char *dropped;
+    char *line;
+    size_t i;
+
+    if(!model->arena){
+        line = malloc(size);
+        for(i = 0; i + 1 < size; ++i){
+            line[i] = expected_byte(start + i);
+        }
+        line[size - 1] = '\n';
+        entry.buffptr = line;
+        entry.size = size;
+        dropped = aesd_circular_buffer_add_entry(&model->buffer, &entry);
+        if(dropped != NULL){
+            model->retired[model->retiredCount++] = dropped;
+        }
+        return;
+    }
+
+    // as aesd_write_arena: drop lines until there's room, then overwrite their bytes
+    while(aesd_circular_buffer_size(&model->buffer) + size > ARENA_SIZE){
+        aesd_circular_buffer_remove_entry(&model->buffer);
+    }
+    aesd_smp_wmb();
+    for(i = 0; i < size; ++i){
+        AESD_WRITE_ONCE(model->arenaData[(start + i) % ARENA_SIZE], i + 1 < size ? expected_byte(start + i) : '\n');
+    }
+    entry.buffptr = &model->arenaData[start % ARENA_SIZE];
+    entry.size = size;
+    aesd_circular_buffer_add_entry(&model->buffer, &entry);
+}
+
+static void *writer(void *arg)
+{
+    struct model *model = arg;
+    uint32_t random = 2463534242u ^ (uint32_t)(uintptr_t)&random;
+    uint32_t i;
+
+    for(i = 0; i < LINES_PER_WRITER; ++i){
+        const size_t size = next_random(&random) % MAX_LINE_SIZE + 1;
+        pthread_mutex_lock(&model->writerMutex);
+        write_line(model, size);
+        pthread_mutex_unlock(&model->writerMutex);
+    }
+    return NULL;
+}
+
+// as aesd_read_iter: look up the bytes at fpos, copy them, and check the copy
+static void read_fpos(struct model *model, size_t fpos)
+{
+    static __thread char copy[ARENA_SIZE];
+    struct aesd_buffer_entry span;
+    uint64_t spanStart;
+    uint64_t endOffs;
+    uint32_t sequence;
+    bool found;
+    size_t i;
+
+    for(;;){
+        do{
+            sequence = aesd_circular_buffer_read_begin(&model->buffer);
+            found = aesd_circular_buffer_read_span(&model->buffer, fpos, &span, &spanStart);
+            endOffs = AESD_READ_ONCE(model->buffer.end_offs);
+        }while(aesd_circular_buffer_read_retry(&model->buffer, sequence) &&
+               (__atomic_fetch_add(&model->retries, 1, __ATOMIC_RELAXED), true));
+        if(!found){
+            return;
+        }
+        if(!model->arena){
+            // lines never change once added, and aren't freed while we might hold them
+            memcpy(copy, span.buffptr, span.size);
+            break;
+        }
+        span.size = endOffs - spanStart;
+        if(span.size > ARENA_SIZE){
+            fail(model, "span larger than the arena", spanStart);
+            return;
+        }
+        for(i = 0; i < span.size; ++i){
+            copy[i] = AESD_READ_ONCE(model->arenaData[(spanStart + i) % ARENA_SIZE]);
+        }
+        if(aesd_circular_buffer_still_holds(&model->buffer, spanStart)){
+            break;
+        }
+        __atomic_fetch_add(&model->retries, 1, __ATOMIC_RELAXED);
+    }
+
+    if(span.size == 0 || copy[span.size - 1] != '\n'){
+        fail(model, "span does not end a line", spanStart);
+        return;
+    }
+    for(i = 0; i + 1 < span.size; ++i){
+        if(copy[i] != '\n' && copy[i] != expected_byte(spanStart + i)){
+            fail(model, "wrong byte", spanStart + i);
+            return;
+        }
+    }
+}
+
+// as aesd_ioctl: look up where a command starts, and check it agrees with the fpos lookup
+static void read_command(struct model *model, uint32_t command)
+{
+    struct aesd_buffer_entry *entryptr;
+    struct aesd_buffer_entry entry;
+    struct aesd_buffer_entry span;
+    uint64_t spanStart;
+    size_t offset = 0;
+    uint32_t sequence;
+    bool found;
+
+    do{
+        sequence = aesd_circular_buffer_read_begin(&model->buffer);
+        entryptr = aesd_circular_buffer_find_entry_for_command(&model->buffer, command, &offset);
+        if(entryptr != NULL){
+            entry.buffptr = AESD_READ_ONCE(entryptr->buffptr);
+            entry.size = AESD_READ_ONCE(entryptr->size);
+            found = aesd_circular_buffer_read_span(&model->buffer, offset, &span, &spanStart);
+        }
+    }while(aesd_circular_buffer_read_retry(&model->buffer, sequence) &&
+           (__atomic_fetch_add(&model->retries, 1, __ATOMIC_RELAXED), true));
+
+    if(entryptr == NULL){
+        return;
+    }
+    if(!found || span.buffptr != entry.buffptr || span.size != entry.size){
+        fail(model, "command start is not an entry start", offset);
+    }
+}
+
+static void *reader(void *arg)
+{
+    struct model *model = arg;
+    uint32_t random = 2463534242u ^ (uint32_t)(uintptr_t)&random;
+    uint32_t sequence;
+    size_t size;
+
+    while(!__atomic_load_n(&model->writersDone, __ATOMIC_ACQUIRE)){
+        // as aesd_llseek
+        do{
+            sequence = aesd_circular_buffer_read_begin(&model->buffer);
+            size = aesd_circular_buffer_size(&model->buffer);
+        }while(aesd_circular_buffer_read_retry(&model->buffer, sequence));
+        if(size > (model->arena ? ARENA_SIZE : (size_t)CAPACITY * MAX_LINE_SIZE)){
+            fail(model, "size too large", size);
+        }
+
+        read_fpos(model, next_random(&random) % (size + 1));
+        read_command(model, next_random(&random) % (CAPACITY + 1));
+        __atomic_fetch_add(&model->reads, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+static int run(bool arena)
+{
+    static struct model model;
+    pthread_t writers[WRITERS];
+    pthread_t readers[READERS];
+    uint32_t index;
+    struct aesd_buffer_entry *entryptr;
+    int i;
+
+    memset(&model, 0, sizeof(model));
+    model.arena = arena;
+    pthread_mutex_init(&model.writerMutex, NULL);
+    if(aesd_circular_buffer_init(&model.buffer, CAPACITY) != 0){
+        fprintf(stderr, "Could not create a buffer of %u entries\n", CAPACITY);
+        return EXIT_FAILURE;
+    }
+    if(!arena){
+        model.retired = calloc((size_t)WRITERS * LINES_PER_WRITER, sizeof(*model.retired));
+    }
+
+    for(i = 0; i < READERS; ++i){
+        pthread_create(&readers[i], NULL, reader, &model);
+    }
+    for(i = 0; i < WRITERS; ++i){
+        pthread_create(&writers[i], NULL, writer, &model);
+    }
+    for(i = 0; i < WRITERS; ++i){
+        pthread_join(writers[i], NULL);
+    }
+    __atomic_store_n(&model.writersDone, true, __ATOMIC_RELEASE);
+    for(i = 0; i < READERS; ++i){
+        pthread_join(readers[i], NULL);
+    }
+
+    printf("%7s: %u writers added %u lines, %u readers did %llu reads with %llu retries, %llu failures\n",
+           arena ? "arena" : "kmalloc", WRITERS, WRITERS * LINES_PER_WRITER, READERS,
+           (unsigned long long)model.reads, (unsigned long long)model.retries,
+           (unsigned long long)model.failures);
+
+    if(!arena){
+        for(index = 0; index < model.retiredCount; ++index){
+            free((char *)model.retired[index]);
+        }
+        free(model.retired);
+        AESD_CIRCULAR_BUFFER_FOREACH(entryptr, &model.buffer, index){
+            free((char *)entryptr->buffptr);
+        }
+    }
+    aesd_circular_buffer_destroy(&model.buffer);
+    pthread_mutex_destroy(&model.writerMutex);
+    return model.failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main(void)
+{
+    const int kmallocResult = run(false);
+    const int arenaResult = run(true);
+    return kmallocResult == EXIT_SUCCESS && arenaResult == EXIT_SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -9,14 +9,131 @@
  */
 
 #ifdef __KERNEL__
+#include <linux/errno.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
 #include <linux/string.h>
+#define AESD_ALLOC_ARRAY(count, size) kvcalloc((count), (size), GFP_KERNEL)
+#define AESD_FREE_ARRAY(array) kvfree(array)
 #else
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
 #include <string.h>
+#define AESD_ALLOC_ARRAY(count, size) calloc((count), (size))
+#define AESD_FREE_ARRAY(array) free(array)
 #endif
 
 #include "aesd-circular-buffer.h"
 
-#define AESD_BUFFER_INCREMENT(x) ((x) = (((x) + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED))
+#define AESD_BUFFER_NEXT(buffer, x) (((x) + 1) & (buffer)->mask)
+
+/*
+ * Every function reading the buffer may run without a lock, between read_begin and
+ * read_retry: fields are read once, indexes stay masked and loops are bounded, so a
+ * snapshot torn by a concurrent writer only ever gives a wrong answer, which read_retry
+ * then throws away.  Writers store with AESD_WRITE_ONCE between write_begin and write_end.
+ */
+
+#ifdef __KERNEL__
+static void aesd_circular_buffer_write_begin(struct aesd_circular_buffer *buffer)
+{
+    write_seqcount_begin(&buffer->sequence);
+}
+
+static void aesd_circular_buffer_write_end(struct aesd_circular_buffer *buffer)
+{
+    write_seqcount_end(&buffer->sequence);
+}
+#else
+// the same protocol as the kernel's seqcount, for the userspace model test
+static void aesd_circular_buffer_write_begin(struct aesd_circular_buffer *buffer)
+{
+    AESD_WRITE_ONCE(buffer->sequence, buffer->sequence + 1);
+    aesd_smp_wmb();
+}
+
+static void aesd_circular_buffer_write_end(struct aesd_circular_buffer *buffer)
+{
+    aesd_smp_wmb();
+    AESD_WRITE_ONCE(buffer->sequence, buffer->sequence + 1);
+}
+#endif
+
+/**
+ * Starts a lockless read of @param buffer, waiting out a write in progress.
+ * @return the sequence to pass aesd_circular_buffer_read_retry once done reading
+ */
+uint32_t aesd_circular_buffer_read_begin(const struct aesd_circular_buffer *buffer)
+{
+#ifdef __KERNEL__
+    // the seqcount macros want it writable, they don't write through it
+    return read_seqcount_begin(&((struct aesd_circular_buffer *)buffer)->sequence);
+#else
+    uint32_t sequence;
+    while((sequence = AESD_READ_ONCE(buffer->sequence)) & 1){
+        sched_yield();
+    }
+    aesd_smp_rmb();
+    return sequence;
+#endif
+}
+
+/**
+ * @return whether a writer changed @param buffer since aesd_circular_buffer_read_begin returned
+ * @param sequence, in which case everything read since must be read again
+ */
+bool aesd_circular_buffer_read_retry(const struct aesd_circular_buffer *buffer, uint32_t sequence)
+{
+#ifdef __KERNEL__
+    return read_seqcount_retry(&((struct aesd_circular_buffer *)buffer)->sequence, sequence);
+#else
+    aesd_smp_rmb();
+    return AESD_READ_ONCE(buffer->sequence) != sequence;
+#endif
+}
+
+#ifdef __KERNEL__
+/**
+ * Ties the sequence count of @param buffer to @param lock, the mutex every writer holds, so
+ * lockdep can check it.  Call after aesd_circular_buffer_init, before the first write
+ */
+void aesd_circular_buffer_set_writer_lock(struct aesd_circular_buffer *buffer, struct mutex *lock)
+{
+    seqcount_mutex_init(&buffer->sequence, lock);
+}
+#endif
+
+/**
+ * @return the entry array index of the @param command th oldest entry, command < count
+ */
+static inline uint32_t aesd_circular_buffer_slot(const struct aesd_circular_buffer *buffer, uint32_t command)
+{
+    return (AESD_READ_ONCE(buffer->out_offs) + command) & buffer->mask;
+}
+
+/**
+ * @return the number of entries in @param buffer.  Any necessary locking must be performed by caller.
+ */
+uint32_t aesd_circular_buffer_count(const struct aesd_circular_buffer *buffer)
+{
+    if(AESD_READ_ONCE(buffer->full)){
+        return buffer->limit;
+    }
+    return (AESD_READ_ONCE(buffer->in_offs) - AESD_READ_ONCE(buffer->out_offs)) & buffer->mask;
+}
+
+/**
+ * @return the total size of every entry in @param buffer, in O(1).  Any necessary locking must be
+ * performed by caller.
+ */
+size_t aesd_circular_buffer_size(const struct aesd_circular_buffer *buffer)
+{
+    if(aesd_circular_buffer_count(buffer) == 0){
+        return 0;
+    }
+    return AESD_READ_ONCE(buffer->end_offs) - AESD_READ_ONCE(buffer->start_offs[aesd_circular_buffer_slot(buffer, 0)]);
+}
 
 /**
  * @param buffer the buffer to search for corresponding offset.  Any necessary locking must be performed by caller.
@@ -27,57 +144,217 @@
  *      in aesd_buffer.
  * @return the struct aesd_buffer_entry structure representing the position described by char_offset, or
  * NULL if this position is not available in the buffer (not enough data is written).
+ * Binary searches the running total of entry sizes, O(log n) in the entry count.
  */
 struct aesd_buffer_entry *  aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn )
 {
-    size_t currBlockOffset = buffer->out_offs;
-    const size_t numBlocksToSearch = buffer->full ? 
-        AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED : 
-        (buffer->in_offs + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - buffer->out_offs) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; // avoid negative modulus shenannigans
-    size_t blocksSearched = 0;
-    while(char_offset >= buffer->entry[currBlockOffset].size && blocksSearched < numBlocksToSearch){
-        char_offset -= buffer->entry[currBlockOffset].size;
-        AESD_BUFFER_INCREMENT(currBlockOffset);
-        ++blocksSearched;
+    uint32_t low = 0;
+    uint32_t high = aesd_circular_buffer_count(buffer);
+    uint64_t target;
+    uint32_t slot;
+
+    if(char_offset >= aesd_circular_buffer_size(buffer)){
+        return NULL; // past the filled-in blocks
+    }
+    target = AESD_READ_ONCE(buffer->start_offs[aesd_circular_buffer_slot(buffer, 0)]) + char_offset;
+
+    // find the last entry starting at or before target; entry 0 always does
+    while(high - low > 1){
+        const uint32_t middle = low + (high - low) / 2;
+        if(AESD_READ_ONCE(buffer->start_offs[aesd_circular_buffer_slot(buffer, middle)]) <= target){
+            low = middle;
+        }else{
+            high = middle;
+        }
     }
 
-    if(blocksSearched >= numBlocksToSearch){
-        return NULL; // Exhausted filled-in blocks
+    slot = aesd_circular_buffer_slot(buffer, low);
+    *entry_offset_byte_rtn = target - AESD_READ_ONCE(buffer->start_offs[slot]); // Amount of counting into the current block
+    return &(buffer->entry[slot]);
+}
+
+/**
+ * Lockless lookup of the bytes at @param char_offset, as for
+ * aesd_circular_buffer_find_entry_offset_for_fpos, copied out so they can be kept after
+ * aesd_circular_buffer_read_retry.  Only use the results once it says no.
+ * @param span_rtn set to the bytes from char_offset to the end of their entry
+ * @param span_start_rtn set to the number of bytes added before char_offset since init
+ * @return false if this position is not available in the buffer
+ */
+bool aesd_circular_buffer_read_span(const struct aesd_circular_buffer *buffer, size_t char_offset,
+            struct aesd_buffer_entry *span_rtn, uint64_t *span_start_rtn)
+{
+    size_t entryOffset = 0;
+    struct aesd_buffer_entry *entryptr = aesd_circular_buffer_find_entry_offset_for_fpos(
+            (struct aesd_circular_buffer *)buffer, char_offset, &entryOffset);
+    if(entryptr == NULL){
+        return false;
+    }
+    span_rtn->buffptr = AESD_READ_ONCE(entryptr->buffptr) + entryOffset;
+    span_rtn->size = AESD_READ_ONCE(entryptr->size) - entryOffset;
+    *span_start_rtn = AESD_READ_ONCE(buffer->start_offs[entryptr - buffer->entry]) + entryOffset;
+    return true;
+}
+
+/**
+ * For storage a writer reuses as soon as it drops an entry: after copying bytes out of it
+ * locklessly, checks they were not dropped, and so maybe overwritten, before the copy finished.
+ * @param offset the number of bytes added before the first one copied, since init
+ * @return true if every byte from offset on is still in @param buffer
+ */
+bool aesd_circular_buffer_still_holds(const struct aesd_circular_buffer *buffer, uint64_t offset)
+{
+    uint32_t sequence;
+    uint64_t first;
+    // the copy's loads come before the check's, pairs with the writer's barrier before it reuses bytes
+    aesd_smp_rmb();
+    do{
+        sequence = aesd_circular_buffer_read_begin(buffer);
+        first = AESD_READ_ONCE(buffer->end_offs) - aesd_circular_buffer_size(buffer);
+    }while(aesd_circular_buffer_read_retry(buffer, sequence));
+    return first <= offset;
+}
+
+/**
+ * @param buffer the buffer to look in.  Any necessary locking must be performed by caller.
+ * @param command the zero referenced write command, counted from the oldest entry
+ * @param entry_char_offset_rtn set to the character index the command starts at, as for
+ *      aesd_circular_buffer_find_entry_offset_for_fpos, when the command is found
+ * @return the entry for the command in O(1), or NULL if the buffer holds fewer commands
+ */
+struct aesd_buffer_entry *aesd_circular_buffer_find_entry_for_command(struct aesd_circular_buffer *buffer,
+            uint32_t command, size_t *entry_char_offset_rtn)
+{
+    uint32_t slot;
+    if(command >= aesd_circular_buffer_count(buffer)){
+        return NULL;
     }
+    slot = aesd_circular_buffer_slot(buffer, command);
+    *entry_char_offset_rtn = AESD_READ_ONCE(buffer->start_offs[slot]) -
+        AESD_READ_ONCE(buffer->start_offs[aesd_circular_buffer_slot(buffer, 0)]);
+    return &(buffer->entry[slot]);
+}
 
-    *entry_offset_byte_rtn = char_offset; // Amount of counting into the current block 
-    return &(buffer->entry[currBlockOffset]);
+/**
+ * @param buffer the buffer @param entry is in.  Any necessary locking must be performed by caller.
+ * @param entry an entry returned by one of the find functions
+ * @return the entry written after @param entry, or NULL if it is the newest
+ */
+struct aesd_buffer_entry *aesd_circular_buffer_next_entry(struct aesd_circular_buffer *buffer,
+            const struct aesd_buffer_entry *entry)
+{
+    const uint32_t slot = AESD_BUFFER_NEXT(buffer, entry - buffer->entry);
+    // the newest entry sits just before in_offs, whether or not the buffer is full
+    if(slot == AESD_READ_ONCE(buffer->in_offs)){
+        return NULL;
+    }
+    return &(buffer->entry[slot]);
 }
 
 /**
 * Adds entry @param add_entry to @param buffer in the location specified in buffer->in_offs.
-* If the buffer was already full, overwrites the oldest entry and advances buffer->out_offs to the
-* new start location.
-* Any necessary locking must be handled by the caller
+* If the buffer already held limit entries, drops the oldest and advances buffer->out_offs to
+* the new start location.
+* Writers must be serialized by the caller, readers need no lock
 * Any memory referenced in @param add_entry must be allocated by and/or must have a lifetime managed by the caller.
+* A lockless reader may still be using the returned data, free it only once they are done.
 */
 const char* aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
 {
-    const char* possibly_erased_data = buffer->entry[buffer->in_offs].buffptr;
-    buffer->entry[buffer->in_offs] = *add_entry;
-    AESD_BUFFER_INCREMENT(buffer->in_offs);
-    if(buffer->in_offs == buffer->out_offs && !(buffer->full)){
-        buffer->full = true;
+    const uint32_t in = buffer->in_offs;
+    const uint32_t out = buffer->out_offs;
+    const bool was_full = buffer->full;
+    const char* possibly_erased_data = was_full ? buffer->entry[out].buffptr : NULL;
+
+    aesd_circular_buffer_write_begin(buffer);
+    if(was_full){
+        // below the capacity the dropped slot isn't the one written next: clear it, so a
+        // later AESD_CIRCULAR_BUFFER_FOREACH doesn't see it
+        AESD_WRITE_ONCE(buffer->entry[out].buffptr, NULL);
+        AESD_WRITE_ONCE(buffer->entry[out].size, 0);
+        AESD_WRITE_ONCE(buffer->out_offs, AESD_BUFFER_NEXT(buffer, out));
+    }
+    AESD_WRITE_ONCE(buffer->entry[in].buffptr, add_entry->buffptr);
+    AESD_WRITE_ONCE(buffer->entry[in].size, add_entry->size);
+    AESD_WRITE_ONCE(buffer->start_offs[in], buffer->end_offs);
+    AESD_WRITE_ONCE(buffer->end_offs, buffer->end_offs + add_entry->size);
+    AESD_WRITE_ONCE(buffer->in_offs, AESD_BUFFER_NEXT(buffer, in));
+    if(!was_full && ((buffer->in_offs - buffer->out_offs) & buffer->mask) == (buffer->limit & buffer->mask)){
         // we just became full, but didn't overwrite yet
-    }else if(buffer->full){
-        AESD_BUFFER_INCREMENT(buffer->out_offs);
-        // we just overwrote data
-        return possibly_erased_data;
+        AESD_WRITE_ONCE(buffer->full, true);
+    }
+    aesd_circular_buffer_write_end(buffer);
+
+    // if we were full we just overwrote data, otherwise no overwrite occured
+    return possibly_erased_data;
+}
+
+/**
+* Drops the oldest entry of @param buffer, to make room for data stored outside it.
+* Writers must be serialized by the caller, readers need no lock
+* @return the dropped entry's buffptr, for the caller to release once lockless readers are done
+* with it, or NULL if the buffer is empty
+*/
+const char* aesd_circular_buffer_remove_entry(struct aesd_circular_buffer *buffer)
+{
+    const uint32_t out = buffer->out_offs;
+    const char* removed_data;
+    if(aesd_circular_buffer_count(buffer) == 0){
+        return NULL;
+    }
+    removed_data = buffer->entry[out].buffptr;
+    aesd_circular_buffer_write_begin(buffer);
+    // cleared so a later AESD_CIRCULAR_BUFFER_FOREACH doesn't see it twice
+    AESD_WRITE_ONCE(buffer->entry[out].buffptr, NULL);
+    AESD_WRITE_ONCE(buffer->entry[out].size, 0);
+    AESD_WRITE_ONCE(buffer->out_offs, AESD_BUFFER_NEXT(buffer, out));
+    AESD_WRITE_ONCE(buffer->full, false);
+    aesd_circular_buffer_write_end(buffer);
+    return removed_data;
+}
+
+/**
+* Initializes the circular buffer described by @param buffer to an empty buffer keeping
+* @param capacity entries.  The entry array is rounded up to a power of two, so offsets wrap
+* with a mask, but only capacity entries are ever kept.
+* Pass AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED for the default size.
+* @return 0 on success, -EINVAL for a capacity of 0 or above AESDCHAR_MAX_CAPACITY,
+* -ENOMEM if the entries could not be allocated
+*/
+int aesd_circular_buffer_init(struct aesd_circular_buffer *buffer, uint32_t capacity)
+{
+    uint32_t rounded = 1;
+    memset(buffer,0,sizeof(struct aesd_circular_buffer));
+    if(capacity == 0 || capacity > AESDCHAR_MAX_CAPACITY){
+        return -EINVAL;
+    }
+    while(rounded < capacity){
+        rounded <<= 1;
+    }
+
+    buffer->entry = AESD_ALLOC_ARRAY(rounded, sizeof(*buffer->entry));
+    buffer->start_offs = AESD_ALLOC_ARRAY(rounded, sizeof(*buffer->start_offs));
+    if(buffer->entry == NULL || buffer->start_offs == NULL){
+        AESD_FREE_ARRAY(buffer->entry);
+        AESD_FREE_ARRAY(buffer->start_offs);
+        buffer->entry = NULL;
+        buffer->start_offs = NULL;
+        return -ENOMEM;
     }
-    // no overwrite occured
-    return NULL;
+    buffer->limit = capacity;
+    buffer->capacity = rounded;
+    buffer->mask = rounded - 1;
+    return 0;
 }
 
 /**
-* Initializes the circular buffer described by @param buffer to an empty struct
+* Releases the entry arrays of @param buffer, leaving it empty with no capacity.
+* The memory the entries point to is the caller's, free it first
 */
-void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
+void aesd_circular_buffer_destroy(struct aesd_circular_buffer *buffer)
 {
+    AESD_FREE_ARRAY(buffer->entry);
+    AESD_FREE_ARRAY(buffer->start_offs);
     memset(buffer,0,sizeof(struct aesd_circular_buffer));
 }
@@ -10,13 +10,32 @@
 
 #ifdef __KERNEL__
 #include <linux/types.h>
+#include <linux/compiler.h>
+#include <linux/mutex.h>
+#include <linux/seqlock.h>
+#include <asm/barrier.h>
+#define AESD_READ_ONCE(x) READ_ONCE(x)
+#define AESD_WRITE_ONCE(x, value) WRITE_ONCE(x, value)
+#define aesd_smp_rmb() smp_rmb()
+#define aesd_smp_wmb() smp_wmb()
 #else
 #include <stddef.h> // size_t
 #include <stdint.h> // uintx_t
 #include <stdbool.h>
+#define AESD_READ_ONCE(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define AESD_WRITE_ONCE(x, value) __atomic_store_n(&(x), (value), __ATOMIC_RELAXED)
+#define aesd_smp_rmb() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define aesd_smp_wmb() __atomic_thread_fence(__ATOMIC_RELEASE)
 #endif
 
+/**
+ * Default number of write operations kept, when no capacity is chosen at init
+ */
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+/**
+ * Largest capacity aesd_circular_buffer_init accepts
+ */
+#define AESDCHAR_MAX_CAPACITY (1u << 24)
 
 struct aesd_buffer_entry
 {
@@ -33,22 +52,55 @@ struct aesd_buffer_entry
 struct aesd_circular_buffer
 {
     /**
-     * An array of pointers to memory allocated for the most recent write operations
+     * An array of pointers to memory allocated for the most recent write operations,
+     * capacity entries long
+     */
+    struct aesd_buffer_entry *entry;
+    /**
+     * Running total of entry sizes: start_offs[i] is the number of bytes added before
+     * entry[i] since init, capacity entries long.  Increases from out_offs onwards, so
+     * the char offset of an entry is its start_offs less the oldest entry's
+     */
+    uint64_t *start_offs;
+    /**
+     * Bytes added since init, the start_offs the next write will get
      */
-    struct aesd_buffer_entry  entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    uint64_t end_offs;
+    /**
+     * Number of entries kept before the oldest is overwritten, as asked for at init
+     */
+    uint32_t limit;
+    /**
+     * Number of entries in the entry array, limit rounded up to a power of two
+     */
+    uint32_t capacity;
+    /**
+     * capacity - 1, wraps an index into the entry array
+     */
+    uint32_t mask;
     /**
      * The current location in the entry structure where the next write should
      * be stored.
      */
-    uint8_t in_offs;
+    uint32_t in_offs;
     /**
      * The first location in the entry structure to read from
      */
-    uint8_t out_offs;
+    uint32_t out_offs;
     /**
-     * set to true when the buffer entry structure is full
+     * set to true when the buffer holds limit entries
      */
     bool full;
+    /**
+     * Odd while add_entry or remove_entry is changing the buffer, bumped again when done, so
+     * lockless readers can tell their snapshot was torn and retry.  Writers still exclude
+     * each other, in the kernel with the mutex given to aesd_circular_buffer_set_writer_lock
+     */
+#ifdef __KERNEL__
+    seqcount_mutex_t sequence;
+#else
+    uint32_t sequence;
+#endif
 };
 
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
@@ -56,16 +108,43 @@ extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos
 
 extern const char* aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
 
-extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
+extern const char* aesd_circular_buffer_remove_entry(struct aesd_circular_buffer *buffer);
+
+extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_for_command(struct aesd_circular_buffer *buffer,
+            uint32_t command, size_t *entry_char_offset_rtn);
+
+extern struct aesd_buffer_entry *aesd_circular_buffer_next_entry(struct aesd_circular_buffer *buffer,
+            const struct aesd_buffer_entry *entry);
+
+extern size_t aesd_circular_buffer_size(const struct aesd_circular_buffer *buffer);
+
+extern uint32_t aesd_circular_buffer_count(const struct aesd_circular_buffer *buffer);
+
+extern uint32_t aesd_circular_buffer_read_begin(const struct aesd_circular_buffer *buffer);
+
+extern bool aesd_circular_buffer_read_retry(const struct aesd_circular_buffer *buffer, uint32_t sequence);
+
+extern bool aesd_circular_buffer_read_span(const struct aesd_circular_buffer *buffer, size_t char_offset,
+            struct aesd_buffer_entry *span_rtn, uint64_t *span_start_rtn);
+
+extern bool aesd_circular_buffer_still_holds(const struct aesd_circular_buffer *buffer, uint64_t offset);
+
+#ifdef __KERNEL__
+extern void aesd_circular_buffer_set_writer_lock(struct aesd_circular_buffer *buffer, struct mutex *lock);
+#endif
+
+extern int aesd_circular_buffer_init(struct aesd_circular_buffer *buffer, uint32_t capacity);
+
+extern void aesd_circular_buffer_destroy(struct aesd_circular_buffer *buffer);
 
 /**
  * Create a for loop to iterate over each member of the circular buffer.
  * Useful when you've allocated memory for circular buffer entries and need to free it
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is a uint32_t stack allocated value used by this macro for an index
  * Example usage:
- * uint8_t index;
+ * uint32_t index;
  * struct aesd_circular_buffer buffer;
  * struct aesd_buffer_entry *entry;
  * AESD_CIRCULAR_BUFFER_FOREACH(entry,&buffer,index) {
@@ -74,7 +153,7 @@ extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
  */
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index) \
     for(index=0, entryptr=&((buffer)->entry[index]); \
-            index<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; \
+            index<(buffer)->capacity; \
             index++, entryptr=&((buffer)->entry[index]))
 
 
@@ -8,9 +8,11 @@
 #ifndef AESD_CHAR_DRIVER_AESDCHAR_H_
 #define AESD_CHAR_DRIVER_AESDCHAR_H_
 
+#include "aesd-arena.h"
 #include "aesd-circular-buffer.h"
 #include <linux/cdev.h>
 #include <linux/mutex.h>
+#include <linux/srcu.h>
 
 // #define AESD_DEBUG 1  //Remove comment on this line to enable debug
 
@@ -33,10 +35,11 @@ struct aesd_dev
      * TODO: Add structure(s) and locks needed to complete assignment requirements
      */
     struct aesd_circular_buffer buffer;
-    struct mutex buffer_mutex;
+    struct aesd_arena arena; // holds the entries' bytes when enabled, else each is kmalloc'd
+    struct srcu_struct srcu; // readers hold it while copying kmalloc entries, writers free dropped ones after
     char* nextLine;
     size_t nextLineLength;
-    struct mutex nextLine_mutex;
+    struct mutex nextLine_mutex; // serializes writers, which are also the only ones changing buffer
     struct cdev cdev;     /* Char device structure      */
 };
 
@@ -12,15 +12,20 @@
  */
 
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/init.h>
 #include <linux/printk.h>
 #include <linux/types.h>
 #include <linux/cdev.h>
 #include <linux/fs.h> // file_operations
 #include <linux/mutex.h>
+#include <linux/pagemap.h> // fault_in_readable
 #include <linux/slab.h>
+#include <linux/srcu.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
 
+#include "aesd-arena.h"
 #include "aesd-circular-buffer.h"
 #include "aesd_ioctl.h"
 #include "aesdchar.h"
@@ -28,12 +33,66 @@
 #include "asm/uaccess.h"
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
+// write commands kept
+static uint aesd_max_entries = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+module_param(aesd_max_entries, uint, 0444);
+MODULE_PARM_DESC(aesd_max_entries, "Write commands kept before the oldest is dropped");
+// bytes in the write arena, 0 to kmalloc each write instead
+static ulong aesd_arena_bytes = 0;
+module_param(aesd_arena_bytes, ulong, 0444);
+MODULE_PARM_DESC(aesd_arena_bytes, "Store writes in one preallocated ring of this many bytes, rounded up to a power of two, instead of an allocation each (0 for off)");
 
 MODULE_AUTHOR("Ben Nowotny"); /** TODO: fill in your name **/
 MODULE_LICENSE("Dual BSD/GPL");
 
 struct aesd_dev aesd_device;
 
+// a kmalloc'd write, with room to free it once lockless readers are done with it
+struct aesd_line
+{
+    struct rcu_head rcu;
+    char data[];
+};
+
+static struct aesd_line *aesd_line_of(const char *data)
+{
+    return (struct aesd_line *)(data - offsetof(struct aesd_line, data));
+}
+
+static char *aesd_line_alloc(size_t size)
+{
+    struct aesd_line *line = kmalloc(sizeof(struct aesd_line) + size, GFP_KERNEL);
+    return line == NULL ? NULL : line->data;
+}
+
+static char *aesd_line_realloc(char *data, size_t size)
+{
+    struct aesd_line *line = krealloc(data == NULL ? NULL : aesd_line_of(data),
+            sizeof(struct aesd_line) + size, GFP_KERNEL);
+    return line == NULL ? NULL : line->data;
+}
+
+// for lines no reader can have found
+static void aesd_line_free(const char *data)
+{
+    if(data != NULL){
+        kfree(aesd_line_of(data));
+    }
+}
+
+static void aesd_line_free_rcu(struct rcu_head *head)
+{
+    kfree(container_of(head, struct aesd_line, rcu));
+}
+
+// for lines dropped from the buffer: a reader may still be copying one, free it after them
+static void aesd_line_retire(struct aesd_dev *device, const char *data)
+{
+    if(data != NULL){
+        call_srcu(&device->srcu, &aesd_line_of(data)->rcu, aesd_line_free_rcu);
+    }
+}
+
 int aesd_open(struct inode *inode, struct file *filp)
 {
     struct aesd_dev* devicePtr;
@@ -57,58 +116,69 @@ int aesd_release(struct inode *inode, struct file *filp)
     return 0;
 }
 
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
-    ssize_t retval = -EINVAL;
-    struct aesd_buffer_entry *datablk = NULL;
-    size_t strOffset = 0;
+    ssize_t retval = 0;
+    struct aesd_buffer_entry span;
+    uint64_t spanStart = 0;
+    uint64_t endOffs = 0;
+    uint32_t sequence;
+    bool found;
+    int srcuIndex;
     struct aesd_dev* device;
-    PDEBUG("read %zu bytes with offset %lld",count,*f_pos);
-    /**
-     * TODO: handle read
-     */
+    PDEBUG("read %zu bytes with offset %lld",iov_iter_count(to),iocb->ki_pos);
 
     // extract device from the file pointer
-    device = (struct aesd_dev*) (filp->private_data);
-
-    // exit early if invalid memory is used
-    if(!access_ok(buf, count)){
-        retval = -EINVAL;
-        goto exit;
-    }
-
-    // reading from buffer - lock buffer mutex
-    if(mutex_lock_interruptible(&device->buffer_mutex) != 0){
-        retval = -EINTR;
-        goto exit;
-    }
+    device = (struct aesd_dev*) (iocb->ki_filp->private_data);
+
+    // no lock: find the bytes in a consistent snapshot of the buffer, retrying if a writer
+    // got in the way, then copy them.  Holding srcu keeps dropped kmalloc entries around
+    // until the copy is done
+    srcuIndex = srcu_read_lock(&device->srcu);
+
+    // copy from the entry holding the first byte onwards, until the user buffers are
+    // full or the newest entry is done, one call for the lot
+    while(iov_iter_count(to) > 0){
+        size_t wanted;
+        size_t copied;
+
+        do{
+            sequence = aesd_circular_buffer_read_begin(&device->buffer);
+            found = aesd_circular_buffer_read_span(&device->buffer, iocb->ki_pos + retval, &span, &spanStart);
+            endOffs = AESD_READ_ONCE(device->buffer.end_offs);
+        }while(aesd_circular_buffer_read_retry(&device->buffer, sequence));
+        if(!found){
+            break;
+        }
 
-    // read the datablock from the buffer
-    datablk = aesd_circular_buffer_find_entry_offset_for_fpos(&device->buffer, *f_pos, &strOffset);
-    PDEBUG("blk is %p", datablk);
-    if(datablk == NULL){
-        // not enough data in the buffer for this read
-        retval = 0;
-        goto unlock_bufferMtx;
+        // arena entries sit back to back in one mapping, the rest of the log is one span
+        if(aesd_arena_enabled(&device->arena)){
+            span.size = endOffs - spanStart;
+        }
+        wanted = min(span.size, iov_iter_count(to));
+        copied = copy_to_iter(span.buffptr, wanted, to);
+        if(aesd_arena_enabled(&device->arena) && !aesd_circular_buffer_still_holds(&device->buffer, spanStart)){
+            // a writer dropped these bytes and may have reused them mid-copy, and the
+            // position now names other bytes: take it back and look again
+            iov_iter_revert(to, copied);
+            continue;
+        }
+        retval += copied;
+        if(copied < wanted){
+            // faulted on the user buffer, report what did make it
+            if(retval == 0){
+                retval = -EFAULT;
+            }
+            break;
+        }
     }
 
-    // calculate the size of the read based off the count and the data available
-    retval = (datablk->size - strOffset) > count ? count : (datablk->size - strOffset);
-    *f_pos += retval;
-    PDEBUG("reading out %zu bytes", retval);
+    srcu_read_unlock(&device->srcu, srcuIndex);
 
-    // give the data to the user
-    if(copy_to_user(buf, datablk->buffptr + strOffset, retval) != 0){
-        retval = -EINVAL;
-        goto unlock_bufferMtx;
+    if(retval > 0){
+        iocb->ki_pos += retval;
     }
-
-    goto unlock_bufferMtx; // noop, signaling intent
-
-unlock_bufferMtx:
-    mutex_unlock(&device->buffer_mutex);
-exit:
+    PDEBUG("read out %zd bytes", retval);
     return retval;
 }
 
@@ -133,6 +203,86 @@ static void* memmem(const void* haystack, size_t haystackSize, const void* needl
     return NULL;
 }
 
+// write into the arena: the bytes go straight into the ring behind the pending partial
+// line in one copy, and a newline publishes everything pending as one entry
+static ssize_t aesd_write_arena(struct aesd_dev *device, const char __user *buf, size_t count,
+                loff_t *f_pos)
+{
+    ssize_t retval;
+    struct aesd_buffer_entry newEntry;
+    uint64_t lineStart;
+    size_t copied;
+    size_t notCopied;
+    char *dest;
+    const char *eolPtr;
+
+    if(mutex_lock_interruptible(&device->nextLine_mutex) != 0){
+        return -EINTR;
+    }
+
+    // a line has to fit the ring whole.  Take what fits behind the pending part: if it
+    // holds a newline the line fits, and the rest is the caller's next write
+    count = min(count, device->arena.size - device->nextLineLength);
+    if(count == 0){
+        // the pending part fills the ring with no newline, the line can never be stored.
+        // Drop it, so one client can't wedge the device and the next write starts afresh
+        device->nextLineLength = 0;
+        retval = -ENOSPC;
+        goto unlock_nxtLineMutex;
+    }
+
+    // only writers move the end of the stored entries, and they hold nextLine_mutex
+    lineStart = device->buffer.end_offs;
+    // the space behind the pending line belongs to no entry, readers don't look at it
+    dest = aesd_arena_at(&device->arena, lineStart + device->nextLineLength);
+
+    // fill the space no entry uses first, a fault there costs no history
+    copied = min(count, device->arena.size - aesd_circular_buffer_size(&device->buffer) -
+            device->nextLineLength);
+    notCopied = copy_from_user(dest, buf, copied);
+    if(notCopied == 0 && copied < count){
+        // the rest needs the oldest entries dropped.  Fault the bytes in first and only
+        // take those, so a bad user buffer doesn't drop entries for nothing; just another
+        // thread unmapping them before the copy below can still cost the dropped entries
+        count -= fault_in_readable(buf + copied, count - copied);
+        while(aesd_circular_buffer_size(&device->buffer) + device->nextLineLength + count > device->arena.size){
+            aesd_circular_buffer_remove_entry(&device->buffer);
+        }
+        // a reader that sees the bytes below change must also see their entries gone, and
+        // retry, pairs with the barrier in aesd_circular_buffer_still_holds
+        smp_wmb();
+        notCopied = copy_from_user(dest + copied, buf + copied, count - copied);
+        copied = count;
+    }
+    // keep what did arrive, the next write reports the fault
+    count = copied - notCopied;
+    if(count == 0){
+        retval = -EFAULT;
+        goto unlock_nxtLineMutex;
+    }
+
+    // take up to the first newline, like the kmalloc path
+    eolPtr = memchr(dest, '\n', count);
+    count = eolPtr == NULL ? count : eolPtr - dest + 1;
+    device->nextLineLength += count;
+    retval = count;
+    *f_pos += count;
+    if(eolPtr == NULL){
+        goto unlock_nxtLineMutex;
+    }
+
+    // the bytes are in place, publishing the line is just its descriptor
+    newEntry.buffptr = aesd_arena_at(&device->arena, lineStart);
+    newEntry.size = device->nextLineLength;
+    // an entry pushed out here leaves its bytes to be reused, nothing to free
+    aesd_circular_buffer_add_entry(&device->buffer, &newEntry);
+    device->nextLineLength = 0;
+
+unlock_nxtLineMutex:
+    mutex_unlock(&device->nextLine_mutex);
+    return retval;
+}
+
 ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
                 loff_t *f_pos)
 {
@@ -155,8 +305,13 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
         goto exit;
     }
 
+    if(aesd_arena_enabled(&device->arena)){
+        retval = aesd_write_arena(device, buf, count, f_pos);
+        goto exit;
+    }
+
     // take ownership of the given data
-    strBuf = kmalloc(count, GFP_KERNEL);
+    strBuf = aesd_line_alloc(count);
     if(strBuf == NULL){
         retval = -ENOMEM;
         goto exit;
@@ -188,11 +343,11 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
     }else if(eolPtr == NULL && device->nextLine != NULL){
         // We don't have a newline, but we already had a line going
         // append
-        reallocPtr = krealloc(device->nextLine, device->nextLineLength + count, GFP_KERNEL);
+        reallocPtr = aesd_line_realloc(device->nextLine, device->nextLineLength + count);
         if(reallocPtr == NULL){
             // keep the command, return failure
             retval = -ENOMEM;
-            goto unlock_nxtLineMutex;
+            goto cleanup_tmpbuffer;
         }
         device->nextLine = reallocPtr;
         memcpy(device->nextLine + device->nextLineLength, strBuf, count);
@@ -202,17 +357,11 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
     }else if(eolPtr != NULL && device->nextLine == NULL){
         // We have a newline and no previous data pending
         // skip the nextLine buffer, write straight to the buffer
-        if(mutex_lock_interruptible(&device->buffer_mutex) != 0){
-            retval = -EINTR;
-            goto cleanup_tmpbuffer;
-        }
-
         newEntry.buffptr = strBuf;
         newEntry.size = count;
         removedEntry = aesd_circular_buffer_add_entry(&device->buffer, &newEntry);
-        kfree(removedEntry);
+        aesd_line_retire(device, removedEntry);
 
-        mutex_unlock(&device->buffer_mutex);
         // exit early, don't free the buffer
         retval = count;
         *f_pos += count;
@@ -220,27 +369,21 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
     }else{
         // We have a newline and previous data
         // append the string and then steal the appended string
-        reallocPtr = krealloc(device->nextLine, device->nextLineLength + count, GFP_KERNEL);
+        reallocPtr = aesd_line_realloc(device->nextLine, device->nextLineLength + count);
         if(reallocPtr == NULL){
             // keep the command, return failure
             retval = -ENOMEM;
-            goto unlock_nxtLineMutex;
+            goto cleanup_tmpbuffer;
         }
         device->nextLine = reallocPtr;
         memcpy(device->nextLine + device->nextLineLength, strBuf, count);
         device->nextLineLength += count;
 
-        if(mutex_lock_interruptible(&device->buffer_mutex) != 0){
-            retval = -EINTR;
-            goto cleanup_tmpbuffer;
-        }
-
         newEntry.buffptr = device->nextLine;
         newEntry.size = device->nextLineLength;
         removedEntry = aesd_circular_buffer_add_entry(&device->buffer, &newEntry);
-        kfree(removedEntry);
+        aesd_line_retire(device, removedEntry);
 
-        mutex_unlock(&device->buffer_mutex);
         device->nextLine = NULL;
         device->nextLineLength = 0;
         retval = count;
@@ -250,7 +393,7 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
     goto cleanup_tmpbuffer; // noop, signifying intention
 
 cleanup_tmpbuffer:
-    kfree(strBuf);
+    aesd_line_free(strBuf);
 unlock_nxtLineMutex:
     mutex_unlock(&aesd_device.nextLine_mutex);
 exit:    
@@ -259,24 +402,18 @@ exit:
 
 loff_t aesd_llseek (struct file *fp, loff_t offset, int whence){
     int retval = -EINVAL;
-    struct aesd_buffer_entry* entryptr = NULL;
     struct aesd_dev* device = NULL;
-    int i;
     loff_t fileSize = 0;
+    uint32_t sequence;
     PDEBUG("seeking to %lld with whence %d", offset, whence);
 
     // grab the device from the file information
     device = (struct aesd_dev*)(fp->private_data);
 
-    if(mutex_lock_interruptible(&device->buffer_mutex) != 0){
-        return -EINTR;
-    }
-
-    AESD_CIRCULAR_BUFFER_FOREACH(entryptr, &device->buffer, i){
-        fileSize += entryptr->size;
-    }
-
-    mutex_unlock(&device->buffer_mutex);
+    do{
+        sequence = aesd_circular_buffer_read_begin(&device->buffer);
+        fileSize = aesd_circular_buffer_size(&device->buffer);
+    }while(aesd_circular_buffer_read_retry(&device->buffer, sequence));
 
     if(whence == SEEK_END || whence == SEEK_SET || whence == SEEK_CUR){
         switch(whence){
@@ -315,12 +452,11 @@ int aesd_fsync(struct file *fp, loff_t unused1, loff_t unused2, int datasync){
 
 long aesd_ioctl (struct file *fp, unsigned int opcode, unsigned long param){
     struct aesd_seekto command_data;
-    loff_t offset = 0;
-    size_t buffer_offset = 0;
+    size_t offset = 0;
     struct aesd_buffer_entry* entryptr;
-    int i;
+    size_t entrySize = 0;
+    uint32_t sequence;
     struct aesd_dev* device;
-    bool found_entry = false;
     PDEBUG("ioctl called with code %d", opcode);
 
     device = (struct aesd_dev*)(fp->private_data);
@@ -339,27 +475,20 @@ long aesd_ioctl (struct file *fp, unsigned int opcode, unsigned long param){
 
     PDEBUG("parsed ioctl data: cmd %d offset %d", command_data.write_cmd, command_data.write_cmd_offset);
 
-    if(mutex_lock_interruptible(&device->buffer_mutex) != 0){
-        return -EINTR;
-    }
-
-    AESD_CIRCULAR_BUFFER_FOREACH(entryptr, &device->buffer, i){
-        if(buffer_offset == command_data.write_cmd){
-            found_entry = true;
-            break;
+    do{
+        sequence = aesd_circular_buffer_read_begin(&device->buffer);
+        entryptr = aesd_circular_buffer_find_entry_for_command(&device->buffer, command_data.write_cmd, &offset);
+        if(entryptr != NULL){
+            entrySize = AESD_READ_ONCE(entryptr->size);
         }
-        offset += entryptr->size;
-        ++buffer_offset;
-    }
+    }while(aesd_circular_buffer_read_retry(&device->buffer, sequence));
 
-    mutex_unlock(&device->buffer_mutex);
-    
-    if(!found_entry){
-        // searched the whole loop without finding the entry: not enough entries
+    if(entryptr == NULL){
+        // not enough entries
         return -EINVAL;
     }
 
-    if(entryptr->size < command_data.write_cmd_offset){
+    if(entrySize < command_data.write_cmd_offset){
         // not enough bytes in requested command
         return -EINVAL;
     }
@@ -373,7 +502,7 @@ long aesd_ioctl (struct file *fp, unsigned int opcode, unsigned long param){
 
 struct file_operations aesd_fops = {
     .owner =            THIS_MODULE,
-    .read =             aesd_read,
+    .read_iter =        aesd_read_iter,
     .write =            aesd_write,
     .open =             aesd_open,
     .release =          aesd_release,
@@ -415,19 +544,39 @@ int aesd_init_module(void)
      * TODO: initialize the AESD specific portion of the device
      */
 
-    aesd_circular_buffer_init(&aesd_device.buffer);
-    mutex_init(&aesd_device.buffer_mutex);
+    result = aesd_circular_buffer_init(&aesd_device.buffer, aesd_max_entries);
+    if( result ) {
+        printk(KERN_WARNING "Can't keep %u write commands\n", aesd_max_entries);
+        goto cleanup_chrdev;
+    }
+    if( aesd_arena_bytes > 0 ) {
+        result = aesd_arena_init(&aesd_device.arena, aesd_arena_bytes);
+        if( result ) {
+            printk(KERN_WARNING "Can't allocate a %lu byte write arena\n", aesd_arena_bytes);
+            goto cleanup_buffer;
+        }
+    }
+    result = init_srcu_struct(&aesd_device.srcu);
+    if( result ) {
+        goto cleanup_buffer;
+    }
     mutex_init(&aesd_device.nextLine_mutex);
+    aesd_circular_buffer_set_writer_lock(&aesd_device.buffer, &aesd_device.nextLine_mutex);
     aesd_device.nextLine = NULL;
     aesd_device.nextLineLength = 0;
 
     result = aesd_setup_cdev(&aesd_device);
 
     if( result ) 
-        goto cleanup_chrdev;
+        goto cleanup_srcu;
 
     goto exit;
 
+cleanup_srcu:
+    cleanup_srcu_struct(&aesd_device.srcu);
+cleanup_buffer:
+    aesd_arena_destroy(&aesd_device.arena);
+    aesd_circular_buffer_destroy(&aesd_device.buffer);
 cleanup_chrdev:
     unregister_chrdev_region(dev, 1);
 exit:
@@ -436,7 +585,8 @@ exit:
 
 void aesd_cleanup_module(void)
 {
-    int _;
+    uint32_t index;
+    struct aesd_buffer_entry *entryptr;
     dev_t devno = MKDEV(aesd_major, aesd_minor);
 
     cdev_del(&aesd_device.cdev);
@@ -445,13 +595,20 @@ void aesd_cleanup_module(void)
      * TODO: cleanup AESD specific poritions here as necessary
      */
 
-    for(_ = 0; _ < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; ++_){
-        struct aesd_buffer_entry nullEntry = {.buffptr = NULL, .size = 0};
-        const char* data = aesd_circular_buffer_add_entry(&aesd_device.buffer, &nullEntry);
-        kfree(data);
+    // lines dropped while readers were about are freed once they're done
+    srcu_barrier(&aesd_device.srcu);
+    cleanup_srcu_struct(&aesd_device.srcu);
+
+    // slots never written are zeroed, aesd_line_free(NULL) is fine.  Arena entries
+    // go with the arena
+    if(!aesd_arena_enabled(&aesd_device.arena)){
+        AESD_CIRCULAR_BUFFER_FOREACH(entryptr, &aesd_device.buffer, index){
+            aesd_line_free(entryptr->buffptr);
+        }
     }
-    kfree(aesd_device.nextLine);
-    mutex_destroy(&aesd_device.buffer_mutex);
+    aesd_arena_destroy(&aesd_device.arena);
+    aesd_circular_buffer_destroy(&aesd_device.buffer);
+    aesd_line_free(aesd_device.nextLine);
     mutex_destroy(&aesd_device.nextLine_mutex);
 
     unregister_chrdev_region(devno, 1);
@@ -3,6 +3,7 @@
 #include <bits/pthreadtypes.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
@@ -18,19 +19,22 @@
 #include <syslog.h>
 #include <unistd.h>
 
+#include "async_log.h"
+#include "buffer_pool.h"
 #include "cleanup.h"
+#include "event_loop.h"
+#include "io_uring_engine.h"
+#include "metrics.h"
 #include "server_behavior.h"
+#include "server_options.h"
+#include "storage.h"
+#include "timer_service.h"
+#include "worker_pool.h"
 
 const char *SERVER_PORT = "9000";
-const int LISTEN_BACKLOG = 20; // Listen for more connections simultaneously
-// Use the device file if requested
-const char *TMP_FILE = 
-#if USE_AESD_CHAR_DEVICE
-"/dev/aesdchar"
-#else
-"/var/tmp/aesdsocket"
-#endif
-;
+
+// resolution of the periodic jobs
+#define TIMER_TICK_MS (100)
 
 /**
  * @brief Cleanup utilities only needed by the server management
@@ -38,15 +42,31 @@ const char *TMP_FILE =
 
 void cleanup_addrinfo(struct addrinfo **info) { freeaddrinfo(*info); }
 
-void cleanup_tmpfile(FILE **fp) {
-  #if USE_AESD_CHAR_DEVICE
-  #else
-  unlink(TMP_FILE);
-  #endif
-  fclose(*fp);
+void cleanup_storage(storage_t **storage) { storage_close(*storage); }
+
+void cleanup_metrics_reporter(metrics_reporter_t **reporter) {
+  metrics_reporter_stop(*reporter);
 }
 
-void cleanup_mutex(pthread_mutex_t *mutex) { pthread_mutex_destroy(mutex); }
+void cleanup_timer_service(timer_service_t **timers) {
+  timer_service_stop(*timers);
+}
+
+/**
+ * @brief Listening sockets, one unless each event loop accepts on its own
+ * SO_REUSEPORT socket
+ */
+typedef struct {
+  int *fds;
+  unsigned count;
+} listen_sockets_t;
+
+void cleanup_listen_sockets(listen_sockets_t *sockets) {
+  for (unsigned i = 0; i < sockets->count; ++i) {
+    cleanup_socket(&sockets->fds[i]);
+  }
+  free(sockets->fds);
+}
 
 struct thread_entry_t {
   pthread_t worker_thread;
@@ -60,52 +80,141 @@ void cleanup_slist(struct thread_list_head_t *head) {
   while (!SLIST_EMPTY(head)) {
     struct thread_entry_t *entry = (struct thread_entry_t *)SLIST_FIRST(head);
     SLIST_REMOVE_HEAD(head, _entry);
-    int *threadReturnCode;
-    pthread_join(entry->worker_thread, (void **)&threadReturnCode);
-    if (*threadReturnCode != EXIT_SUCCESS) {
-      syslog(LOG_ERR, "Thread ID %lu failed during processing",
+    void *threadReturnCode;
+    pthread_join(entry->worker_thread, &threadReturnCode);
+    if ((intptr_t)threadReturnCode != EXIT_SUCCESS) {
+      async_log(LOG_ERR, "Thread ID %lu failed during processing",
              entry->worker_thread);
     }
-    free(threadReturnCode);
-    free(entry);
+    buffer_pool_free(entry, sizeof(*entry));
   }
 }
 
-static sig_atomic_t signalCaught = 0;
+static volatile sig_atomic_t signalCaught = 0;
 
 void signal_handler(int signal) {
   (void)signal; // Assumed that proper signals are registered
   signalCaught = 1;
 }
 
-/// Program entrypoint
-int main(int argc, char **argv) {
+/**
+ * @brief Accept connections and hand each one to its own worker thread, until
+ * a signal is caught
+ *
+ * @return EXIT_SUCCESS when stopped by a signal, else EXIT_FAILURE
+ */
+static int serve_thread_per_connection(int socketFd,
+                                       const server_options_t *options,
+                                       storage_t *storage,
+                                       struct thread_list_head_t *threadList) {
+  // signalCaught is set on signal reception
+  while (signalCaught != 1) {
+    // Wait for a connection
+    struct sockaddr connectedAddr;
+    socklen_t addrLen = sizeof(connectedAddr);
+    // DON'T clean up the socket at this scope.  The thread lives longer, so it
+    // should do cleanup
+    const int connectionSocketFd = accept(socketFd, &connectedAddr, &addrLen);
+    // Handle the case where we catch our signal while waiting to accept a
+    // connection
+    if (connectionSocketFd == -1 && signalCaught == 0) {
+      async_log(LOG_ERR, "Error when waiting for a connection");
+      return EXIT_FAILURE;
+    } else if (signalCaught == 1) {
+      break;
+    }
+    const uint64_t acceptedAt = metrics_now();
 
-  // Open syslog
-  openlog("aesdsocket", 0, LOG_USER);
-  atexit(closelog); // Handle open logs at program exit
+    // Get client address
+    char addrString[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &(((struct sockaddr_in *)&connectedAddr)->sin_addr),
+              addrString, sizeof(connectedAddr));
+    async_log(LOG_INFO, "Accepted connection from %s", addrString);
+
+    // DON'T clean up the memory here, since we would destroy it too early
+    struct thread_entry_t *threadTrackingData =
+        buffer_pool_alloc(sizeof(struct thread_entry_t), NULL);
+    if (threadTrackingData == NULL) {
+      // out of budget, turn the client away and keep serving the others
+      server_memory_rejected(addrString);
+      cleanup_socket(&connectionSocketFd);
+      continue;
+    }
+
+    // Run the server behavior (read a line, write the file).  A connection
+    // that can't get a thread is closed, the others carry on
+    if (on_server_connection(connectionSocketFd, storage, addrString, options,
+                             &(threadTrackingData->worker_thread),
+                             &(threadTrackingData->thread_complete)) !=
+        EXIT_SUCCESS) {
+      buffer_pool_free(threadTrackingData, sizeof(struct thread_entry_t));
+      continue;
+    }
+
+    SLIST_INSERT_HEAD(threadList, threadTrackingData, _entry);
+    metrics_record(METRICS_ACCEPT, acceptedAt);
+
+    // Clean up existing threads when we make a new one.  Grab the next entry
+    // before unlinking, the current one is freed
+    struct thread_entry_t *threadEntry = SLIST_FIRST(threadList);
+    while (threadEntry != NULL) {
+      struct thread_entry_t *nextEntry = SLIST_NEXT(threadEntry, _entry);
+      if(!atomic_flag_test_and_set(&(threadEntry->thread_complete))){
+        // flag cleared on complete
+        void *threadReturnCode;
+        pthread_join(threadEntry->worker_thread, &threadReturnCode);
+        if ((intptr_t)threadReturnCode != EXIT_SUCCESS) {
+          async_log(LOG_ERR, "Thread ID %lu failed during processing",
+                threadEntry->worker_thread);
+        }
+
+        SLIST_REMOVE(threadList, threadEntry, thread_entry_t, _entry);
+        buffer_pool_free(threadEntry, sizeof(struct thread_entry_t));
+      }
+      threadEntry = nextEntry;
+    }
 
-  // Parse daemon behavior from cmdline
-  bool isDaemon = false;
-  if (argc > 1 && strcmp(argv[1], "-d") == 0) {
-    isDaemon = true;
   }
 
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Create a socket bound to SERVER_PORT, not listening yet
+ *
+ * @param reusePort let other sockets bind the same port with SO_REUSEPORT
+ * @return the socket, or -1 on error
+ */
+static int open_listen_socket(bool reusePort) {
   // Create socket
-  const int socketFd CLEANUP(cleanup_socket) = socket(AF_INET, SOCK_STREAM, 0);
+  int socketFd CLEANUP(cleanup_socket) = socket(AF_INET, SOCK_STREAM, 0);
   if (socketFd == -1) {
-    syslog(LOG_ERR, "Could not open the socket");
-    return EXIT_FAILURE;
+    async_log(LOG_ERR, "Could not open the socket");
+    return -1;
   }
 
   // Allow port reuse, even if the TCP shutdown states aren't complete
   if (setsockopt(socketFd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) !=
       0) {
     // Not a failure, keep going until we fail to bind the socket
-    syslog(LOG_WARNING,
+    async_log(LOG_WARNING,
            "Could not configure address reuse, may cause spurious failures");
   }
 
+  // Replays go out in few, large sends, so don't hold the tail of one back
+  // waiting for the client to ACK the rest.  Accepted sockets inherit this
+  if (setsockopt(socketFd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int)) !=
+      0) {
+    async_log(LOG_WARNING, "Could not disable Nagle's algorithm");
+  }
+
+  // Share the port with the other acceptors
+  if (reusePort && setsockopt(socketFd, SOL_SOCKET, SO_REUSEPORT, &(int){1},
+                              sizeof(int)) != 0) {
+    async_log(LOG_ERR, "Could not configure port sharing");
+    return -1;
+  }
+
   {
     struct addrinfo hints;
     // Scoped in to destroy when finished using this
@@ -118,59 +227,107 @@ int main(int argc, char **argv) {
     hints.ai_flags = AI_PASSIVE;
 
     if (getaddrinfo(NULL, SERVER_PORT, &hints, &addrResult) != 0) {
-      syslog(LOG_ERR, "Could not get address information");
-      return EXIT_FAILURE;
+      async_log(LOG_ERR, "Could not get address information");
+      return -1;
     }
 
     if (bind(socketFd, addrResult->ai_addr, sizeof(struct sockaddr)) != 0) {
-      syslog(LOG_ERR, "Could not bind to port");
-      return EXIT_FAILURE;
+      async_log(LOG_ERR, "Could not bind to port");
+      return -1;
     }
 
     // Release the addrinfo
   }
 
+  // Hand the socket over to the caller
+  const int boundFd = socketFd;
+  socketFd = -1;
+  return boundFd;
+}
+
+/// Program entrypoint
+int main(int argc, char **argv) {
+
+  // Open syslog
+  openlog("aesdsocket", 0, LOG_USER);
+  atexit(closelog); // Handle open logs at program exit
+
+  // Parse daemon behavior and the serving mode from cmdline
+  server_options_t options;
+  if (parse_server_options(argc, argv, &options) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+  buffer_pool_init(options.memoryBudget);
+
+  // With SO_REUSEPORT every event loop gets its own socket, and the kernel
+  // spreads incoming connections over them
+  listen_sockets_t listenSockets CLEANUP(cleanup_listen_sockets) = {
+      .fds = NULL, .count = 0};
+  const unsigned socketCount =
+      options.reusePort ? options.eventLoopThreads : 1;
+  listenSockets.fds = malloc(socketCount * sizeof(int));
+  if (listenSockets.fds == NULL) {
+    async_log(LOG_ERR, "Could not allocate the listening sockets");
+    return EXIT_FAILURE;
+  }
+  for (; listenSockets.count < socketCount; ++listenSockets.count) {
+    listenSockets.fds[listenSockets.count] =
+        open_listen_socket(options.reusePort);
+    if (listenSockets.fds[listenSockets.count] == -1) {
+      return EXIT_FAILURE;
+    }
+  }
+  const int socketFd = listenSockets.fds[0];
+
   // If we are a deamon, enter daemon mode
-  if (isDaemon) {
+  if (options.isDaemon) {
     if (daemon(0, 0) == -1) {
-      syslog(LOG_ERR, "Needed to daemonize, but couldn't");
+      async_log(LOG_ERR, "Needed to daemonize, but couldn't");
       return EXIT_FAILURE;
     }
   }
 
-  // Register the socket for inbound connections
-  if (listen(socketFd, LISTEN_BACKLOG)) {
-    syslog(LOG_ERR, "Could not listen for connections");
+  // Register the sockets for inbound connections
+  for (unsigned i = 0; i < listenSockets.count; ++i) {
+    if (listen(listenSockets.fds[i], options.listenBacklog)) {
+      async_log(LOG_ERR, "Could not listen for connections");
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Start reporting metrics before any other thread exists, they all leave
+  // SIGUSR1 to the reporter.  It is stopped last, after the storage is closed
+  metrics_reporter_t *metricsReporter CLEANUP(cleanup_metrics_reporter) =
+      metrics_reporter_start(options.metricsSocket);
+  if (metricsReporter == NULL) {
     return EXIT_FAILURE;
   }
 
-#if USE_AESD_CHAR_DEVICE
-  // Don't open the file yet, wait until the server is referenced
-  FILE* tmpfile CLEANUP(cleanup_tmpfile) = NULL;
-#else
-  // Open/clear the storage file
-  FILE *tmpfile CLEANUP(cleanup_tmpfile) = fopen(TMP_FILE, "w+");
-  if (tmpfile == NULL) {
-    syslog(LOG_ERR, "Error when waiting for a connection");
+  // Take log writes off the connection path.  Stopped at exit, after
+  // everything above has logged its shutdown
+  if (async_log_start(options.logLevel, options.logFile) != EXIT_SUCCESS) {
     return EXIT_FAILURE;
   }
-#endif
-
-#if USE_AESD_CHAR_DEVICE
-  pthread_mutex_t tmp=PTHREAD_MUTEX_INITIALIZER; // avoid build warning for uninitialized variable
-#else
-  // setup server multithreading
-  pthread_mutex_t tmp; // No cleanup, temporary copy of the mutex
-  pthread_t timestampThread;
-  pthread_mutex_t endTimestamping;
-  if (on_server_initialize(&tmp, &timestampThread, tmpfile, &endTimestamping) !=
-      EXIT_SUCCESS) {
-    syslog(LOG_ERR, "Could not initialize the server");
+  atexit(async_log_stop);
+
+  // Open the storage backend.  It is flushed and closed only after the worker
+  // threads below have been joined
+  storage_t *storage CLEANUP(cleanup_storage) = storage_open(&options);
+  if (storage == NULL) {
+    return EXIT_FAILURE;
+  }
+
+  // Run the periodic jobs.  Declared after the storage, so it is stopped
+  // before the storage is closed
+  timer_service_t *timers CLEANUP(cleanup_timer_service) =
+      timer_service_start(TIMER_TICK_MS);
+  if (timers == NULL) {
+    return EXIT_FAILURE;
+  }
+  if (on_server_initialize(storage, &options, timers) != EXIT_SUCCESS) {
+    async_log(LOG_ERR, "Could not initialize the server");
     return EXIT_FAILURE;
   }
-#endif
-  pthread_mutex_t tmpFileMutex CLEANUP(cleanup_mutex) =
-      tmp; // Longterm mutex storage, requires cleanup
 
   // thread storage for worker threads
   struct thread_list_head_t threadList CLEANUP(cleanup_slist);
@@ -182,99 +339,36 @@ int main(int argc, char **argv) {
   signalBehavior.sa_handler = signal_handler;
   sigaction(SIGTERM, &signalBehavior, NULL);
   sigaction(SIGINT, &signalBehavior, NULL);
+  // a client hanging up mid-replay is an error return, not a fatal signal
+  signal(SIGPIPE, SIG_IGN);
 
-  // signalCaught is set on signal reception
-  while (signalCaught != 1) {
-    // Wait for a connection
-    struct sockaddr connectedAddr;
-    socklen_t addrLen = sizeof(connectedAddr);
-    // DON'T clean up the socket at this scope.  The thread lives longer, so it
-    // should do cleanup
-    const int connectionSocketFd = accept(socketFd, &connectedAddr, &addrLen);
-    // Handle the case where we catch our signal while waiting to accept a
-    // connection
-    if (connectionSocketFd == -1 && signalCaught == 0) {
-      syslog(LOG_ERR, "Error when waiting for a connection");
-      return EXIT_FAILURE;
-    } else if (signalCaught == 1) {
-      break;
-    }
-
-    // Get client address
-    char addrString[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &(((struct sockaddr_in *)&connectedAddr)->sin_addr),
-              addrString, sizeof(connectedAddr));
-    syslog(LOG_INFO, "Accepted connection from %s", addrString);
-
-    // DON'T clean up the memory here, since we would destroy it too early
-    struct thread_entry_t *threadTrackingData =
-        malloc(sizeof(struct thread_entry_t));
-    if (threadTrackingData == NULL) {
-      syslog(LOG_ERR, "Could not allocate thread tracking structure");
-      return EXIT_FAILURE;
-    }
-
-#if USE_AESD_CHAR_DEVICE
-    // delay file opening until first use
-    if(tmpfile == NULL){
-      tmpfile = fopen(TMP_FILE, "w+");
-      if (tmpfile == NULL) {
-        syslog(LOG_ERR, "Error when waiting for a connection");
-        return EXIT_FAILURE;
-      }
-      setbuf(tmpfile, NULL);
-    }
-#endif
-
-    // Run the server behavior (read a line, write the file)
-    if (on_server_connection(connectionSocketFd, tmpfile, &tmpFileMutex,
-                             addrString, &(threadTrackingData->worker_thread),
-                             &(threadTrackingData->thread_complete)) !=
-        EXIT_SUCCESS) {
-      syslog(LOG_ERR, "Server processing failed");
-      free(threadTrackingData);
-      return EXIT_FAILURE;
-    }
-
-    SLIST_INSERT_HEAD(&threadList, threadTrackingData, _entry);
-
-    // Clean up existing threads when we make a new one
-    struct thread_entry_t *threadEntry;
-    struct thread_entry_t *lastEntry = NULL;
-    SLIST_FOREACH(threadEntry, &threadList, _entry){
-      if(!atomic_flag_test_and_set(&(threadEntry->thread_complete))){
-        // flag cleared on complete
-        int *threadReturnCode;
-        pthread_join(threadEntry->worker_thread, (void **)&threadReturnCode);
-        if (*threadReturnCode != EXIT_SUCCESS) {
-          syslog(LOG_ERR, "Thread ID %lu failed during processing",
-                threadEntry->worker_thread);
-        }
-        free(threadReturnCode);
-        
-        SLIST_REMOVE(&threadList, threadEntry, thread_entry_t, _entry);
-        free(threadEntry);
-        if(lastEntry != NULL){
-          threadEntry = lastEntry; // Restore iteration
-        }
-      }
-      lastEntry = threadEntry;
-    }
+  if (options.useIoUring && !io_uring_engine_available()) {
+    async_log(LOG_WARNING, "io_uring is not supported by this kernel, serving a "
+                        "thread per connection instead");
+    options.useIoUring = false;
+  }
 
+  int serverResult;
+  if (options.useIoUring) {
+    serverResult =
+        run_io_uring_engine(socketFd, &options, storage, &signalCaught);
+  } else if (options.eventLoopThreads > 0) {
+    serverResult = run_event_loops(listenSockets.fds, listenSockets.count,
+                                   &options, storage, &signalCaught);
+  } else if (options.useWorkerPool) {
+    serverResult = run_worker_pool(socketFd, &options, storage, &signalCaught);
+  } else {
+    serverResult = serve_thread_per_connection(socketFd, &options, storage,
+                                               &threadList);
   }
 
   if (signalCaught) {
-    syslog(LOG_INFO, "Caught signal, exiting");
+    async_log(LOG_INFO, "Caught signal, exiting");
   }
-
-#if USE_AESD_CHAR_DEVICE
-#else
-  // stop the timestamping thread's sleep
-  pthread_mutex_unlock(&endTimestamping);
-  pthread_join(timestampThread, NULL);
-#endif
+  // the connection threads are joined on the way out, free any still serving
+  server_stop_connections();
 
   // Variables that are stack-allocated will have a 'destructor' called
   // automatically
-  return EXIT_SUCCESS;
+  return serverResult;
 }
\ No newline at end of file
@@ -0,0 +1,300 @@
+#include "async_log.h"
+#include "metrics.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RECORD_COUNT (1024) // power of two
+#define RECORD_TEXT_SIZE (240)
+#define BATCH_BUFFER_SIZE (64 * 1024)
+#define DRAIN_INTERVAL_MS (100) // upper bound on how long a record waits
+
+// One slot of the ring.  sequence says whose turn it is: equal to the slot's
+// position when a producer may fill it, position + 1 once it holds a record
+typedef struct {
+  atomic_size_t sequence;
+  int priority;
+  struct timespec time;
+  char text[RECORD_TEXT_SIZE];
+} log_record_t;
+
+static log_record_t records[RECORD_COUNT];
+static atomic_size_t enqueuePosition = 0;
+static size_t dequeuePosition = 0; // only touched by the drain thread
+
+static atomic_int logLevel = LOG_INFO;
+static atomic_bool running = false;
+static atomic_bool stopping = false;
+static atomic_bool drainSleeping = false;
+static atomic_ulong droppedRecords = 0;
+static int wakeFd = -1;
+static int logFileFd = -1; // -1 to drain to syslog
+static pthread_t drainThread;
+
+static const struct {
+  const char *name;
+  int priority;
+} LEVELS[] = {
+    {"err", LOG_ERR},   {"warning", LOG_WARNING}, {"notice", LOG_NOTICE},
+    {"info", LOG_INFO}, {"debug", LOG_DEBUG},
+};
+
+static const char *level_name(int priority) {
+  for (size_t i = 0; i < sizeof(LEVELS) / sizeof(LEVELS[0]); ++i) {
+    if (LEVELS[i].priority == priority) {
+      return LEVELS[i].name;
+    }
+  }
+  return priority < LOG_ERR ? "crit" : "debug";
+}
+
+int async_log_parse_level(const char *name, int *out_level) {
+  for (size_t i = 0; i < sizeof(LEVELS) / sizeof(LEVELS[0]); ++i) {
+    if (strcmp(LEVELS[i].name, name) == 0) {
+      *out_level = LEVELS[i].priority;
+      return EXIT_SUCCESS;
+    }
+  }
+  return EXIT_FAILURE;
+}
+
+// claim a free slot, or NULL if the ring is full
+static log_record_t *claim_record(size_t *out_position) {
+  size_t position =
+      atomic_load_explicit(&enqueuePosition, memory_order_relaxed);
+  while (true) {
+    log_record_t *record = &records[position & (RECORD_COUNT - 1)];
+    const size_t sequence =
+        atomic_load_explicit(&record->sequence, memory_order_acquire);
+    const intptr_t lag = (intptr_t)sequence - (intptr_t)position;
+    if (lag == 0) {
+      if (atomic_compare_exchange_weak_explicit(
+              &enqueuePosition, &position, position + 1, memory_order_relaxed,
+              memory_order_relaxed)) {
+        *out_position = position;
+        return record;
+      }
+    } else if (lag < 0) {
+      return NULL; // the drain thread hasn't freed this slot yet
+    } else {
+      position = atomic_load_explicit(&enqueuePosition, memory_order_relaxed);
+    }
+  }
+}
+
+void async_log(int priority, const char *format, ...) {
+  if (priority > atomic_load_explicit(&logLevel, memory_order_relaxed)) {
+    return;
+  }
+  va_list args;
+  va_start(args, format);
+  if (!atomic_load_explicit(&running, memory_order_acquire)) {
+    vsyslog(priority, format, args);
+    va_end(args);
+    return;
+  }
+
+  size_t position;
+  log_record_t *record = claim_record(&position);
+  if (record == NULL) {
+    va_end(args);
+    atomic_fetch_add_explicit(&droppedRecords, 1, memory_order_relaxed);
+    metrics_count(METRICS_LOG_DROPPED, 1);
+    return;
+  }
+  record->priority = priority;
+  clock_gettime(CLOCK_REALTIME, &record->time);
+  vsnprintf(record->text, sizeof(record->text), format, args); // truncates
+  va_end(args);
+  atomic_store_explicit(&record->sequence, position + 1, memory_order_release);
+
+  // only the first record after the drain thread went idle pays for a wakeup
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&drainSleeping, memory_order_relaxed) &&
+      atomic_exchange(&drainSleeping, false)) {
+    eventfd_write(wakeFd, 1);
+  }
+}
+
+static bool record_ready(void) {
+  const log_record_t *record = &records[dequeuePosition & (RECORD_COUNT - 1)];
+  return atomic_load_explicit(&record->sequence, memory_order_acquire) ==
+         dequeuePosition + 1;
+}
+
+static void write_all(int fd, const char *data, size_t size) {
+  while (size > 0) {
+    const ssize_t written = write(fd, data, size);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return; // nowhere left to report it
+    }
+    data += written;
+    size -= written;
+  }
+}
+
+// format one file line, returns its length
+static size_t format_line(char *line, size_t space, int priority,
+                          const struct timespec *time, const char *text) {
+  struct tm local;
+  localtime_r(&time->tv_sec, &local);
+  char stamp[32];
+  strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &local);
+  const int length =
+      snprintf(line, space, "%s.%03ld %-7s %s\n", stamp,
+               time->tv_nsec / 1000000, level_name(priority), text);
+  if (length < 0) {
+    return 0;
+  }
+  return (size_t)length < space ? (size_t)length : space - 1;
+}
+
+// hand every ready record to the sink, a file gets one write per batch
+static void drain_records(void) {
+  static char batch[BATCH_BUFFER_SIZE];
+  size_t used = 0;
+  while (record_ready()) {
+    log_record_t *record = &records[dequeuePosition & (RECORD_COUNT - 1)];
+    if (logFileFd == -1) {
+      syslog(record->priority, "%s", record->text);
+    } else {
+      if (BATCH_BUFFER_SIZE - used < RECORD_TEXT_SIZE + 64) {
+        write_all(logFileFd, batch, used);
+        used = 0;
+      }
+      used += format_line(batch + used, BATCH_BUFFER_SIZE - used,
+                          record->priority, &record->time, record->text);
+    }
+    // the slot is free for the producer one lap ahead
+    atomic_store_explicit(&record->sequence, dequeuePosition + RECORD_COUNT,
+                          memory_order_release);
+    ++dequeuePosition;
+  }
+  if (used > 0) {
+    write_all(logFileFd, batch, used);
+  }
+}
+
+static void report_drops(unsigned long *reported) {
+  const unsigned long dropped =
+      atomic_load_explicit(&droppedRecords, memory_order_relaxed);
+  if (dropped == *reported) {
+    return;
+  }
+  char text[RECORD_TEXT_SIZE];
+  snprintf(text, sizeof(text), "Dropped %lu log records, the log ring was full",
+           dropped - *reported);
+  *reported = dropped;
+  if (logFileFd == -1) {
+    syslog(LOG_WARNING, "%s", text);
+  } else {
+    char line[RECORD_TEXT_SIZE + 64];
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    write_all(logFileFd, line,
+              format_line(line, sizeof(line), LOG_WARNING, &now, text));
+  }
+}
+
+static void *drain_thread(void *param) {
+  (void)param;
+  unsigned long reportedDrops = 0;
+  while (true) {
+    drain_records();
+    report_drops(&reportedDrops);
+    if (atomic_load(&stopping)) {
+      // catch anything published while the last batch was going out
+      drain_records();
+      return NULL;
+    }
+
+    // announce the sleep before the last look, so a producer that publishes
+    // after that look sees the flag and wakes us
+    atomic_store(&drainSleeping, true);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!record_ready()) {
+      struct pollfd wake = {.fd = wakeFd, .events = POLLIN};
+      if (poll(&wake, 1, DRAIN_INTERVAL_MS) > 0) {
+        eventfd_t count;
+        eventfd_read(wakeFd, &count);
+      }
+    }
+    atomic_store(&drainSleeping, false);
+  }
+}
+
+int async_log_start(int level, const char *path) {
+  atomic_store(&logLevel, level);
+  setlogmask(LOG_UPTO(level)); // for the synchronous fallback as well
+  if (atomic_load(&running)) {
+    return EXIT_SUCCESS;
+  }
+
+  for (size_t i = 0; i < RECORD_COUNT; ++i) {
+    atomic_init(&records[i].sequence, i);
+  }
+  atomic_store(&enqueuePosition, 0);
+  dequeuePosition = 0;
+
+  if (path != NULL) {
+    logFileFd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (logFileFd == -1) {
+      syslog(LOG_ERR, "Could not open the log file %s", path);
+      return EXIT_FAILURE;
+    }
+  }
+  wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (wakeFd == -1) {
+    syslog(LOG_ERR, "Could not create the log wakeup");
+    return EXIT_FAILURE;
+  }
+
+  // keep every signal away from the drain thread
+  sigset_t allSignals;
+  sigset_t previousMask;
+  sigfillset(&allSignals);
+  pthread_sigmask(SIG_BLOCK, &allSignals, &previousMask);
+  const int created = pthread_create(&drainThread, NULL, drain_thread, NULL);
+  pthread_sigmask(SIG_SETMASK, &previousMask, NULL);
+  if (created != 0) {
+    syslog(LOG_ERR, "Could not start the log drain thread");
+    return EXIT_FAILURE;
+  }
+
+  atomic_store(&stopping, false);
+  atomic_store_explicit(&running, true, memory_order_release);
+  return EXIT_SUCCESS;
+}
+
+void async_log_stop(void) {
+  if (!atomic_load(&running)) {
+    return;
+  }
+  // new records go to syslog directly from here on
+  atomic_store(&running, false);
+  atomic_store(&stopping, true);
+  eventfd_write(wakeFd, 1);
+  pthread_join(drainThread, NULL);
+
+  close(wakeFd);
+  wakeFd = -1;
+  if (logFileFd != -1) {
+    close(logFileFd);
+    logFileFd = -1;
+  }
+}
@@ -0,0 +1,49 @@
+#ifndef ASYNC_LOG_H
+#define ASYNC_LOG_H
+
+#include <syslog.h>
+
+/**
+ * @brief Log without blocking the caller on the log socket.
+ *
+ * Records are formatted into a fixed-size lock-free ring, and a background
+ * thread drains them in batches to syslog or to a file.  When the ring is
+ * full the record is dropped and counted instead of waiting, so logging can't
+ * throttle the connection rate; the drain thread reports how many were lost.
+ * Records above the configured level are discarded before formatting.
+ *
+ * Before @ref async_log_start and after @ref async_log_stop every record goes
+ * straight to syslog, so it is safe to log at any time.
+ *
+ * @param priority syslog priority, LOG_ERR to LOG_DEBUG
+ * @param format printf format
+ */
+void async_log(int priority, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/**
+ * @brief Start the drain thread.  Signals are blocked on it, so they keep
+ * going to the threads that expect them
+ *
+ * @param level most verbose priority to keep, LOG_ERR to LOG_DEBUG
+ * @param path file to append records to, or NULL for syslog
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if logging stays synchronous
+ */
+int async_log_start(int level, const char *path);
+
+/**
+ * @brief Drain every outstanding record and stop the drain thread.  Usable
+ * with atexit()
+ */
+void async_log_stop(void);
+
+/**
+ * @brief Parse a level name: err, warning, notice, info or debug
+ *
+ * @param name level name
+ * @param out_level the syslog priority
+ * @return EXIT_SUCCESS, or EXIT_FAILURE for an unknown name
+ */
+int async_log_parse_level(const char *name, int *out_level);
+
+#endif
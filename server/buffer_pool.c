@@ -0,0 +1,140 @@
+#include "buffer_pool.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN_CLASS_BITS (8)  // 256 bytes
+#define MAX_CLASS_BITS (20) // 1 MiB
+#define CLASS_COUNT (MAX_CLASS_BITS - MIN_CLASS_BITS + 1)
+#define CACHE_BYTES_PER_CLASS (1024 * 1024)
+#define MIN_CACHED_BLOCKS (4)
+
+// freed blocks are linked through their first bytes
+typedef struct free_block {
+  struct free_block *next;
+} free_block_t;
+
+typedef struct {
+  pthread_mutex_t lock;
+  free_block_t *head;
+  size_t cached;
+  size_t maxCached;
+} size_class_t;
+
+static size_class_t classes[CLASS_COUNT];
+static pthread_once_t classesOnce = PTHREAD_ONCE_INIT;
+static size_t budget = 0; // 0 for no limit
+static atomic_size_t inUse = 0;
+
+static void init_classes(void) {
+  for (unsigned i = 0; i < CLASS_COUNT; ++i) {
+    pthread_mutex_init(&classes[i].lock, NULL);
+    classes[i].head = NULL;
+    classes[i].cached = 0;
+    const size_t blockSize = (size_t)1 << (i + MIN_CLASS_BITS);
+    classes[i].maxCached = CACHE_BYTES_PER_CLASS / blockSize;
+    if (classes[i].maxCached < MIN_CACHED_BLOCKS) {
+      classes[i].maxCached = MIN_CACHED_BLOCKS;
+    }
+  }
+}
+
+// the class a size rounds up to, CLASS_COUNT if it is too big for any
+static unsigned class_index(size_t size) {
+  if (size <= ((size_t)1 << MIN_CLASS_BITS)) {
+    return 0;
+  }
+  const unsigned bits = 64 - __builtin_clzll((unsigned long long)size - 1);
+  return bits > MAX_CLASS_BITS ? CLASS_COUNT : bits - MIN_CLASS_BITS;
+}
+
+// take bytes out of the budget, false if they don't fit
+static bool charge(size_t bytes) {
+  size_t used = atomic_load_explicit(&inUse, memory_order_relaxed);
+  do {
+    if (budget > 0 && (bytes > budget || used > budget - bytes)) {
+      return false;
+    }
+  } while (!atomic_compare_exchange_weak_explicit(
+      &inUse, &used, used + bytes, memory_order_relaxed, memory_order_relaxed));
+  return true;
+}
+
+void buffer_pool_init(size_t newBudget) {
+  pthread_once(&classesOnce, init_classes);
+  budget = newBudget;
+}
+
+void *buffer_pool_alloc(size_t size, size_t *out_capacity) {
+  pthread_once(&classesOnce, init_classes);
+  const unsigned index = class_index(size);
+  const size_t capacity =
+      index < CLASS_COUNT ? (size_t)1 << (index + MIN_CLASS_BITS) : size;
+  if (!charge(capacity)) {
+    return NULL;
+  }
+
+  void *block = NULL;
+  if (index < CLASS_COUNT) {
+    size_class_t *sizeClass = &classes[index];
+    pthread_mutex_lock(&sizeClass->lock);
+    free_block_t *cachedBlock = sizeClass->head;
+    if (cachedBlock != NULL) {
+      sizeClass->head = cachedBlock->next;
+      --sizeClass->cached;
+    }
+    pthread_mutex_unlock(&sizeClass->lock);
+    block = cachedBlock;
+  }
+  if (block == NULL) {
+    block = malloc(capacity);
+  }
+  if (block == NULL) {
+    atomic_fetch_sub_explicit(&inUse, capacity, memory_order_relaxed);
+    return NULL;
+  }
+  if (out_capacity != NULL) {
+    *out_capacity = capacity;
+  }
+  return block;
+}
+
+void *buffer_pool_calloc(size_t size) {
+  void *block = buffer_pool_alloc(size, NULL);
+  if (block != NULL) {
+    memset(block, 0, size);
+  }
+  return block;
+}
+
+void buffer_pool_free(void *block, size_t capacity) {
+  if (block == NULL) {
+    return;
+  }
+  const unsigned index = class_index(capacity);
+  if (index < CLASS_COUNT) {
+    capacity = (size_t)1 << (index + MIN_CLASS_BITS);
+  }
+  atomic_fetch_sub_explicit(&inUse, capacity, memory_order_relaxed);
+
+  if (index < CLASS_COUNT) {
+    size_class_t *sizeClass = &classes[index];
+    pthread_mutex_lock(&sizeClass->lock);
+    if (sizeClass->cached < sizeClass->maxCached) {
+      free_block_t *freed = block;
+      freed->next = sizeClass->head;
+      sizeClass->head = freed;
+      ++sizeClass->cached;
+      block = NULL;
+    }
+    pthread_mutex_unlock(&sizeClass->lock);
+  }
+  free(block); // no room on the list, or never pooled
+}
+
+size_t buffer_pool_in_use(void) {
+  return atomic_load_explicit(&inUse, memory_order_relaxed);
+}
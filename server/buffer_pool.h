@@ -0,0 +1,56 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stddef.h>
+
+/**
+ * @brief Recycling allocator for connection state and I/O buffers, under one
+ * memory budget for the whole server.
+ *
+ * Requests are rounded up to a power-of-two size class, from 256 bytes to
+ * 1 MiB.  Freed blocks go back on their class's free list, so connections
+ * that come and go reuse the same memory instead of going through malloc
+ * each time; each list keeps a bounded number of blocks.  Larger requests are
+ * malloc'd directly.
+ *
+ * Every block handed out counts against the budget until it is freed, and an
+ * allocation that would go over it fails like an out-of-memory one, so
+ * clients can't grow the server past the budget between them.
+ */
+
+/**
+ * @brief Set the budget.  Call before any other thread allocates
+ *
+ * @param budget most bytes that may be handed out at once, 0 for no limit
+ */
+void buffer_pool_init(size_t budget);
+
+/**
+ * @brief Allocate a block of at least @ref size bytes
+ *
+ * @param size bytes needed
+ * @param out_capacity usable size of the block, pass it back to
+ * @ref buffer_pool_free.  May be NULL if the caller remembers @ref size
+ * @return the block, or NULL if it doesn't fit the budget or memory is out
+ */
+void *buffer_pool_alloc(size_t size, size_t *out_capacity);
+
+/**
+ * @brief Allocate a zeroed block, as for @ref buffer_pool_alloc
+ */
+void *buffer_pool_calloc(size_t size);
+
+/**
+ * @brief Give a block back
+ *
+ * @param block a block from this pool, may be NULL
+ * @param capacity the size it was allocated with, or its capacity
+ */
+void buffer_pool_free(void *block, size_t capacity);
+
+/**
+ * @brief Bytes currently handed out, against the budget
+ */
+size_t buffer_pool_in_use(void);
+
+#endif
@@ -0,0 +1,67 @@
+#include "command_parser.h"
+#include <stdlib.h>
+
+const command_t *command_find(const command_t *commands, size_t commandCount,
+                              const char *line, size_t lineSize,
+                              command_args_t *out_args) {
+  // [low, high) share their first `matched` bytes with the line.  A prefix
+  // sorts before every longer prefix it starts, so a complete match is
+  // always at low, and keeping on finds the longest one
+  const command_t *found = NULL;
+  size_t low = 0;
+  size_t high = commandCount;
+  for (size_t matched = 0; low < high; ++matched) {
+    if (commands[low].prefixSize == matched) {
+      found = &commands[low];
+      ++low;
+    }
+    if (low == high || matched == lineSize) {
+      break;
+    }
+    const unsigned char byte = line[matched];
+    while (low < high &&
+           (unsigned char)commands[low].prefix[matched] < byte) {
+      ++low;
+    }
+    while (low < high &&
+           (unsigned char)commands[high - 1].prefix[matched] > byte) {
+      --high;
+    }
+  }
+  if (found != NULL) {
+    out_args->next = line + found->prefixSize;
+    out_args->end = line + lineSize;
+  }
+  return found;
+}
+
+int command_parse_uint(command_args_t *args, uint64_t max,
+                       uint64_t *out_value) {
+  const char *digit = args->next;
+  uint64_t value = 0;
+  for (; digit < args->end && *digit >= '0' && *digit <= '9'; ++digit) {
+    const unsigned digitValue = *digit - '0';
+    if (value > (max - digitValue) / 10) {
+      return EXIT_FAILURE; // too large
+    }
+    value = value * 10 + digitValue;
+  }
+  if (digit == args->next) {
+    return EXIT_FAILURE; // no digits
+  }
+  args->next = digit;
+  *out_value = value;
+  return EXIT_SUCCESS;
+}
+
+int command_expect(command_args_t *args, char separator) {
+  if (args->next == args->end || *args->next != separator) {
+    return EXIT_FAILURE;
+  }
+  ++args->next;
+  return EXIT_SUCCESS;
+}
+
+bool command_args_done(const command_args_t *args) {
+  return args->next == args->end;
+}
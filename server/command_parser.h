@@ -0,0 +1,78 @@
+#ifndef COMMAND_PARSER_H
+#define COMMAND_PARSER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief The arguments of a matched command: the rest of its line, consumed
+ * from the front by the parse functions
+ */
+typedef struct {
+  const char *next;
+  const char *end;
+} command_args_t;
+
+/**
+ * @brief An in-band command, recognized by the prefix of a packet
+ */
+typedef struct {
+  const char *prefix;
+  size_t prefixSize;
+  bool (*enabled)(const void *context); // NULL if always enabled, else the
+                                        // packet is data while it says no
+  int (*run)(command_args_t *args, void *context); // EXIT_SUCCESS or
+                                                   // EXIT_FAILURE
+} command_t;
+
+/**
+ * @brief Build a @ref command_t from a string literal prefix
+ */
+#define COMMAND(literal, enabledFn, runFn)                                     \
+  { (literal), sizeof(literal) - 1, (enabledFn), (runFn) }
+
+/**
+ * @brief Find the command a line starts with.
+ *
+ * The line is read at most once, front to back: the table is sorted, so the
+ * commands agreeing with the bytes read so far are a contiguous range that
+ * only ever narrows, and ordinary data usually falls out on its first byte.
+ *
+ * @param commands command table, sorted by prefix (strcmp order), no prefix
+ * repeated
+ * @param commandCount entries in @ref commands
+ * @param line the packet, without its newline
+ * @param lineSize bytes in @ref line
+ * @param out_args the rest of the line after the prefix, if one matched
+ * @return the longest matching command, or NULL for data
+ */
+const command_t *command_find(const command_t *commands, size_t commandCount,
+                              const char *line, size_t lineSize,
+                              command_args_t *out_args);
+
+/**
+ * @brief Parse an unsigned decimal number: at least one digit, no sign, no
+ * spaces, and nothing above @ref max
+ *
+ * @param args arguments, advanced past the digits on success
+ * @param max largest value accepted
+ * @param out_value the number
+ * @return EXIT_SUCCESS, or EXIT_FAILURE with @ref args unchanged
+ */
+int command_parse_uint(command_args_t *args, uint64_t max,
+                       uint64_t *out_value);
+
+/**
+ * @brief Consume one expected separator character
+ *
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if the next character is another one
+ */
+int command_expect(command_args_t *args, char separator);
+
+/**
+ * @brief Whether every argument byte has been consumed
+ */
+bool command_args_done(const command_args_t *args);
+
+#endif
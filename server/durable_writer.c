@@ -0,0 +1,283 @@
+#include "durable_writer.h"
+#include "async_log.h"
+#include "metrics.h"
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MS_PER_SEC (1000)
+#define NS_PER_MS (1000000L)
+#define NS_PER_SEC (1000000000L)
+
+// Most iovecs handed to one pwritev call, the Linux UIO_MAXIOV limit
+#define IOV_BATCH (1024)
+
+// One appender's data, queued on the appender's own stack until it is durable
+typedef struct pending_append {
+  const char *data;
+  size_t dataSize;
+  off_t fileEnd; // set by the flusher
+  int result;    // set by the flusher
+  bool done;     // set by the flusher once the data is durable (or failed)
+  struct pending_append *next;
+} pending_append_t;
+
+struct durable_writer {
+  durability_mode_t mode;
+  unsigned intervalMs;
+  FILE *file;
+  int fd;
+  pthread_mutex_t *fileMutex;
+  pthread_mutex_t lock;       // guards everything below
+  pthread_cond_t wakeFlusher; // new appends queued, or stopping
+  pthread_cond_t appendDone;  // a batch was committed
+  pending_append_t *queueHead;
+  pending_append_t *queueTail;
+  bool dirty;                 // interval mode: written since the last sync
+  bool stopping;
+  pthread_t flusher;
+};
+
+// pwritev everything, resuming after short writes
+static int write_all(int fd, struct iovec *iov, int iovCount, off_t offset) {
+  while (iovCount > 0) {
+    ssize_t written = pwritev(fd, iov, iovCount, offset);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return EXIT_FAILURE;
+    }
+    offset += written;
+    while (iovCount > 0 && (size_t)written >= iov->iov_len) {
+      written -= iov->iov_len;
+      ++iov;
+      --iovCount;
+    }
+    if (iovCount > 0) {
+      iov->iov_base = (char *)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+  return EXIT_SUCCESS;
+}
+
+// fdatasync, timed for the metrics
+static int sync_file(int fd) {
+  const uint64_t start = metrics_now();
+  const int result = fdatasync(fd);
+  metrics_record(METRICS_SYNC, start);
+  return result;
+}
+
+// write a whole batch of appends, sync once, then release their appenders
+static void commit_batch(durable_writer_t *writer, pending_append_t *batch) {
+  struct iovec iov[IOV_BATCH];
+  int result = EXIT_SUCCESS;
+
+  // the file lock is only needed while the data goes in, not for the sync
+  metrics_lock(writer->fileMutex);
+  off_t fileEnd = lseek(writer->fd, 0, SEEK_END);
+  if (fileEnd < 0) {
+    result = EXIT_FAILURE;
+  }
+  pending_append_t *next = batch;
+  while (result == EXIT_SUCCESS && next != NULL) {
+    pending_append_t *first = next;
+    int iovCount = 0;
+    for (; next != NULL && iovCount < IOV_BATCH; next = next->next) {
+      iov[iovCount].iov_base = (void *)next->data;
+      iov[iovCount].iov_len = next->dataSize;
+      ++iovCount;
+    }
+    if (write_all(writer->fd, iov, iovCount, fileEnd) != EXIT_SUCCESS) {
+      async_log(LOG_ERR, "Could not write data to file");
+      result = EXIT_FAILURE;
+      break;
+    }
+    for (pending_append_t *append = first; append != next;
+         append = append->next) {
+      fileEnd += append->dataSize;
+      append->fileEnd = fileEnd;
+    }
+  }
+  pthread_mutex_unlock(writer->fileMutex);
+
+  if (result == EXIT_SUCCESS && sync_file(writer->fd) != 0) {
+    async_log(LOG_ERR, "Could not sync the tempfile");
+    result = EXIT_FAILURE;
+  }
+
+  pthread_mutex_lock(&writer->lock);
+  while (batch != NULL) {
+    // the appender owns the record again as soon as done is set and the lock
+    // is dropped, so read the link first
+    pending_append_t *following = batch->next;
+    batch->result = result;
+    batch->done = true;
+    batch = following;
+  }
+  pthread_cond_broadcast(&writer->appendDone);
+  pthread_mutex_unlock(&writer->lock);
+}
+
+static void run_group_commit(durable_writer_t *writer) {
+  while (true) {
+    pthread_mutex_lock(&writer->lock);
+    while (writer->queueHead == NULL && !writer->stopping) {
+      pthread_cond_wait(&writer->wakeFlusher, &writer->lock);
+    }
+    if (writer->queueHead == NULL) {
+      // stopping, and everything queued is committed
+      pthread_mutex_unlock(&writer->lock);
+      return;
+    }
+    // take everything queued so far, later appends form the next batch
+    pending_append_t *batch = writer->queueHead;
+    writer->queueHead = writer->queueTail = NULL;
+    pthread_mutex_unlock(&writer->lock);
+
+    commit_batch(writer, batch);
+  }
+}
+
+static void run_interval_sync(durable_writer_t *writer) {
+  bool stopping = false;
+  while (!stopping) {
+    pthread_mutex_lock(&writer->lock);
+    if (!writer->stopping) {
+      struct timespec wakeTime;
+      clock_gettime(CLOCK_REALTIME, &wakeTime);
+      wakeTime.tv_sec += writer->intervalMs / MS_PER_SEC;
+      wakeTime.tv_nsec += (writer->intervalMs % MS_PER_SEC) * NS_PER_MS;
+      if (wakeTime.tv_nsec >= NS_PER_SEC) {
+        wakeTime.tv_nsec -= NS_PER_SEC;
+        ++wakeTime.tv_sec;
+      }
+      pthread_cond_timedwait(&writer->wakeFlusher, &writer->lock, &wakeTime);
+    }
+    const bool needsSync = writer->dirty;
+    writer->dirty = false;
+    stopping = writer->stopping;
+    pthread_mutex_unlock(&writer->lock);
+
+    if (needsSync && sync_file(writer->fd) != 0) {
+      async_log(LOG_ERR, "Could not sync the tempfile");
+    }
+  }
+}
+
+static void *flusher_thread(void *param) {
+  durable_writer_t *writer = (durable_writer_t *)param;
+  if (writer->mode == DURABILITY_GROUP_COMMIT) {
+    run_group_commit(writer);
+  } else {
+    run_interval_sync(writer);
+  }
+  return NULL;
+}
+
+durable_writer_t *durable_writer_create(durability_mode_t mode,
+                                        unsigned intervalMs, FILE *file,
+                                        pthread_mutex_t *fileMutex) {
+  if (mode != DURABILITY_GROUP_COMMIT && mode != DURABILITY_INTERVAL) {
+    return NULL;
+  }
+
+  durable_writer_t *writer = calloc(1, sizeof(*writer));
+  if (writer == NULL) {
+    async_log(LOG_ERR, "Could not allocate the durable writer");
+    return NULL;
+  }
+  writer->mode = mode;
+  writer->intervalMs = intervalMs;
+  writer->file = file;
+  writer->fd = fileno(file);
+  writer->fileMutex = fileMutex;
+  pthread_mutex_init(&writer->lock, NULL);
+  pthread_cond_init(&writer->wakeFlusher, NULL);
+  pthread_cond_init(&writer->appendDone, NULL);
+
+  // keep every signal away from the flusher, so a stop signal wakes the
+  // thread that waits for it
+  sigset_t allSignals;
+  sigset_t previousMask;
+  sigfillset(&allSignals);
+  pthread_sigmask(SIG_BLOCK, &allSignals, &previousMask);
+  const int created =
+      pthread_create(&writer->flusher, NULL, flusher_thread, writer);
+  pthread_sigmask(SIG_SETMASK, &previousMask, NULL);
+  if (created != 0) {
+    async_log(LOG_ERR, "Could not start the tempfile flusher");
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->wakeFlusher);
+    pthread_cond_destroy(&writer->appendDone);
+    free(writer);
+    return NULL;
+  }
+  return writer;
+}
+
+int durable_writer_append(durable_writer_t *writer, const char *data,
+                          size_t dataSize, off_t *out_fileEnd) {
+  if (writer->mode == DURABILITY_INTERVAL) {
+    metrics_lock(writer->fileMutex);
+    fseek(writer->file, 0, SEEK_END);
+    if (fwrite(data, sizeof(char), dataSize, writer->file) != dataSize ||
+        fflush(writer->file) != 0) {
+      async_log(LOG_ERR, "Could not write data to file");
+      pthread_mutex_unlock(writer->fileMutex);
+      return EXIT_FAILURE;
+    }
+    if (out_fileEnd != NULL) {
+      *out_fileEnd = ftello(writer->file);
+    }
+    pthread_mutex_unlock(writer->fileMutex);
+
+    pthread_mutex_lock(&writer->lock);
+    writer->dirty = true;
+    pthread_mutex_unlock(&writer->lock);
+    return EXIT_SUCCESS;
+  }
+
+  pending_append_t append = {.data = data, .dataSize = dataSize};
+  pthread_mutex_lock(&writer->lock);
+  if (writer->queueTail == NULL) {
+    writer->queueHead = &append;
+  } else {
+    writer->queueTail->next = &append;
+  }
+  writer->queueTail = &append;
+  pthread_cond_signal(&writer->wakeFlusher);
+  while (!append.done) {
+    pthread_cond_wait(&writer->appendDone, &writer->lock);
+  }
+  pthread_mutex_unlock(&writer->lock);
+
+  if (out_fileEnd != NULL) {
+    *out_fileEnd = append.fileEnd;
+  }
+  return append.result;
+}
+
+void durable_writer_destroy(durable_writer_t *writer) {
+  if (writer == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&writer->lock);
+  writer->stopping = true;
+  pthread_cond_signal(&writer->wakeFlusher);
+  pthread_mutex_unlock(&writer->lock);
+  pthread_join(writer->flusher, NULL);
+
+  pthread_mutex_destroy(&writer->lock);
+  pthread_cond_destroy(&writer->wakeFlusher);
+  pthread_cond_destroy(&writer->appendDone);
+  free(writer);
+}
@@ -0,0 +1,58 @@
+#ifndef DURABLE_WRITER_H
+#define DURABLE_WRITER_H
+
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/**
+ * @brief How appends to the tempfile are made durable
+ */
+typedef enum {
+  DURABILITY_PER_WRITE,    // fsync after every append
+  DURABILITY_GROUP_COMMIT, // batch concurrent appends into one writev and one
+                           // fdatasync, appenders wait until theirs is durable
+  DURABILITY_INTERVAL,     // append immediately, fdatasync on a fixed interval
+} durability_mode_t;
+
+typedef struct durable_writer durable_writer_t;
+
+/**
+ * @brief Start the background flusher for a batching durability mode
+ *
+ * Once started, every append to @ref file must go through
+ * @ref durable_writer_append.
+ *
+ * @param mode DURABILITY_GROUP_COMMIT or DURABILITY_INTERVAL
+ * @param intervalMs time between syncs, for DURABILITY_INTERVAL
+ * @param file the tempfile
+ * @param fileMutex mutex protecting I/O to @ref file, held only while writing
+ * @return the writer, or NULL on error
+ */
+durable_writer_t *durable_writer_create(durability_mode_t mode,
+                                        unsigned intervalMs, FILE *file,
+                                        pthread_mutex_t *fileMutex);
+
+/**
+ * @brief Append data to the end of the file
+ *
+ * With group commit this blocks until the data has been synced to disk.
+ *
+ * @param writer the writer
+ * @param data character buffer to write
+ * @param dataSize number of characters to write
+ * @param out_fileEnd if not NULL, the file offset just past the written data
+ * @return EXIT_SUCCESS on pass, else EXIT_FAILURE
+ */
+int durable_writer_append(durable_writer_t *writer, const char *data,
+                          size_t dataSize, off_t *out_fileEnd);
+
+/**
+ * @brief Flush anything outstanding and stop the flusher.  No appends may be
+ * running or made afterwards
+ *
+ * @param writer the writer, may be NULL
+ */
+void durable_writer_destroy(durable_writer_t *writer);
+
+#endif
@@ -0,0 +1,285 @@
+/**
+ * @brief Benchmark of the connection engines: thread per connection against
+ * the io_uring engine
+ *
+ * Starts the server once per engine on port 9000 (with an in-memory ring
+ * backend, so every replay costs the same), then runs CLIENTS concurrent
+ * clients that each open a connection per message, send a line and read the
+ * replay until the server hangs up.  Every engine is measured twice: untraced
+ * for throughput and per-message latency, then under ptrace to count the
+ * server's system calls per message (tracing slows everything down, so those
+ * timings are not reported).
+ *
+ * Usage: engine_bench [path to aesdsocket] [messages per client]
+ */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SERVER_PORT (9000)
+#define CLIENTS (8)
+#define DEFAULT_MESSAGES (2000)
+#define MESSAGE_SIZE (64)
+#define RING_BACKEND ("ring:4096")
+#define CONNECT_ATTEMPTS (100)
+
+typedef struct {
+  const char *name;
+  const char *engineArg; // NULL for the default engine
+} engine_t;
+
+static const engine_t ENGINES[] = {
+    {"threads", NULL},
+    {"io_uring", "-u"},
+};
+
+typedef struct {
+  unsigned messages;
+  double *latencies; // seconds, one per message
+  bool failed;
+} client_t;
+
+// server system calls seen by the tracer, read by the load thread
+static atomic_long tracedSyscalls = 0;
+
+static double now_seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static int connect_to_server(void) {
+  const int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd == -1) {
+    return -1;
+  }
+  struct sockaddr_in addr = {
+      .sin_family = AF_INET,
+      .sin_port = htons(SERVER_PORT),
+      .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+  };
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// one message: connect, send a line, read the replay until the server closes
+static bool exchange(const char *message, size_t messageSize) {
+  const int fd = connect_to_server();
+  if (fd == -1) {
+    return false;
+  }
+  bool ok = send(fd, message, messageSize, MSG_NOSIGNAL) ==
+            (ssize_t)messageSize;
+  char replay[8192];
+  ssize_t received;
+  while (ok && (received = recv(fd, replay, sizeof(replay), 0)) != 0) {
+    if (received < 0 && errno != EINTR) {
+      ok = false;
+    }
+  }
+  close(fd);
+  return ok;
+}
+
+static void *client_thread(void *param) {
+  client_t *client = param;
+  char message[MESSAGE_SIZE];
+  memset(message, 'a', sizeof(message) - 1);
+  message[sizeof(message) - 1] = '\n';
+
+  for (unsigned i = 0; i < client->messages; ++i) {
+    const double start = now_seconds();
+    if (!exchange(message, sizeof(message))) {
+      client->failed = true;
+      return NULL;
+    }
+    client->latencies[i] = now_seconds() - start;
+  }
+  return NULL;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  const double left = *(const double *)a;
+  const double right = *(const double *)b;
+  return (left > right) - (left < right);
+}
+
+typedef struct {
+  unsigned messagesPerClient;
+  bool traced;
+  pid_t server;
+  double seconds;
+  long syscalls;
+  double p50;
+  double p99;
+  bool failed;
+} run_t;
+
+// SIGTERM may be taken by a thread other than the acceptor (always possible
+// under ptrace), so connect once more to wake up a blocked accept
+static void stop_server(pid_t server) {
+  kill(server, SIGTERM);
+  const int fd = connect_to_server();
+  if (fd != -1) {
+    close(fd);
+  }
+}
+
+// wait for the server to listen, run every client, then stop the server
+static void *load_thread(void *param) {
+  run_t *run = param;
+  int probe = -1;
+  for (unsigned i = 0; i < CONNECT_ATTEMPTS && probe == -1; ++i) {
+    if ((probe = connect_to_server()) == -1) {
+      usleep(50000);
+    }
+  }
+  if (probe == -1) {
+    run->failed = true;
+    stop_server(run->server);
+    return NULL;
+  }
+  close(probe); // an empty connection, the server drops it
+
+  const size_t total = (size_t)CLIENTS * run->messagesPerClient;
+  double *latencies = calloc(total, sizeof(double));
+  client_t clients[CLIENTS];
+  pthread_t threads[CLIENTS];
+  if (latencies == NULL) {
+    run->failed = true;
+    stop_server(run->server);
+    return NULL;
+  }
+
+  const long syscallsBefore = atomic_load(&tracedSyscalls);
+  const double start = now_seconds();
+  for (unsigned i = 0; i < CLIENTS; ++i) {
+    clients[i] = (client_t){.messages = run->messagesPerClient,
+                            .latencies = latencies +
+                                         (size_t)i * run->messagesPerClient};
+    pthread_create(&threads[i], NULL, client_thread, &clients[i]);
+  }
+  for (unsigned i = 0; i < CLIENTS; ++i) {
+    pthread_join(threads[i], NULL);
+    run->failed |= clients[i].failed;
+  }
+  run->seconds = now_seconds() - start;
+  run->syscalls = atomic_load(&tracedSyscalls) - syscallsBefore;
+
+  qsort(latencies, total, sizeof(double), compare_doubles);
+  run->p50 = latencies[total / 2];
+  run->p99 = latencies[total * 99 / 100];
+  free(latencies);
+
+  stop_server(run->server);
+  return NULL;
+}
+
+// follow every server thread, counting syscall entries, until it exits
+static void trace_server(pid_t server) {
+  int status;
+  waitpid(server, &status, 0); // stopped itself before exec
+  ptrace(PTRACE_SETOPTIONS, server, 0,
+         PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL);
+  ptrace(PTRACE_SYSCALL, server, 0, 0);
+
+  // each syscall stops twice, on entry and on exit
+  long stops = 0;
+  while (true) {
+    const pid_t thread = waitpid(-1, &status, __WALL);
+    if (thread == -1) {
+      break;
+    }
+    if (WIFEXITED(status) || WIFSIGNALED(status)) {
+      if (thread == server) {
+        break;
+      }
+      continue;
+    }
+    int signal = 0;
+    if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+      ++stops;
+      atomic_store(&tracedSyscalls, stops / 2);
+    } else if (status >> 16 == 0 && WSTOPSIG(status) != SIGSTOP &&
+               WSTOPSIG(status) != SIGTRAP) {
+      signal = WSTOPSIG(status); // pass real signals on (SIGTERM)
+    }
+    ptrace(PTRACE_SYSCALL, thread, 0, signal);
+  }
+}
+
+static bool run_engine(const char *serverPath, const engine_t *engine,
+                       run_t *run) {
+  const pid_t server = fork();
+  if (server == -1) {
+    return false;
+  }
+  if (server == 0) {
+    const char *argv[] = {serverPath, "-b", RING_BACKEND, engine->engineArg,
+                          NULL};
+    if (run->traced) {
+      ptrace(PTRACE_TRACEME, 0, 0, 0);
+      raise(SIGSTOP);
+    }
+    execv(serverPath, (char *const *)argv);
+    _exit(127);
+  }
+
+  run->server = server;
+  atomic_store(&tracedSyscalls, 0);
+  pthread_t load;
+  pthread_create(&load, NULL, load_thread, run);
+  if (run->traced) {
+    trace_server(server);
+  } else {
+    waitpid(server, NULL, 0);
+  }
+  pthread_join(load, NULL);
+  return !run->failed;
+}
+
+int main(int argc, char **argv) {
+  const char *serverPath = argc > 1 ? argv[1] : "./aesdsocket";
+  const unsigned messages =
+      argc > 2 ? strtoul(argv[2], NULL, 0) : DEFAULT_MESSAGES;
+
+  printf("%u clients x %u messages of %d bytes, %s backend\n", CLIENTS,
+         messages, MESSAGE_SIZE, RING_BACKEND);
+  printf("%-10s %12s %10s %10s %14s\n", "engine", "msgs/s", "p50 us",
+         "p99 us", "syscalls/msg");
+
+  int result = EXIT_SUCCESS;
+  for (size_t i = 0; i < sizeof(ENGINES) / sizeof(ENGINES[0]); ++i) {
+    run_t timed = {.messagesPerClient = messages};
+    // tracing is slow, a tenth of the messages gives a stable count
+    run_t traced = {.messagesPerClient = messages / 10 > 0 ? messages / 10 : 1,
+                    .traced = true};
+    if (!run_engine(serverPath, &ENGINES[i], &timed) ||
+        !run_engine(serverPath, &ENGINES[i], &traced)) {
+      printf("%-10s FAILED\n", ENGINES[i].name);
+      result = EXIT_FAILURE;
+      continue;
+    }
+    const double totalMessages = (double)CLIENTS * messages;
+    printf("%-10s %12.0f %10.1f %10.1f %14.1f\n", ENGINES[i].name,
+           totalMessages / timed.seconds, timed.p50 * 1e6, timed.p99 * 1e6,
+           (double)traced.syscalls /
+               ((double)CLIENTS * traced.messagesPerClient));
+  }
+  return result;
+}
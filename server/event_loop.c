@@ -0,0 +1,527 @@
+#define _GNU_SOURCE // accept4
+#include "event_loop.h"
+#include "async_log.h"
+#include "buffer_pool.h"
+#include "cleanup.h"
+#include "line_framer.h"
+#include "metrics.h"
+#include "replay.h"
+#include "server_behavior.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define MAX_EVENTS (64)
+#define INITIAL_RECV_SIZE (1024)
+#define NS_PER_MS (1000000)
+
+typedef enum {
+  CONNECTION_READING,   // waiting for the newline ending the packet
+  CONNECTION_REPLAYING, // sending the stored data back
+} connection_state_t;
+
+struct connection_t {
+  int fd;
+  connection_state_t state;
+  line_framer_t framer;
+  replay_cursor_t replay; // what is left to send back
+  uint64_t packetStart; // when the packet being received started arriving
+  char clientAddr[INET_ADDRSTRLEN];
+  uint64_t deadline; // when the current read or write wait times out
+  bool hasDeadline;  // on one of the loop's deadline queues
+  LIST_ENTRY(connection_t) _entry;
+  TAILQ_ENTRY(connection_t) _deadlineEntry;
+};
+
+LIST_HEAD(connection_list_head_t, connection_t);
+
+// Connections waiting under one timeout.  Every deadline in a queue is armed
+// with the same timeout, so appending keeps the queue sorted by expiry:
+// arming, disarming and finding the next expiry are all O(1)
+typedef struct {
+  TAILQ_HEAD(, connection_t) connections;
+  uint64_t timeoutNs; // 0 for no timeout
+} deadline_queue_t;
+
+typedef struct {
+  int epollFd;
+  int listenFd;
+  int wakeFd; // shared by all loops, readable once the server is stopping
+  storage_t *storage;
+  volatile sig_atomic_t *stopFlag;
+  const server_options_t *options;
+  const sigset_t *waitMask; // only the first loop waits with signals unblocked
+  int cpu;                  // CPU the loop is pinned to, -1 if not pinned
+  replay_buffer_t replayBuffer; // copy space for backends that can't send
+                                // directly, one replay runs at a time per loop
+  struct connection_list_head_t connections;
+  deadline_queue_t readDeadlines;  // waiting for the rest of a packet
+  deadline_queue_t writeDeadlines; // waiting for the client to read a replay
+  int result;
+} event_loop_t;
+
+typedef enum {
+  CONNECTION_KEEP,  // wait for the next readiness edge
+  CONNECTION_DONE,  // the current step finished, move on to the next one
+  CONNECTION_CLOSE, // finished or failed, tear it down
+} connection_status_t;
+
+static void disarm_deadline(event_loop_t *loop,
+                            struct connection_t *connection) {
+  if (!connection->hasDeadline) {
+    return;
+  }
+  deadline_queue_t *queue = connection->state == CONNECTION_READING
+                                ? &loop->readDeadlines
+                                : &loop->writeDeadlines;
+  TAILQ_REMOVE(&queue->connections, connection, _deadlineEntry);
+  connection->hasDeadline = false;
+}
+
+// (re)start the timeout of the wait the connection's state is in
+static void arm_deadline(event_loop_t *loop, struct connection_t *connection) {
+  disarm_deadline(loop, connection);
+  deadline_queue_t *queue = connection->state == CONNECTION_READING
+                                ? &loop->readDeadlines
+                                : &loop->writeDeadlines;
+  if (queue->timeoutNs == 0) {
+    return;
+  }
+  connection->deadline = metrics_now() + queue->timeoutNs;
+  connection->hasDeadline = true;
+  TAILQ_INSERT_TAIL(&queue->connections, connection, _deadlineEntry);
+}
+
+// milliseconds until the queue's first deadline, -1 if it is empty
+static int queue_wait_ms(const deadline_queue_t *queue, uint64_t now) {
+  const struct connection_t *first = TAILQ_FIRST(&queue->connections);
+  if (first == NULL) {
+    return -1;
+  }
+  // round up, waking before the deadline would only mean waiting again
+  return first->deadline <= now
+             ? 0
+             : (int)((first->deadline - now + NS_PER_MS - 1) / NS_PER_MS);
+}
+
+// how long epoll may wait before the next deadline is due
+static int next_deadline_ms(const event_loop_t *loop) {
+  const uint64_t now = metrics_now();
+  const int readWait = queue_wait_ms(&loop->readDeadlines, now);
+  const int writeWait = queue_wait_ms(&loop->writeDeadlines, now);
+  if (readWait < 0 || (writeWait >= 0 && writeWait < readWait)) {
+    return writeWait;
+  }
+  return readWait;
+}
+
+static void close_connection(event_loop_t *loop,
+                             struct connection_t *connection) {
+  disarm_deadline(loop, connection);
+  LIST_REMOVE(connection, _entry);
+  metrics_count(METRICS_CONNECTIONS_CLOSED, 1);
+  async_log(LOG_INFO, "Closed connection from %s", connection->clientAddr);
+  cleanup_socket(&connection->fd); // also drops it from the epoll set
+  line_framer_destroy(&connection->framer);
+  buffer_pool_free(connection, sizeof(*connection));
+}
+
+static connection_status_t replay_connection(event_loop_t *loop,
+                                             struct connection_t *connection) {
+  const off_t offsetBefore = connection->replay.offset;
+  const size_t headerSentBefore = connection->replay.headerSent;
+  // the backend does its own locking around each call
+  switch (server_replay(loop->storage, connection->fd, &connection->replay,
+                        &loop->replayBuffer)) {
+  case REPLAY_COMPLETE:
+    return CONNECTION_DONE;
+  case REPLAY_WOULD_BLOCK:
+    // the write timeout restarts whenever the client makes room, not on every
+    // wakeup: a client that keeps sending can't stall forever
+    if (!connection->hasDeadline ||
+        connection->replay.offset != offsetBefore ||
+        connection->replay.headerSent != headerSentBefore) {
+      arm_deadline(loop, connection);
+    }
+    return CONNECTION_KEEP; // resume on EPOLLOUT
+  default:
+    return CONNECTION_CLOSE;
+  }
+}
+
+static connection_status_t read_connection(event_loop_t *loop,
+                                           struct connection_t *connection) {
+  const char *packet = NULL;
+  size_t packetSize = 0;
+
+  while (!line_framer_next(&connection->framer, &packet, &packetSize)) {
+    size_t recvSpace = 0;
+    char *recvBuf =
+        line_framer_reserve(&connection->framer, INITIAL_RECV_SIZE, &recvSpace);
+    if (recvBuf == NULL) {
+      // the packet is longer than this connection may buffer
+      server_memory_rejected(connection->clientAddr);
+      return CONNECTION_CLOSE;
+    }
+
+    const ssize_t recvDataSize = recv(connection->fd, recvBuf, recvSpace, 0);
+    if (recvDataSize < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return CONNECTION_KEEP; // resume on EPOLLIN
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      async_log(LOG_ERR, "Failed to get received data from socket!");
+      return CONNECTION_CLOSE;
+    }
+    if (recvDataSize == 0) {
+      return CONNECTION_CLOSE; // client hung up before finishing a packet
+    }
+    line_framer_commit(&connection->framer, recvDataSize);
+    metrics_received(&connection->packetStart, recvDataSize);
+  }
+  metrics_packet_received(&connection->packetStart,
+                          line_framer_pending(&connection->framer) > 0);
+
+  if (server_store_packet(packet, packetSize, loop->storage,
+                          &connection->replay) != EXIT_SUCCESS) {
+    return CONNECTION_CLOSE;
+  }
+  if (!loop->options->persistentSessions) {
+    // packet stored, the receive buffer isn't needed anymore
+    line_framer_destroy(&connection->framer);
+  }
+  disarm_deadline(loop, connection);
+  connection->state = CONNECTION_REPLAYING;
+  return CONNECTION_DONE;
+}
+
+// drive a connection through its states until it has to wait or is finished
+static connection_status_t service_connection(event_loop_t *loop,
+                                              struct connection_t *connection) {
+  while (true) {
+    connection_status_t status;
+    if (connection->state == CONNECTION_READING) {
+      status = read_connection(loop, connection);
+      if (status != CONNECTION_DONE) {
+        return status;
+      }
+      // packet stored, start sending
+    }
+
+    status = replay_connection(loop, connection);
+    if (status != CONNECTION_DONE) {
+      return status;
+    }
+    if (!loop->options->persistentSessions) {
+      return CONNECTION_CLOSE; // replay complete, one packet per connection
+    }
+    // sessions go back for the next packet, which may already be buffered
+    disarm_deadline(loop, connection);
+    connection->state = CONNECTION_READING;
+    arm_deadline(loop, connection);
+  }
+}
+
+static void accept_connections(event_loop_t *loop) {
+  while (true) {
+    struct sockaddr_in connectedAddr;
+    socklen_t addrLen = sizeof(connectedAddr);
+    const int connectionFd =
+        accept4(loop->listenFd, (struct sockaddr *)&connectedAddr, &addrLen,
+                SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (connectionFd == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        async_log(LOG_ERR, "Error when accepting a connection");
+      }
+      return; // another loop may have taken it, or the backlog is drained
+    }
+    const uint64_t acceptedAt = metrics_now();
+
+    char clientAddr[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &connectedAddr.sin_addr, clientAddr,
+              sizeof(clientAddr));
+    struct connection_t *connection = buffer_pool_calloc(sizeof(*connection));
+    if (connection == NULL) {
+      server_memory_rejected(clientAddr);
+      cleanup_socket(&connectionFd);
+      continue;
+    }
+    connection->fd = connectionFd;
+    connection->state = CONNECTION_READING;
+    const int framerResult =
+        line_framer_init(&connection->framer, INITIAL_RECV_SIZE,
+                         loop->options->connectionBufferLimit);
+    memcpy(connection->clientAddr, clientAddr, sizeof(clientAddr));
+    LIST_INSERT_HEAD(&loop->connections, connection, _entry);
+    metrics_count(METRICS_CONNECTIONS_OPENED, 1);
+    // the first packet is due within the read timeout
+    arm_deadline(loop, connection);
+
+    if (framerResult != EXIT_SUCCESS) {
+      server_memory_rejected(connection->clientAddr);
+      close_connection(loop, connection);
+      continue;
+    }
+
+    struct epoll_event event = {
+        .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+        .data.ptr = connection,
+    };
+    if (epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, connectionFd, &event) != 0) {
+      async_log(LOG_ERR, "Could not watch the connection");
+      close_connection(loop, connection);
+      continue;
+    }
+    async_log(LOG_INFO, "Accepted connection from %s", connection->clientAddr);
+    metrics_record(METRICS_ACCEPT, acceptedAt);
+  }
+}
+
+// close every connection whose deadline has passed
+static void expire_deadlines(event_loop_t *loop, deadline_queue_t *queue) {
+  const uint64_t now = metrics_now();
+  struct connection_t *connection;
+  while ((connection = TAILQ_FIRST(&queue->connections)) != NULL &&
+         connection->deadline <= now) {
+    server_connection_timed_out(connection->clientAddr,
+                                queue == &loop->readDeadlines);
+    close_connection(loop, connection);
+  }
+}
+
+static void event_loop_run(event_loop_t *loop) {
+  struct epoll_event events[MAX_EVENTS];
+  bool running = true;
+
+  if (loop->cpu >= 0) {
+    // connections stay on the loop that accepted them, so they stay on this
+    // core's caches too
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(loop->cpu, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+      async_log(LOG_WARNING, "Could not pin an event loop to CPU %d", loop->cpu);
+    }
+  }
+
+  while (running && *loop->stopFlag == 0) {
+    const int eventCount =
+        epoll_pwait(loop->epollFd, events, MAX_EVENTS, next_deadline_ms(loop),
+                    loop->waitMask);
+    if (eventCount < 0) {
+      if (errno == EINTR) {
+        continue; // stopFlag is checked by the loop condition
+      }
+      async_log(LOG_ERR, "Waiting for events failed");
+      loop->result = EXIT_FAILURE;
+      break;
+    }
+
+    for (int i = 0; i < eventCount; ++i) {
+      void *source = events[i].data.ptr;
+      if (source == NULL) {
+        accept_connections(loop);
+      } else if (source == &loop->wakeFd) {
+        running = false;
+      } else {
+        struct connection_t *connection = source;
+        if (service_connection(loop, connection) == CONNECTION_CLOSE) {
+          close_connection(loop, connection);
+        }
+      }
+    }
+    expire_deadlines(loop, &loop->readDeadlines);
+    expire_deadlines(loop, &loop->writeDeadlines);
+  }
+
+  while (!LIST_EMPTY(&loop->connections)) {
+    close_connection(loop, LIST_FIRST(&loop->connections));
+  }
+}
+
+static void *event_loop_thread(void *param) {
+  event_loop_run((event_loop_t *)param);
+  return NULL;
+}
+
+static void event_loop_destroy(event_loop_t *loop) {
+  cleanup_fd(&loop->epollFd);
+  replay_buffer_release(&loop->replayBuffer);
+}
+
+static int event_loop_init(event_loop_t *loop, int listenFd, int wakeFd,
+                           int cpu, const server_options_t *options,
+                           storage_t *storage,
+                           volatile sig_atomic_t *stopFlag) {
+  bzero(loop, sizeof(*loop));
+  loop->cpu = cpu;
+  loop->options = options;
+  loop->listenFd = listenFd;
+  loop->wakeFd = wakeFd;
+  loop->storage = storage;
+  loop->stopFlag = stopFlag;
+  loop->result = EXIT_SUCCESS;
+  LIST_INIT(&loop->connections);
+  TAILQ_INIT(&loop->readDeadlines.connections);
+  TAILQ_INIT(&loop->writeDeadlines.connections);
+  loop->readDeadlines.timeoutNs = (uint64_t)options->readTimeoutMs * NS_PER_MS;
+  loop->writeDeadlines.timeoutNs =
+      (uint64_t)options->writeTimeoutMs * NS_PER_MS;
+
+  loop->epollFd = epoll_create1(EPOLL_CLOEXEC);
+  if (loop->epollFd == -1) {
+    async_log(LOG_ERR, "Could not create an epoll instance");
+    return EXIT_FAILURE;
+  }
+
+  // prefer handing this socket connections whose packets arrive on the loop's
+  // own CPU.  Only a hint, the kernel may ignore it
+  if (cpu >= 0 &&
+      setsockopt(listenFd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) !=
+          0) {
+    async_log(LOG_WARNING, "Could not steer connections to CPU %d", cpu);
+  }
+
+  // only one of the loops is woken per incoming connection
+  struct epoll_event listenEvent = {.events = EPOLLIN | EPOLLEXCLUSIVE,
+                                    .data.ptr = NULL};
+  struct epoll_event wakeEvent = {.events = EPOLLIN,
+                                  .data.ptr = &loop->wakeFd};
+  if (epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, listenFd, &listenEvent) != 0 ||
+      epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, wakeFd, &wakeEvent) != 0) {
+    async_log(LOG_ERR, "Could not register the event loop sources");
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+// the CPU for loop @ref index: the process's allowed CPUs, in turn
+static int pick_cpu(const cpu_set_t *allowed, unsigned index) {
+  const int allowedCount = CPU_COUNT(allowed);
+  int skip = allowedCount > 0 ? (int)(index % allowedCount) : 0;
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, allowed) && skip-- == 0) {
+      return cpu;
+    }
+  }
+  return -1;
+}
+
+int run_event_loops(const int *listenFds, unsigned listenFdCount,
+                    const server_options_t *options, storage_t *storage,
+                    volatile sig_atomic_t *stopFlag) {
+  const unsigned threadCount = options->eventLoopThreads;
+  if (threadCount == 0 || (listenFdCount != 1 && listenFdCount != threadCount)) {
+    return EXIT_FAILURE;
+  }
+
+  for (unsigned i = 0; i < listenFdCount; ++i) {
+    const int listenFlags = fcntl(listenFds[i], F_GETFL);
+    if (listenFlags == -1 ||
+        fcntl(listenFds[i], F_SETFL, listenFlags | O_NONBLOCK) != 0) {
+      async_log(LOG_ERR, "Could not make the listening socket non-blocking");
+      return EXIT_FAILURE;
+    }
+  }
+
+  cpu_set_t allowedCpus;
+  CPU_ZERO(&allowedCpus);
+  if (options->pinThreads &&
+      sched_getaffinity(0, sizeof(allowedCpus), &allowedCpus) != 0) {
+    async_log(LOG_WARNING, "Could not get the usable CPUs, not pinning");
+    CPU_ZERO(&allowedCpus);
+  }
+
+  const int wakeFd CLEANUP(cleanup_fd) = eventfd(0, EFD_CLOEXEC);
+  if (wakeFd == -1) {
+    async_log(LOG_ERR, "Could not create the event loop wakeup");
+    return EXIT_FAILURE;
+  }
+
+  event_loop_t *loops = calloc(threadCount, sizeof(event_loop_t));
+  pthread_t *threads = calloc(threadCount, sizeof(pthread_t));
+  if (loops == NULL || threads == NULL) {
+    async_log(LOG_ERR, "Could not allocate event loop storage");
+    free(loops);
+    free(threads);
+    return EXIT_FAILURE;
+  }
+
+  // Signals are only taken by this thread, and only while it waits for events,
+  // so a stop request can't slip in between checking the flag and sleeping
+  sigset_t stopSignals;
+  sigset_t waitMask;
+  sigemptyset(&stopSignals);
+  sigaddset(&stopSignals, SIGINT);
+  sigaddset(&stopSignals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &stopSignals, &waitMask);
+  sigdelset(&waitMask, SIGINT);
+  sigdelset(&waitMask, SIGTERM);
+
+  int result = EXIT_SUCCESS;
+  unsigned loopsCreated = 0;
+  unsigned threadsStarted = 0;
+  for (; loopsCreated < threadCount; ++loopsCreated) {
+    const int listenFd = listenFds[listenFdCount == 1 ? 0 : loopsCreated];
+    const int cpu = CPU_COUNT(&allowedCpus) > 0
+                        ? pick_cpu(&allowedCpus, loopsCreated)
+                        : -1;
+    if (event_loop_init(&loops[loopsCreated], listenFd, wakeFd, cpu, options,
+                        storage, stopFlag) != EXIT_SUCCESS) {
+      event_loop_destroy(&loops[loopsCreated]);
+      result = EXIT_FAILURE;
+      break;
+    }
+  }
+
+  // the first loop runs on this thread
+  for (threadsStarted = 1; result == EXIT_SUCCESS && threadsStarted < threadCount;
+       ++threadsStarted) {
+    if (pthread_create(&threads[threadsStarted], NULL, event_loop_thread,
+                       &loops[threadsStarted]) != 0) {
+      async_log(LOG_ERR, "Could not start an event loop thread");
+      result = EXIT_FAILURE;
+      break;
+    }
+  }
+
+  if (result == EXIT_SUCCESS) {
+    loops[0].waitMask = &waitMask;
+    event_loop_run(&loops[0]);
+  }
+
+  // wake every other loop so they can shut down
+  eventfd_write(wakeFd, 1);
+  for (unsigned i = 1; i < threadsStarted; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+
+  for (unsigned i = 0; i < loopsCreated; ++i) {
+    if (loops[i].result != EXIT_SUCCESS) {
+      result = EXIT_FAILURE;
+    }
+    event_loop_destroy(&loops[i]);
+  }
+  free(loops);
+  free(threads);
+
+  pthread_sigmask(SIG_UNBLOCK, &stopSignals, NULL);
+  return result;
+}
@@ -0,0 +1,35 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <signal.h>
+
+#include "server_options.h"
+#include "storage.h"
+
+/**
+ * @brief Serve connections from edge-triggered epoll event loops instead of a
+ * thread per connection.
+ *
+ * Every loop thread watches a listening socket and owns the connections it
+ * accepts.  The loops either share one socket, or each accepts on its own
+ * SO_REUSEPORT socket so accepting scales across cores too.  Connections are non-blocking: each one is a small state struct that
+ * reads until a newline, stores the packet and then replays the storage as the
+ * socket becomes writable (then reads the next packet, for persistent
+ * sessions).  The calling thread runs the first loop, so this only returns
+ * once the server is stopped.
+ *
+ * @param listenFds listening sockets, switched to non-blocking mode
+ * @param listenFdCount 1 to share the socket between every loop, else one
+ * socket per loop (eventLoopThreads of them)
+ * @param options server options: eventLoopThreads (at least 1), pinThreads and
+ * the connection behavior.  Must outlive the loops
+ * @param storage the storage backend, shared by every loop
+ * @param stopFlag set by the SIGINT/SIGTERM handler to stop the server
+ * @return EXIT_SUCCESS when stopped by a signal, EXIT_FAILURE on error.  The
+ * program should clean up and close on EXIT_FAILURE
+ */
+int run_event_loops(const int *listenFds, unsigned listenFdCount,
+                    const server_options_t *options, storage_t *storage,
+                    volatile sig_atomic_t *stopFlag);
+
+#endif
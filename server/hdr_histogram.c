@@ -0,0 +1,193 @@
+#include "hdr_histogram.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_SIGNIFICANT_FIGURES (5)
+#define MAX_HALVINGS (64) // percentile ticks stop well before this
+
+// the counts slot a value falls into
+static int32_t counts_index(const hdr_histogram_t *histogram, int64_t value) {
+  const int pow2Ceiling =
+      64 - __builtin_clzll((uint64_t)(value | histogram->subBucketMask));
+  const int bucket = pow2Ceiling - (histogram->subBucketHalfMagnitude + 1);
+  const int32_t subBucket = (int32_t)(value >> bucket);
+  return ((bucket + 1) << histogram->subBucketHalfMagnitude) +
+         (subBucket - histogram->subBucketHalfCount);
+}
+
+// lowest value and width of the range counted in a slot
+static int64_t lowest_value_at(const hdr_histogram_t *histogram, int32_t index,
+                               int64_t *out_width) {
+  int bucket = (index >> histogram->subBucketHalfMagnitude) - 1;
+  int64_t subBucket = (index & (histogram->subBucketHalfCount - 1)) +
+                      histogram->subBucketHalfCount;
+  if (bucket < 0) {
+    subBucket -= histogram->subBucketHalfCount;
+    bucket = 0;
+  }
+  *out_width = (int64_t)1 << bucket;
+  return subBucket << bucket;
+}
+
+static int64_t highest_value_at(const hdr_histogram_t *histogram,
+                                int32_t index) {
+  int64_t width;
+  const int64_t lowest = lowest_value_at(histogram, index, &width);
+  return lowest + width - 1;
+}
+
+int hdr_histogram_init(hdr_histogram_t *histogram, int64_t highestTrackable,
+                       int significantFigures) {
+  memset(histogram, 0, sizeof(*histogram));
+  if (highestTrackable < 2 || significantFigures < 1 ||
+      significantFigures > MAX_SIGNIFICANT_FIGURES) {
+    return EXIT_FAILURE;
+  }
+
+  // enough linear sub-buckets to tell 2 * 10^figures values apart
+  int64_t largestSingleUnit = 2;
+  for (int i = 0; i < significantFigures; ++i) {
+    largestSingleUnit *= 10;
+  }
+  int subBucketMagnitude = 0;
+  while (((int64_t)1 << subBucketMagnitude) < largestSingleUnit) {
+    ++subBucketMagnitude;
+  }
+  const int64_t subBucketCount = (int64_t)1 << subBucketMagnitude;
+
+  // each bucket doubles the range of the one before
+  int buckets = 1;
+  for (int64_t smallestUntracked = subBucketCount;
+       smallestUntracked <= highestTrackable; smallestUntracked <<= 1) {
+    ++buckets;
+    if (smallestUntracked > INT64_MAX / 2) {
+      break;
+    }
+  }
+
+  histogram->highestTrackable = highestTrackable;
+  histogram->subBucketHalfMagnitude = subBucketMagnitude - 1;
+  histogram->subBucketHalfCount = (int32_t)(subBucketCount / 2);
+  histogram->subBucketMask = subBucketCount - 1;
+  histogram->countsLength = (buckets + 1) * histogram->subBucketHalfCount;
+  histogram->counts = calloc(histogram->countsLength, sizeof(int64_t));
+  histogram->minValue = INT64_MAX;
+  return histogram->counts == NULL ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+void hdr_histogram_destroy(hdr_histogram_t *histogram) {
+  free(histogram->counts);
+  histogram->counts = NULL;
+}
+
+void hdr_histogram_record(hdr_histogram_t *histogram, int64_t value) {
+  if (value < 0) {
+    value = 0;
+  } else if (value > histogram->highestTrackable) {
+    value = histogram->highestTrackable;
+  }
+  ++histogram->counts[counts_index(histogram, value)];
+  ++histogram->totalCount;
+  if (value < histogram->minValue) {
+    histogram->minValue = value;
+  }
+  if (value > histogram->maxValue) {
+    histogram->maxValue = value;
+  }
+}
+
+int hdr_histogram_add(hdr_histogram_t *to, const hdr_histogram_t *from) {
+  if (to->countsLength != from->countsLength ||
+      to->subBucketHalfCount != from->subBucketHalfCount) {
+    return EXIT_FAILURE;
+  }
+  for (int32_t i = 0; i < from->countsLength; ++i) {
+    to->counts[i] += from->counts[i];
+  }
+  to->totalCount += from->totalCount;
+  if (from->minValue < to->minValue) {
+    to->minValue = from->minValue;
+  }
+  if (from->maxValue > to->maxValue) {
+    to->maxValue = from->maxValue;
+  }
+  return EXIT_SUCCESS;
+}
+
+// value at a percentile, and how many values are at or below it
+static int64_t value_and_count_at(const hdr_histogram_t *histogram,
+                                  double percentile, int64_t *out_countAtValue) {
+  if (percentile > 100.0) {
+    percentile = 100.0;
+  }
+  int64_t target = (int64_t)ceil(percentile / 100.0 * histogram->totalCount);
+  if (target < 1) {
+    target = 1;
+  }
+  int64_t seen = 0;
+  for (int32_t i = 0; i < histogram->countsLength; ++i) {
+    seen += histogram->counts[i];
+    if (seen >= target) {
+      *out_countAtValue = seen;
+      const int64_t value = highest_value_at(histogram, i);
+      return value < histogram->maxValue ? value : histogram->maxValue;
+    }
+  }
+  *out_countAtValue = histogram->totalCount;
+  return histogram->maxValue;
+}
+
+int64_t hdr_histogram_value_at(const hdr_histogram_t *histogram,
+                               double percentile) {
+  if (histogram->totalCount == 0) {
+    return 0;
+  }
+  int64_t countAtValue;
+  return value_and_count_at(histogram, percentile, &countAtValue);
+}
+
+static double mean_value(const hdr_histogram_t *histogram) {
+  double total = 0;
+  for (int32_t i = 0; i < histogram->countsLength; ++i) {
+    if (histogram->counts[i] != 0) {
+      int64_t width;
+      const int64_t lowest = lowest_value_at(histogram, i, &width);
+      total += (lowest + width / 2.0) * histogram->counts[i];
+    }
+  }
+  return total / histogram->totalCount;
+}
+
+void hdr_histogram_print(const hdr_histogram_t *histogram, FILE *stream,
+                         double valueScale, int ticksPerHalf) {
+  fprintf(stream, "%12s %14s %10s %14s\n\n", "Value", "Percentile",
+          "TotalCount", "1/(1-Percentile)");
+  if (histogram->totalCount == 0) {
+    return;
+  }
+
+  // ticksPerHalf steps to 50%, as many again to 75%, to 87.5%, ...
+  int64_t countAtValue = 0;
+  for (int halving = 0;
+       halving < MAX_HALVINGS && countAtValue < histogram->totalCount;
+       ++halving) {
+    const double remaining = 100.0 / ((int64_t)1 << halving);
+    for (int tick = 0; tick < ticksPerHalf; ++tick) {
+      const double percentile =
+          100.0 - remaining + remaining / 2 * tick / ticksPerHalf;
+      const int64_t value =
+          value_and_count_at(histogram, percentile, &countAtValue);
+      fprintf(stream, "%12.3f %14.12f %10ld %14.2f\n", value / valueScale,
+              percentile / 100, (long)countAtValue,
+              1 / (1 - percentile / 100));
+    }
+  }
+  fprintf(stream, "%12.3f %14.12f %10ld\n", histogram->maxValue / valueScale,
+          1.0, (long)histogram->totalCount);
+  fprintf(stream, "#[Mean    = %12.3f, Min         = %12.3f]\n",
+          mean_value(histogram) / valueScale,
+          histogram->minValue / valueScale);
+  fprintf(stream, "#[Max     = %12.3f, Total count = %12ld]\n",
+          histogram->maxValue / valueScale, (long)histogram->totalCount);
+}
@@ -0,0 +1,88 @@
+#ifndef HDR_HISTOGRAM_H
+#define HDR_HISTOGRAM_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * @brief High dynamic range histogram of non-negative integer values.
+ *
+ * Values are bucketed by powers of two, and each bucket is split into linear
+ * sub-buckets, so every recorded value is kept to a fixed number of
+ * significant decimal digits no matter its magnitude.  Recording is O(1) and
+ * never allocates, so it can sit on a latency measurement path.
+ *
+ * Not thread safe: give every thread its own histogram and merge them with
+ * @ref hdr_histogram_add afterwards.
+ */
+typedef struct {
+  int64_t highestTrackable;   // larger values are clamped to this
+  int subBucketHalfMagnitude; // log2 of subBucketHalfCount
+  int32_t subBucketHalfCount;
+  int64_t subBucketMask; // values below this land in bucket 0
+  int32_t countsLength;
+  int64_t *counts;
+  int64_t totalCount;
+  int64_t minValue;
+  int64_t maxValue;
+} hdr_histogram_t;
+
+/**
+ * @brief Set up an empty histogram
+ *
+ * @param histogram histogram to initialize
+ * @param highestTrackable largest value to tell apart, at least 2
+ * @param significantFigures decimal digits kept per value, 1 to 5
+ * @return EXIT_SUCCESS, or EXIT_FAILURE on bad arguments or no memory
+ */
+int hdr_histogram_init(hdr_histogram_t *histogram, int64_t highestTrackable,
+                       int significantFigures);
+
+/**
+ * @brief Release the histogram's counts.  Usable with CLEANUP()
+ *
+ * @param histogram histogram to destroy
+ */
+void hdr_histogram_destroy(hdr_histogram_t *histogram);
+
+/**
+ * @brief Count one occurrence of @ref value
+ *
+ * Negative values are recorded as 0, values over the trackable range as the
+ * highest trackable value.
+ */
+void hdr_histogram_record(hdr_histogram_t *histogram, int64_t value);
+
+/**
+ * @brief Add every count of @ref from into @ref to
+ *
+ * Both histograms must have been initialized with the same parameters
+ *
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if their layouts differ
+ */
+int hdr_histogram_add(hdr_histogram_t *to, const hdr_histogram_t *from);
+
+/**
+ * @brief Value at a percentile of the recorded values
+ *
+ * @param histogram histogram to query
+ * @param percentile 0 to 100
+ * @return the highest value equivalent to the one at @ref percentile, 0 if
+ * nothing has been recorded
+ */
+int64_t hdr_histogram_value_at(const hdr_histogram_t *histogram,
+                               double percentile);
+
+/**
+ * @brief Print the percentile distribution in the usual HdrHistogram text
+ * layout (value, percentile, total count, 1/(1-percentile))
+ *
+ * @param histogram histogram to print
+ * @param stream where to print
+ * @param valueScale recorded values are divided by this when printed
+ * @param ticksPerHalf percentile steps between each halving of the remainder
+ */
+void hdr_histogram_print(const hdr_histogram_t *histogram, FILE *stream,
+                         double valueScale, int ticksPerHalf);
+
+#endif
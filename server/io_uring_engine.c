@@ -0,0 +1,643 @@
+#include "io_uring_engine.h"
+#include "async_log.h"
+#include "buffer_pool.h"
+#include "cleanup.h"
+#include "line_framer.h"
+#include "metrics.h"
+#include "server_behavior.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define RING_ENTRIES (256)
+#define RECV_BUFFER_COUNT (256) // power of two, the kernel requires it
+#define RECV_BUFFER_SIZE (4096)
+#define RECV_BUFFER_GROUP (0)
+#define NS_PER_MS (1000000)
+#define NS_PER_SEC (1000000000)
+
+// What a completion belongs to, kept in the low bits of its user_data.
+// Connection pointers are malloc-aligned, so those bits are free
+#define TAG_ACCEPT ((uint64_t)0) // the multishot accept, no connection
+#define TAG_RECV ((uint64_t)1)
+#define TAG_POLL ((uint64_t)2)
+#define TAG_CANCEL ((uint64_t)3) // the shutdown cancel and linked timeouts, no
+                                 // connection
+#define TAG_MASK ((uint64_t)3)
+
+// Raw submission and completion rings, as mapped from the kernel
+typedef struct {
+  int fd;
+  void *sqRing;
+  size_t sqRingSize;
+  void *cqRing;
+  size_t cqRingSize;
+  struct io_uring_sqe *sqes;
+  size_t sqesSize;
+  unsigned *sqHead;
+  unsigned *sqTail;
+  unsigned sqMask;
+  unsigned sqEntries;
+  unsigned sqLocalTail;  // queued by us, published to sqTail on submit
+  unsigned sqSubmitted;  // handed to the kernel so far
+  unsigned *cqHead;
+  unsigned *cqTail;
+  unsigned cqMask;
+  struct io_uring_cqe *cqes;
+} uring_t;
+
+struct uring_connection_t {
+  int fd;
+  line_framer_t framer;
+  replay_cursor_t replay; // what is left to send back
+  uint64_t packetStart; // when the packet being received started arriving
+  uint64_t readDeadline; // when the packet being received must be complete
+  struct __kernel_timespec timeout; // of the armed recv or poll
+  char clientAddr[INET_ADDRSTRLEN];
+  LIST_ENTRY(uring_connection_t) _entry;
+};
+
+LIST_HEAD(uring_connection_list_head_t, uring_connection_t);
+
+typedef struct {
+  uring_t ring;
+  struct io_uring_buf_ring *bufRing;
+  char *bufData;
+  unsigned short bufTail;
+  int listenFd;
+  storage_t *storage;
+  const server_options_t *options;
+  volatile sig_atomic_t *stopFlag;
+  replay_buffer_t replayBuffer; // copy space for backends that can't send
+                                // directly
+  unsigned inFlight; // requests the kernel still owes a final completion for
+  bool draining;     // shutting down, nothing new may be armed
+  struct uring_connection_list_head_t connections;
+} uring_engine_t;
+
+static int uring_setup(unsigned entries, struct io_uring_params *params) {
+  return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned toSubmit, unsigned minComplete,
+                       unsigned flags, const sigset_t *waitMask) {
+  return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags,
+                      waitMask, waitMask == NULL ? 0 : _NSIG / 8);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg,
+                          unsigned argCount) {
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, argCount);
+}
+
+static void uring_destroy(uring_t *ring) {
+  if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+    munmap(ring->sqes, ring->sqesSize);
+  }
+  if (ring->cqRing != NULL && ring->cqRing != MAP_FAILED &&
+      ring->cqRing != ring->sqRing) {
+    munmap(ring->cqRing, ring->cqRingSize);
+  }
+  if (ring->sqRing != NULL && ring->sqRing != MAP_FAILED) {
+    munmap(ring->sqRing, ring->sqRingSize);
+  }
+  cleanup_fd(&ring->fd);
+}
+
+static int uring_init(uring_t *ring, unsigned entries) {
+  bzero(ring, sizeof(*ring));
+  struct io_uring_params params;
+  bzero(&params, sizeof(params));
+  ring->fd = uring_setup(entries, &params);
+  if (ring->fd < 0) {
+    ring->fd = -1;
+    return EXIT_FAILURE;
+  }
+
+  ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cqRingSize =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cqRingSize > ring->sqRingSize) {
+      ring->sqRingSize = ring->cqRingSize;
+    }
+    ring->cqRingSize = ring->sqRingSize;
+  }
+  ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sqRing == MAP_FAILED) {
+    uring_destroy(ring);
+    return EXIT_FAILURE;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cqRing = ring->sqRing;
+  } else {
+    ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cqRing == MAP_FAILED) {
+      uring_destroy(ring);
+      return EXIT_FAILURE;
+    }
+  }
+  ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    uring_destroy(ring);
+    return EXIT_FAILURE;
+  }
+
+  char *sq = ring->sqRing;
+  char *cq = ring->cqRing;
+  ring->sqHead = (unsigned *)(sq + params.sq_off.head);
+  ring->sqTail = (unsigned *)(sq + params.sq_off.tail);
+  ring->sqMask = *(unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sqEntries = params.sq_entries;
+  ring->cqHead = (unsigned *)(cq + params.cq_off.head);
+  ring->cqTail = (unsigned *)(cq + params.cq_off.tail);
+  ring->cqMask = *(unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  ring->sqLocalTail = ring->sqSubmitted = *ring->sqTail;
+
+  // submission slots are always used in order, so the index array is fixed
+  unsigned *sqArray = (unsigned *)(sq + params.sq_off.array);
+  for (unsigned i = 0; i < ring->sqEntries; ++i) {
+    sqArray[i] = i;
+  }
+  return EXIT_SUCCESS;
+}
+
+// hand queued submissions to the kernel, optionally waiting for a completion
+static int uring_submit(uring_t *ring, unsigned minComplete,
+                        const sigset_t *waitMask) {
+  __atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+  const unsigned toSubmit = ring->sqLocalTail - ring->sqSubmitted;
+  const int submitted =
+      uring_enter(ring->fd, toSubmit, minComplete,
+                  minComplete > 0 ? IORING_ENTER_GETEVENTS : 0, waitMask);
+  if (submitted > 0) {
+    ring->sqSubmitted += submitted;
+  }
+  return submitted < 0 ? -errno : submitted;
+}
+
+// make room for @ref count submissions in a row, so a linked pair never
+// straddles a submit
+static bool uring_reserve(uring_t *ring, unsigned count) {
+  unsigned head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+  if (ring->sqLocalTail - head + count > ring->sqEntries) {
+    // full: push what is queued so the kernel frees up slots
+    uring_submit(ring, 0, NULL);
+    head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+  }
+  return ring->sqLocalTail - head + count <= ring->sqEntries;
+}
+
+static struct io_uring_sqe *uring_get_sqe(uring_t *ring) {
+  if (!uring_reserve(ring, 1)) {
+    return NULL;
+  }
+  struct io_uring_sqe *sqe = &ring->sqes[ring->sqLocalTail & ring->sqMask];
+  ++ring->sqLocalTail;
+  bzero(sqe, sizeof(*sqe));
+  return sqe;
+}
+
+// give a receive buffer back to the kernel
+static void recycle_buffer(uring_engine_t *engine, unsigned short bufferId) {
+  struct io_uring_buf *buf =
+      &engine->bufRing->bufs[engine->bufTail & (RECV_BUFFER_COUNT - 1)];
+  buf->addr = (uint64_t)(uintptr_t)(engine->bufData +
+                                    (size_t)bufferId * RECV_BUFFER_SIZE);
+  buf->len = RECV_BUFFER_SIZE;
+  buf->bid = bufferId;
+  ++engine->bufTail;
+  __atomic_store_n(&engine->bufRing->tail, engine->bufTail, __ATOMIC_RELEASE);
+}
+
+static int setup_buffer_ring(uring_engine_t *engine) {
+  engine->bufRing = mmap(NULL, RECV_BUFFER_COUNT * sizeof(struct io_uring_buf),
+                         PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                         -1, 0);
+  if (engine->bufRing == MAP_FAILED) {
+    engine->bufRing = NULL;
+    return EXIT_FAILURE;
+  }
+  engine->bufData = malloc((size_t)RECV_BUFFER_COUNT * RECV_BUFFER_SIZE);
+  if (engine->bufData == NULL) {
+    return EXIT_FAILURE;
+  }
+
+  struct io_uring_buf_reg registration;
+  bzero(&registration, sizeof(registration));
+  registration.ring_addr = (uint64_t)(uintptr_t)engine->bufRing;
+  registration.ring_entries = RECV_BUFFER_COUNT;
+  registration.bgid = RECV_BUFFER_GROUP;
+  if (uring_register(engine->ring.fd, IORING_REGISTER_PBUF_RING, &registration,
+                     1) != 0) {
+    return EXIT_FAILURE;
+  }
+  for (unsigned short i = 0; i < RECV_BUFFER_COUNT; ++i) {
+    recycle_buffer(engine, i);
+  }
+  return EXIT_SUCCESS;
+}
+
+bool io_uring_engine_available(void) {
+  uring_engine_t engine;
+  bzero(&engine, sizeof(engine));
+  if (uring_init(&engine.ring, 4) != EXIT_SUCCESS) {
+    return false;
+  }
+
+  // every opcode the engine submits must be known to this kernel
+  const size_t probeSize =
+      sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = calloc(1, probeSize);
+  bool available =
+      probe != NULL &&
+      uring_register(engine.ring.fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+  const int requiredOps[] = {IORING_OP_ACCEPT, IORING_OP_RECV,
+                             IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL,
+                             IORING_OP_LINK_TIMEOUT};
+  for (size_t i = 0; available && i < sizeof(requiredOps) / sizeof(int); ++i) {
+    available = requiredOps[i] <= probe->last_op &&
+                (probe->ops[requiredOps[i]].flags & IO_URING_OP_SUPPORTED);
+  }
+  free(probe);
+
+  // provided buffer rings arrived together with multishot accept (5.19)
+  available = available && setup_buffer_ring(&engine) == EXIT_SUCCESS;
+
+  uring_destroy(&engine.ring);
+  if (engine.bufRing != NULL) {
+    munmap(engine.bufRing, RECV_BUFFER_COUNT * sizeof(struct io_uring_buf));
+  }
+  free(engine.bufData);
+  return available;
+}
+
+static int arm_accept(uring_engine_t *engine) {
+  struct io_uring_sqe *sqe =
+      engine->draining ? NULL : uring_get_sqe(&engine->ring);
+  if (sqe == NULL) {
+    return EXIT_FAILURE;
+  }
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = engine->listenFd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  sqe->user_data = TAG_ACCEPT;
+  ++engine->inFlight;
+  return EXIT_SUCCESS;
+}
+
+// Bound the request just queued by a timeout: the kernel cancels it with
+// -ECANCELED if it is still pending then.  Its own completion is ignored
+static void link_timeout(uring_engine_t *engine, struct io_uring_sqe *request,
+                         struct uring_connection_t *connection,
+                         uint64_t timeoutNs, bool absolute) {
+  request->flags |= IOSQE_IO_LINK;
+  connection->timeout.tv_sec = timeoutNs / NS_PER_SEC;
+  connection->timeout.tv_nsec = timeoutNs % NS_PER_SEC;
+  struct io_uring_sqe *sqe = uring_get_sqe(&engine->ring); // reserved
+  sqe->opcode = IORING_OP_LINK_TIMEOUT;
+  sqe->addr = (uint64_t)(uintptr_t)&connection->timeout;
+  sqe->len = 1;
+  sqe->timeout_flags = absolute ? IORING_TIMEOUT_ABS : 0; // CLOCK_MONOTONIC
+  sqe->user_data = TAG_CANCEL;
+}
+
+static int arm_recv(uring_engine_t *engine,
+                    struct uring_connection_t *connection) {
+  const bool timed = engine->options->readTimeoutMs > 0;
+  if (engine->draining || !uring_reserve(&engine->ring, timed ? 2 : 1)) {
+    return EXIT_FAILURE;
+  }
+  struct io_uring_sqe *sqe = uring_get_sqe(&engine->ring);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = connection->fd;
+  sqe->flags = IOSQE_BUFFER_SELECT; // the kernel picks the buffer on arrival
+  sqe->buf_group = RECV_BUFFER_GROUP;
+  // receive no more than the framer may still take, as the other engines do,
+  // so lines sent back to back don't add up past the limit in one completion.
+  // With no room left this is 0, a whole buffer, and the framer rejects it
+  const line_framer_t *framer = &connection->framer;
+  const size_t room = framer->maxCapacity - line_framer_pending(framer);
+  sqe->len = room < RECV_BUFFER_SIZE ? room : RECV_BUFFER_SIZE;
+  sqe->user_data = (uint64_t)(uintptr_t)connection | TAG_RECV;
+  if (timed) {
+    // the whole packet is due by one deadline, however it trickles in
+    link_timeout(engine, sqe, connection, connection->readDeadline, true);
+  }
+  ++engine->inFlight;
+  return EXIT_SUCCESS;
+}
+
+static int arm_poll_writable(uring_engine_t *engine,
+                             struct uring_connection_t *connection) {
+  const bool timed = engine->options->writeTimeoutMs > 0;
+  if (engine->draining || !uring_reserve(&engine->ring, timed ? 2 : 1)) {
+    return EXIT_FAILURE;
+  }
+  struct io_uring_sqe *sqe = uring_get_sqe(&engine->ring);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = connection->fd;
+  sqe->poll32_events = POLLOUT;
+  sqe->user_data = (uint64_t)(uintptr_t)connection | TAG_POLL;
+  if (timed) {
+    // the client makes room within the write timeout, or is dropped
+    link_timeout(engine, sqe, connection,
+                 (uint64_t)engine->options->writeTimeoutMs * NS_PER_MS, false);
+  }
+  ++engine->inFlight;
+  return EXIT_SUCCESS;
+}
+
+// start the read deadline of the next packet
+static void start_read_deadline(uring_engine_t *engine,
+                                struct uring_connection_t *connection) {
+  connection->readDeadline =
+      metrics_now() + (uint64_t)engine->options->readTimeoutMs * NS_PER_MS;
+}
+
+static void close_connection(struct uring_connection_t *connection) {
+  LIST_REMOVE(connection, _entry);
+  metrics_count(METRICS_CONNECTIONS_CLOSED, 1);
+  async_log(LOG_INFO, "Closed connection from %s", connection->clientAddr);
+  cleanup_socket(&connection->fd);
+  line_framer_destroy(&connection->framer);
+  buffer_pool_free(connection, sizeof(*connection));
+}
+
+// Store and replay every buffered packet, then wait for whatever the
+// connection needs next.  Called with no request in flight for it, returns
+// false once it should be closed
+static bool service_connection(uring_engine_t *engine,
+                               struct uring_connection_t *connection,
+                               bool replaying) {
+  while (true) {
+    if (!replaying) {
+      const char *packet = NULL;
+      size_t packetSize = 0;
+      if (!line_framer_next(&connection->framer, &packet, &packetSize)) {
+        return arm_recv(engine, connection) == EXIT_SUCCESS;
+      }
+      metrics_packet_received(&connection->packetStart,
+                              line_framer_pending(&connection->framer) > 0);
+      if (server_store_packet(packet, packetSize, engine->storage,
+                              &connection->replay) != EXIT_SUCCESS) {
+        return false;
+      }
+    }
+
+    switch (server_replay(engine->storage, connection->fd,
+                          &connection->replay, &engine->replayBuffer)) {
+    case REPLAY_COMPLETE:
+      break;
+    case REPLAY_WOULD_BLOCK:
+      return arm_poll_writable(engine, connection) == EXIT_SUCCESS;
+    default:
+      return false;
+    }
+    if (!engine->options->persistentSessions) {
+      return false; // replay complete, one packet per connection
+    }
+    start_read_deadline(engine, connection);
+    replaying = false; // the next packet may already be buffered
+  }
+}
+
+static void handle_accept(uring_engine_t *engine,
+                          const struct io_uring_cqe *cqe) {
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    // the multishot accept ended, start another unless we are stopping
+    --engine->inFlight;
+    if (*engine->stopFlag == 0 && !engine->draining &&
+        arm_accept(engine) != EXIT_SUCCESS) {
+      async_log(LOG_ERR, "Could not re-arm the accept");
+    }
+  }
+  if (cqe->res < 0) {
+    if (cqe->res != -ECANCELED) {
+      async_log(LOG_ERR, "Error when accepting a connection");
+    }
+    return;
+  }
+
+  const int connectionFd = cqe->res;
+  const uint64_t acceptedAt = metrics_now();
+  char clientAddr[INET_ADDRSTRLEN] = "";
+  struct sockaddr_in connectedAddr;
+  socklen_t addrLen = sizeof(connectedAddr);
+  if (getpeername(connectionFd, (struct sockaddr *)&connectedAddr,
+                  &addrLen) == 0) {
+    inet_ntop(AF_INET, &connectedAddr.sin_addr, clientAddr,
+              sizeof(clientAddr));
+  }
+  struct uring_connection_t *connection =
+      buffer_pool_calloc(sizeof(*connection));
+  if (connection == NULL) {
+    server_memory_rejected(clientAddr);
+    cleanup_socket(&connectionFd);
+    return;
+  }
+  connection->fd = connectionFd;
+  memcpy(connection->clientAddr, clientAddr, sizeof(clientAddr));
+  const int framerResult =
+      line_framer_init(&connection->framer, RECV_BUFFER_SIZE,
+                       engine->options->connectionBufferLimit);
+  LIST_INSERT_HEAD(&engine->connections, connection, _entry);
+  metrics_count(METRICS_CONNECTIONS_OPENED, 1);
+  if (framerResult != EXIT_SUCCESS) {
+    server_memory_rejected(connection->clientAddr);
+    close_connection(connection);
+    return;
+  }
+  async_log(LOG_INFO, "Accepted connection from %s", connection->clientAddr);
+
+  start_read_deadline(engine, connection);
+  if (arm_recv(engine, connection) != EXIT_SUCCESS) {
+    close_connection(connection);
+    return;
+  }
+  metrics_record(METRICS_ACCEPT, acceptedAt);
+}
+
+static void handle_recv(uring_engine_t *engine,
+                        struct uring_connection_t *connection,
+                        const struct io_uring_cqe *cqe) {
+  --engine->inFlight;
+  if (cqe->res == -ENOBUFS) {
+    // every buffer was taken in this batch, they are back by the next one
+    if (arm_recv(engine, connection) != EXIT_SUCCESS) {
+      close_connection(connection);
+    }
+    return;
+  }
+  if (cqe->res <= 0) {
+    if (cqe->res == -ECANCELED && !engine->draining) {
+      server_connection_timed_out(connection->clientAddr, true);
+    } else if (cqe->res < 0 && cqe->res != -ECANCELED &&
+               cqe->res != -ECONNRESET) {
+      async_log(LOG_ERR, "Failed to get received data from socket!");
+    }
+    close_connection(connection); // hung up, any unfinished packet is dropped
+    return;
+  }
+
+  const unsigned short bufferId = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+  size_t recvSpace = 0;
+  char *recvBuf =
+      line_framer_reserve(&connection->framer, cqe->res, &recvSpace);
+  if (recvSpace < (size_t)cqe->res) {
+    recvBuf = NULL; // near the limit, less room than was received
+  }
+  if (recvBuf != NULL) {
+    memcpy(recvBuf,
+           engine->bufData + (size_t)bufferId * RECV_BUFFER_SIZE, cqe->res);
+    line_framer_commit(&connection->framer, cqe->res);
+    metrics_received(&connection->packetStart, cqe->res);
+  }
+  recycle_buffer(engine, bufferId);
+  if (recvBuf == NULL) {
+    // the packet is longer than this connection may buffer
+    server_memory_rejected(connection->clientAddr);
+    close_connection(connection);
+    return;
+  }
+
+  if (!service_connection(engine, connection, false)) {
+    close_connection(connection);
+  }
+}
+
+static void handle_poll(uring_engine_t *engine,
+                        struct uring_connection_t *connection,
+                        const struct io_uring_cqe *cqe) {
+  --engine->inFlight;
+  if (cqe->res == -ECANCELED && !engine->draining) {
+    server_connection_timed_out(connection->clientAddr, false);
+  }
+  if (cqe->res < 0 || !service_connection(engine, connection, true)) {
+    close_connection(connection);
+  }
+}
+
+// process every completion that has arrived
+static void reap_completions(uring_engine_t *engine) {
+  uring_t *ring = &engine->ring;
+  unsigned head = *ring->cqHead;
+  const unsigned tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+  for (; head != tail; ++head) {
+    const struct io_uring_cqe cqe = ring->cqes[head & ring->cqMask];
+    // release the slot first, handlers may queue more work
+    __atomic_store_n(ring->cqHead, head + 1, __ATOMIC_RELEASE);
+
+    struct uring_connection_t *connection =
+        (struct uring_connection_t *)(uintptr_t)(cqe.user_data & ~TAG_MASK);
+    switch (cqe.user_data & TAG_MASK) {
+    case TAG_ACCEPT:
+      handle_accept(engine, &cqe);
+      break;
+    case TAG_RECV:
+      handle_recv(engine, connection, &cqe);
+      break;
+    case TAG_POLL:
+      handle_poll(engine, connection, &cqe);
+      break;
+    default: // TAG_CANCEL, nothing is waiting on it
+      break;
+    }
+  }
+}
+
+// cancel everything outstanding and wait until the kernel is done with it
+static void drain_requests(uring_engine_t *engine) {
+  engine->draining = true;
+  struct io_uring_sqe *sqe = uring_get_sqe(&engine->ring);
+  if (sqe != NULL) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+    sqe->user_data = TAG_CANCEL;
+  }
+  while (engine->inFlight > 0) {
+    const int result = uring_submit(&engine->ring, 1, NULL);
+    if (result < 0 && result != -EINTR) {
+      break;
+    }
+    reap_completions(engine);
+  }
+}
+
+int run_io_uring_engine(int listenFd, const server_options_t *options,
+                        storage_t *storage, volatile sig_atomic_t *stopFlag) {
+  uring_engine_t engine;
+  bzero(&engine, sizeof(engine));
+  engine.listenFd = listenFd;
+  engine.storage = storage;
+  engine.options = options;
+  engine.stopFlag = stopFlag;
+  LIST_INIT(&engine.connections);
+
+  int result = EXIT_SUCCESS;
+  if (uring_init(&engine.ring, RING_ENTRIES) != EXIT_SUCCESS) {
+    async_log(LOG_ERR, "Could not create the io_uring");
+    return EXIT_FAILURE;
+  }
+  if (setup_buffer_ring(&engine) != EXIT_SUCCESS ||
+      arm_accept(&engine) != EXIT_SUCCESS) {
+    async_log(LOG_ERR, "Could not set up the io_uring engine");
+    result = EXIT_FAILURE;
+  }
+
+  // Signals are only taken while waiting on the ring, so a stop request can't
+  // slip in between checking the flag and sleeping
+  sigset_t stopSignals;
+  sigset_t waitMask;
+  sigemptyset(&stopSignals);
+  sigaddset(&stopSignals, SIGINT);
+  sigaddset(&stopSignals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &stopSignals, &waitMask);
+  sigdelset(&waitMask, SIGINT);
+  sigdelset(&waitMask, SIGTERM);
+
+  while (result == EXIT_SUCCESS && *stopFlag == 0) {
+    const int submitted = uring_submit(&engine.ring, 1, &waitMask);
+    if (submitted < 0 && submitted != -EINTR) {
+      async_log(LOG_ERR, "Waiting for completions failed");
+      result = EXIT_FAILURE;
+      break;
+    }
+    reap_completions(&engine);
+  }
+
+  if (engine.ring.fd != -1) {
+    drain_requests(&engine);
+  }
+  while (!LIST_EMPTY(&engine.connections)) {
+    close_connection(LIST_FIRST(&engine.connections));
+  }
+  pthread_sigmask(SIG_UNBLOCK, &stopSignals, NULL);
+
+  uring_destroy(&engine.ring);
+  if (engine.bufRing != NULL) {
+    munmap(engine.bufRing, RECV_BUFFER_COUNT * sizeof(struct io_uring_buf));
+  }
+  free(engine.bufData);
+  replay_buffer_release(&engine.replayBuffer);
+  return result;
+}
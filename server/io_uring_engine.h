@@ -0,0 +1,41 @@
+#ifndef IO_URING_ENGINE_H
+#define IO_URING_ENGINE_H
+
+#include <signal.h>
+#include <stdbool.h>
+
+#include "server_options.h"
+#include "storage.h"
+
+/**
+ * @brief Whether the running kernel supports everything the io_uring engine
+ * needs (multishot accept and provided buffer rings, Linux 5.19 or later)
+ *
+ * @return true if @ref run_io_uring_engine can be used
+ */
+bool io_uring_engine_available(void);
+
+/**
+ * @brief Serve connections from a single io_uring instead of a thread per
+ * connection.
+ *
+ * One multishot accept keeps delivering connections without re-arming.  Each
+ * connection has exactly one request in flight: a recv that picks its buffer
+ * from a ring of provided buffers (so idle connections pin no memory), or a
+ * poll for writability while a replay is blocked.  Complete packets are stored
+ * through the backend and replayed straight to the non-blocking socket.  The
+ * calling thread runs the ring, so this only returns once the server is
+ * stopped.
+ *
+ * @param listenFd a listening socket
+ * @param options server options: the connection behavior.  Must outlive the
+ * engine
+ * @param storage the storage backend
+ * @param stopFlag set by the SIGINT/SIGTERM handler to stop the server
+ * @return EXIT_SUCCESS when stopped by a signal, EXIT_FAILURE on error.  The
+ * program should clean up and close on EXIT_FAILURE
+ */
+int run_io_uring_engine(int listenFd, const server_options_t *options,
+                        storage_t *storage, volatile sig_atomic_t *stopFlag);
+
+#endif
@@ -0,0 +1,108 @@
+#include "line_framer.h"
+#include "buffer_pool.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+int line_framer_init(line_framer_t *framer, size_t initialCapacity,
+                     size_t maxCapacity) {
+  bzero(framer, sizeof(*framer));
+  framer->maxCapacity = maxCapacity > 0 ? maxCapacity : SIZE_MAX;
+  if (initialCapacity == 0) {
+    initialCapacity = 1;
+  }
+  if (initialCapacity > framer->maxCapacity) {
+    initialCapacity = framer->maxCapacity;
+  }
+  framer->data = buffer_pool_alloc(initialCapacity, &framer->capacity);
+  if (framer->data == NULL) {
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+void line_framer_destroy(line_framer_t *framer) {
+  buffer_pool_free(framer->data, framer->capacity);
+  bzero(framer, sizeof(*framer));
+}
+
+char *line_framer_reserve(line_framer_t *framer, size_t minimumSpace,
+                          size_t *out_space) {
+  if (framer->start == framer->size) {
+    // everything was handed out, start over at the front for free
+    framer->start = framer->size = framer->scanned = 0;
+  }
+
+  // close to the limit, settle for whatever room is left under it, so only a
+  // line longer than the limit fails.  No newline is pending, so a full
+  // buffer already holds a longer line
+  const size_t pending = framer->size - framer->start;
+  if (pending >= framer->maxCapacity) {
+    return NULL;
+  }
+  if (minimumSpace > framer->maxCapacity - pending) {
+    minimumSpace = framer->maxCapacity - pending;
+  }
+
+  if (framer->capacity - framer->size < minimumSpace && framer->start > 0) {
+    // drop the lines already handed out before growing
+    memmove(framer->data, framer->data + framer->start, pending);
+    framer->scanned -= framer->start;
+    framer->size = pending;
+    framer->start = 0;
+  }
+
+  if (framer->capacity - framer->size < minimumSpace) {
+    if (framer->size >= framer->maxCapacity ||
+        minimumSpace > framer->maxCapacity - framer->size) {
+      return NULL; // the line is longer than the limit allows
+    }
+    size_t newCapacity = framer->capacity;
+    while (newCapacity - framer->size < minimumSpace) {
+      newCapacity = newCapacity > framer->maxCapacity / 2
+                        ? framer->maxCapacity
+                        : newCapacity * 2;
+    }
+    // only the pending bytes move, the start was compacted above
+    size_t allocated = 0;
+    char *newData = buffer_pool_alloc(newCapacity, &allocated);
+    if (newData == NULL) {
+      return NULL;
+    }
+    memcpy(newData, framer->data, framer->size);
+    buffer_pool_free(framer->data, framer->capacity);
+    framer->data = newData;
+    framer->capacity = allocated;
+  }
+
+  // the pool may round the buffer past the limit, never offer room beyond it
+  const size_t space = framer->capacity - framer->size;
+  const size_t allowed = framer->maxCapacity - (framer->size - framer->start);
+  *out_space = space < allowed ? space : allowed;
+  return framer->data + framer->size;
+}
+
+void line_framer_commit(line_framer_t *framer, size_t receivedSize) {
+  framer->size += receivedSize;
+}
+
+bool line_framer_next(line_framer_t *framer, const char **out_line,
+                      size_t *out_lineSize) {
+  const char *endOfLine = memchr(framer->data + framer->scanned, '\n',
+                                 framer->size - framer->scanned);
+  if (endOfLine == NULL) {
+    framer->scanned = framer->size; // never search these bytes again
+    return false;
+  }
+
+  *out_line = framer->data + framer->start;
+  *out_lineSize = endOfLine - *out_line + 1; // Incl. newline
+  framer->start += *out_lineSize;
+  framer->scanned = framer->start;
+  return true;
+}
+
+size_t line_framer_pending(const line_framer_t *framer) {
+  return framer->size - framer->start;
+}
@@ -0,0 +1,94 @@
+#ifndef LINE_FRAMER_H
+#define LINE_FRAMER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * @brief Splits a received byte stream into newline-terminated packets.
+ *
+ * Received data is written straight into the framer's buffer, which grows
+ * geometrically up to a limit, so a line costs amortized O(1) copies per
+ * byte.  Buffers come from the buffer pool and count against its budget.
+ * Only bytes that haven't been searched yet are scanned for the newline, and
+ * anything received after a newline is kept for the next packet.
+ *
+ * Typical use:
+ * @code
+ * while (!line_framer_next(&framer, &line, &lineSize)) {
+ *   char *space = line_framer_reserve(&framer, minimum, &spaceSize);
+ *   ssize_t received = recv(fd, space, spaceSize, 0);
+ *   line_framer_commit(&framer, received);
+ * }
+ * @endcode
+ */
+typedef struct {
+  char *data;
+  size_t capacity; // allocated bytes in data
+  size_t maxCapacity; // the buffer never grows past this
+  size_t start;    // first byte not yet returned as part of a line
+  size_t size;     // bytes of data in use, from the buffer start
+  size_t scanned;  // bytes in [start, scanned) are known to hold no newline
+} line_framer_t;
+
+/**
+ * @brief Set up an empty framer
+ *
+ * @param framer framer to initialize
+ * @param initialCapacity first allocation size, in bytes
+ * @param maxCapacity largest the buffer may grow, which bounds the length of
+ * a line, 0 for no limit
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if the buffer couldn't be allocated
+ */
+int line_framer_init(line_framer_t *framer, size_t initialCapacity,
+                     size_t maxCapacity);
+
+/**
+ * @brief Release the framer's buffer.  Usable with CLEANUP()
+ *
+ * @param framer framer to destroy
+ */
+void line_framer_destroy(line_framer_t *framer);
+
+/**
+ * @brief Make room for at least @ref minimumSpace more received bytes
+ *
+ * Invalidates any line previously returned by @ref line_framer_next
+ *
+ * @param framer framer to receive into
+ * @param minimumSpace minimum number of bytes the caller wants, cut down to
+ * the room left under the limit when that is less
+ * @param out_space number of bytes actually available at the returned pointer,
+ * never more than the room left under the limit
+ * @return where to write received data, or NULL if the pending line already
+ * fills the limit, the buffer would grow past the pool's budget, or memory is
+ * out
+ */
+char *line_framer_reserve(line_framer_t *framer, size_t minimumSpace,
+                          size_t *out_space);
+
+/**
+ * @brief Mark bytes written to the reserved space as received
+ *
+ * @param framer framer that was received into
+ * @param receivedSize number of bytes written, at most the reserved space
+ */
+void line_framer_commit(line_framer_t *framer, size_t receivedSize);
+
+/**
+ * @brief Take the next complete line, if one has been received
+ *
+ * @param framer framer to take from
+ * @param out_line start of the line, valid until the next reserve call
+ * @param out_lineSize length of the line, including the newline
+ * @return true if a line was returned, false if more data is needed
+ */
+bool line_framer_next(line_framer_t *framer, const char **out_line,
+                      size_t *out_lineSize);
+
+/**
+ * @brief Number of received bytes not yet returned as part of a line
+ */
+size_t line_framer_pending(const line_framer_t *framer);
+
+#endif
@@ -0,0 +1,163 @@
+/**
+ * @brief Microbenchmark for the line framer
+ *
+ * Feeds single lines from 1 KiB up to 64 MiB through the framer the way a
+ * socket would deliver them (at most RECV_SIZE bytes per recv), and compares
+ * against the original receive loop (1 KiB realloc steps, bzero of the new
+ * tail, strstr over the whole buffer after every recv) for sizes where that
+ * finishes in reasonable time.
+ *
+ * Usage: line_framer_bench [max line size in bytes]
+ */
+#include "line_framer.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#define KIB (1024UL)
+#define MIB (1024UL * KIB)
+
+#define RECV_SIZE (64 * KIB)      // largest chunk handed out by one recv
+#define BUFFER_SIZE_INCREMENT (1024)
+#define LEGACY_MAX_LINE (1 * MIB) // quadratic beyond this, skip it
+#define MIN_BYTES_PER_SIZE (256 * MIB)
+#define MIN_REPETITIONS (3)       // legacy runs only this many, it is slow
+
+static double now_seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// copy from the "socket" like recv would
+static size_t fake_recv(const char *input, size_t inputSize, size_t *consumed,
+                        char *dest, size_t space) {
+  size_t chunk = inputSize - *consumed;
+  chunk = chunk > space ? space : chunk;
+  chunk = chunk > RECV_SIZE ? RECV_SIZE : chunk;
+  memcpy(dest, input + *consumed, chunk);
+  *consumed += chunk;
+  return chunk;
+}
+
+static bool frame_with_framer(const char *input, size_t inputSize) {
+  line_framer_t framer;
+  if (line_framer_init(&framer, BUFFER_SIZE_INCREMENT, 0) != EXIT_SUCCESS) {
+    return false;
+  }
+  const char *line = NULL;
+  size_t lineSize = 0;
+  size_t consumed = 0;
+  while (!line_framer_next(&framer, &line, &lineSize)) {
+    size_t space = 0;
+    char *dest = line_framer_reserve(&framer, BUFFER_SIZE_INCREMENT, &space);
+    if (dest == NULL || consumed == inputSize) {
+      line_framer_destroy(&framer);
+      return false;
+    }
+    line_framer_commit(&framer,
+                       fake_recv(input, inputSize, &consumed, dest, space));
+  }
+  const bool ok = lineSize == inputSize;
+  line_framer_destroy(&framer);
+  return ok;
+}
+
+// the receive loop aesdsocket used before the framer existed
+static bool frame_legacy(const char *input, size_t inputSize) {
+  char *dataBuf = malloc(BUFFER_SIZE_INCREMENT);
+  if (dataBuf == NULL) {
+    return false;
+  }
+  size_t dataBufferAllocationSize = BUFFER_SIZE_INCREMENT;
+  size_t dataBufferSize = 0;
+  size_t consumed = 0;
+  bzero(dataBuf, BUFFER_SIZE_INCREMENT);
+  while (true) {
+    if (consumed == inputSize) {
+      free(dataBuf);
+      return false;
+    }
+    dataBufferSize += fake_recv(input, inputSize, &consumed,
+                                dataBuf + dataBufferSize,
+                                BUFFER_SIZE_INCREMENT - 1);
+    const char *const endOfPacket = strstr(dataBuf, "\n");
+    if (endOfPacket != NULL) {
+      const bool ok = (size_t)(endOfPacket - dataBuf + 1) == inputSize;
+      free(dataBuf);
+      return ok;
+    }
+    char *grown =
+        realloc(dataBuf, dataBufferAllocationSize + BUFFER_SIZE_INCREMENT);
+    if (grown == NULL) {
+      free(dataBuf);
+      return false;
+    }
+    dataBuf = grown;
+    dataBufferAllocationSize += BUFFER_SIZE_INCREMENT;
+    bzero(dataBuf + dataBufferSize, dataBufferAllocationSize - dataBufferSize);
+  }
+}
+
+// run one framing strategy until enough bytes went through, return seconds per
+// line or a negative value on a framing error
+static double time_per_line(bool (*frame)(const char *, size_t),
+                            const char *input, size_t inputSize,
+                            size_t minBytes) {
+  size_t repetitions = minBytes / inputSize;
+  repetitions = repetitions < MIN_REPETITIONS ? MIN_REPETITIONS : repetitions;
+
+  const double start = now_seconds();
+  for (size_t i = 0; i < repetitions; ++i) {
+    if (!frame(input, inputSize)) {
+      return -1;
+    }
+  }
+  return (now_seconds() - start) / repetitions;
+}
+
+static void print_result(const char *name, size_t lineSize, double seconds) {
+  if (seconds < 0) {
+    printf("%-8s %10zu KiB  FAILED\n", name, lineSize / KIB);
+    return;
+  }
+  printf("%-8s %10zu KiB  %12.1f us/line  %10.1f MiB/s\n", name,
+         lineSize / KIB, seconds * 1e6, lineSize / seconds / MIB);
+}
+
+int main(int argc, char **argv) {
+  size_t maxLineSize = 64 * MIB;
+  if (argc > 1) {
+    maxLineSize = strtoul(argv[1], NULL, 0);
+  }
+
+  char *input = malloc(maxLineSize);
+  if (input == NULL) {
+    fprintf(stderr, "Could not allocate %zu bytes of input\n", maxLineSize);
+    return EXIT_FAILURE;
+  }
+
+  int result = EXIT_SUCCESS;
+  for (size_t lineSize = KIB; lineSize <= maxLineSize; lineSize *= 4) {
+    memset(input, 'a', lineSize - 1);
+    input[lineSize - 1] = '\n';
+
+    const double framerTime = time_per_line(frame_with_framer, input, lineSize,
+                                            MIN_BYTES_PER_SIZE);
+    print_result("framer", lineSize, framerTime);
+    if (framerTime < 0) {
+      result = EXIT_FAILURE;
+    }
+
+    if (lineSize <= LEGACY_MAX_LINE) {
+      const double legacyTime = time_per_line(frame_legacy, input, lineSize, 0);
+      print_result("legacy", lineSize, legacyTime);
+    }
+  }
+
+  free(input);
+  return result;
+}
@@ -0,0 +1,56 @@
+#!/usr/bin/env bash
+
+# Checks the -L receive limit on every engine: a line of exactly the limit is
+# stored and replayed, longer lines close the connection unanswered.  600 is
+# not a buffer pool size class, so it also checks that a buffer rounded up past
+# the limit does not let longer lines in.
+# Run from a built tree, as root or as anyone allowed to bind port 9000
+
+port=9000
+cd "$(dirname "$0")" || exit 1
+
+# print the server's reply to one line of $1 bytes, newline included.  The
+# line goes out in one write, so the server may receive all of it at once
+send_line() {
+  exec 3<>"/dev/tcp/127.0.0.1/${port}" || return 1
+  printf '%s\n' "$(head -c $(($1 - 1)) /dev/zero | tr '\0' 'x')" >&3
+  timeout 5 cat <&3
+  exec 3<&-
+}
+
+failures=0
+for limit in 512 600; do
+  for engine in "" "-e 1" "-w 2" "-u"; do
+    # shellcheck disable=SC2086 # the engine options are separate words
+    ./aesdsocket -b ring -L ${limit} -o /dev/null ${engine} &
+    server=$!
+    for _ in $(seq 50); do
+      (exec 3<>"/dev/tcp/127.0.0.1/${port}") 2>/dev/null && break
+      sleep 0.1
+    done
+
+    result="ok  "
+    fits=$(send_line ${limit} | wc -c)
+    if [ "${fits}" -ne ${limit} ]; then
+      echo "FAIL ${engine:-thread}: ${limit} byte line replayed ${fits} bytes"
+      result="FAIL"
+    fi
+    for size in $((limit + 1)) $((limit + 100)) 1000; do
+      over=$(send_line ${size} | wc -c)
+      if [ "${over}" -ne 0 ]; then
+        echo "FAIL ${engine:-thread}: ${size} byte line over the ${limit}" \
+          "byte limit replayed ${over} bytes"
+        result="FAIL"
+      fi
+    done
+    if [ "${result}" = "FAIL" ]; then
+      failures=$((failures + 1))
+    fi
+    echo "${result} -L ${limit} ${engine:-thread}"
+
+    kill ${server}
+    wait ${server} 2>/dev/null
+  done
+done
+
+exit $((failures > 0))
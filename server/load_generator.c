@@ -0,0 +1,456 @@
+/**
+ * @brief Load generator and latency benchmark for the aesdsocket protocol
+ *
+ * Runs CONNECTIONS concurrent clients against a server.  Each client sends
+ * MESSAGES lines of LINE_SIZE bytes, either one connection per line (the
+ * server's default) or all on one connection (-k, for servers run with -s),
+ * and reads each replay back.  Every line is unique, and a replay only counts
+ * as valid if it holds that line whole, so lost or torn writes show up as
+ * invalid replays.
+ *
+ * With -R the clients send at a fixed total rate, and latency is measured from
+ * when each message should have been sent rather than when it was, so a
+ * stalled server is not hidden by clients that waited for it (coordinated
+ * omission).  Latencies go into an HDR histogram per client, merged at the
+ * end.
+ *
+ * Anything after "--" is a server command line: it is started, the load runs
+ * once it listens, and it is stopped with SIGTERM afterwards, so every server
+ * change can be measured the same way on loopback:
+ *
+ *   load_generator -c 16 -n 2000 -- ./aesdsocket -b ring -e 4
+ *
+ * Usage: load_generator [-a address] [-p port] [-c connections]
+ *        [-n messages] [-s line size] [-R messages/s] [-k] [-v]
+ *        [-- server command...]
+ */
+#include "hdr_histogram.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_ADDRESS ("127.0.0.1")
+#define DEFAULT_PORT (9000)
+#define DEFAULT_CONNECTIONS (8)
+#define DEFAULT_MESSAGES (1000)
+#define DEFAULT_LINE_SIZE (64)
+#define MIN_LINE_SIZE (32) // room for the unique prefix and the newline
+#define RECV_SIZE (64 * 1024)
+#define CONNECT_ATTEMPTS (100)
+#define NANOS_PER_SECOND (1000000000LL)
+#define HIGHEST_LATENCY_NS (60 * NANOS_PER_SECOND)
+#define SIGNIFICANT_FIGURES (3)
+
+typedef struct {
+  struct sockaddr_in address;
+  unsigned connections;
+  unsigned messages; // per connection
+  size_t lineSize;   // including the newline
+  double rate;       // total messages per second, 0 for as fast as possible
+  bool keepAlive;
+  bool verbose;
+  char **serverCommand; // NULL when testing an already running server
+} load_options_t;
+
+typedef struct {
+  const load_options_t *options;
+  unsigned id;
+  hdr_histogram_t latencies; // nanoseconds
+  unsigned long valid;
+  unsigned long invalid;
+  unsigned long failed;
+  unsigned long long replayBytes;
+} client_t;
+
+// Streams a replay, looking for one expected line among whole lines
+typedef struct {
+  const char *line;
+  size_t lineSize; // including the newline
+  size_t position; // bytes of the current replay line seen so far
+  bool matching;   // the current replay line is a prefix of the expected one
+  bool lastLineMatched;
+  bool found;
+} line_matcher_t;
+
+static pthread_barrier_t startBarrier;
+static long long startTime; // shared schedule origin for rate limited runs
+
+static long long now_nanos(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * NANOS_PER_SECOND + now.tv_nsec;
+}
+
+static void sleep_until(long long deadline) {
+  const struct timespec until = {.tv_sec = deadline / NANOS_PER_SECOND,
+                                 .tv_nsec = deadline % NANOS_PER_SECOND};
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) ==
+         EINTR) {
+  }
+}
+
+static void line_matcher_reset(line_matcher_t *matcher, const char *line,
+                               size_t lineSize) {
+  *matcher = (line_matcher_t){
+      .line = line, .lineSize = lineSize, .matching = true};
+}
+
+// compare a line at a time instead of a byte at a time
+static void line_matcher_feed(line_matcher_t *matcher, const char *data,
+                              size_t size) {
+  while (size > 0) {
+    const char *newline = memchr(data, '\n', size);
+    const size_t segment = newline != NULL ? (size_t)(newline - data) + 1 : size;
+    if (matcher->matching) {
+      matcher->matching =
+          matcher->position + segment <= matcher->lineSize &&
+          memcmp(matcher->line + matcher->position, data, segment) == 0;
+    }
+    matcher->position += segment;
+    if (newline != NULL) {
+      matcher->lastLineMatched =
+          matcher->matching && matcher->position == matcher->lineSize;
+      matcher->found |= matcher->lastLineMatched;
+      matcher->position = 0;
+      matcher->matching = true;
+    }
+    data += segment;
+    size -= segment;
+  }
+}
+
+static int connect_to_server(const struct sockaddr_in *address) {
+  const int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd == -1) {
+    return -1;
+  }
+  if (connect(fd, (const struct sockaddr *)address, sizeof(*address)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static bool send_all(int fd, const char *data, size_t size) {
+  while (size > 0) {
+    const ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data += sent;
+    size -= sent;
+  }
+  return true;
+}
+
+// read one replay.  Per-message connections end at the server's hang up,
+// kept-alive ones once the replay ends with our line
+static bool receive_replay(client_t *client, int fd, line_matcher_t *matcher,
+                           char *buffer) {
+  while (true) {
+    const ssize_t received = recv(fd, buffer, RECV_SIZE, 0);
+    if (received < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    if (received == 0) {
+      return !client->options->keepAlive;
+    }
+    client->replayBytes += received;
+    line_matcher_feed(matcher, buffer, received);
+    if (client->options->keepAlive && matcher->lastLineMatched &&
+        matcher->position == 0) {
+      return true;
+    }
+  }
+}
+
+static void *client_thread(void *param) {
+  client_t *client = param;
+  const load_options_t *options = client->options;
+  char *line = malloc(options->lineSize);
+  char *buffer = malloc(RECV_SIZE);
+  pthread_barrier_wait(&startBarrier);
+  if (line == NULL || buffer == NULL) {
+    client->failed = options->messages;
+    free(line);
+    free(buffer);
+    return NULL;
+  }
+
+  // clients take turns in the schedule, so the total rate is even
+  const long long interval =
+      options->rate > 0
+          ? (long long)(NANOS_PER_SECOND * options->connections / options->rate)
+          : 0;
+  long long intended = startTime + interval * client->id / options->connections;
+  int fd = -1;
+
+  for (unsigned message = 0; message < options->messages; ++message) {
+    const int prefixSize =
+        snprintf(line, options->lineSize, "%u:%u:", client->id, message);
+    memset(line + prefixSize, 'x', options->lineSize - prefixSize - 1);
+    line[options->lineSize - 1] = '\n';
+
+    long long start = now_nanos();
+    if (interval > 0) {
+      sleep_until(intended);
+      start = intended; // a late send still counts from its slot
+      intended += interval;
+    }
+
+    if (fd == -1) {
+      fd = connect_to_server(&options->address);
+    }
+    line_matcher_t matcher;
+    line_matcher_reset(&matcher, line, options->lineSize);
+    const bool exchanged = fd != -1 &&
+                           send_all(fd, line, options->lineSize) &&
+                           receive_replay(client, fd, &matcher, buffer);
+    const long long end = now_nanos();
+    if (!options->keepAlive || !exchanged) {
+      if (fd != -1) {
+        close(fd);
+      }
+      fd = -1;
+    }
+
+    if (!exchanged) {
+      ++client->failed;
+      continue;
+    }
+    hdr_histogram_record(&client->latencies, end - start);
+    if (matcher.found) {
+      ++client->valid;
+    } else {
+      ++client->invalid;
+    }
+  }
+
+  if (fd != -1) {
+    close(fd);
+  }
+  free(line);
+  free(buffer);
+  return NULL;
+}
+
+static pid_t start_server(char **command, const struct sockaddr_in *address) {
+  const pid_t server = fork();
+  if (server == -1) {
+    perror("fork");
+    return -1;
+  }
+  if (server == 0) {
+    execvp(command[0], command);
+    perror(command[0]);
+    _exit(127);
+  }
+
+  for (unsigned i = 0; i < CONNECT_ATTEMPTS; ++i) {
+    const int probe = connect_to_server(address);
+    if (probe != -1) {
+      close(probe); // an empty connection, the server drops it
+      return server;
+    }
+    if (waitpid(server, NULL, WNOHANG) == server) {
+      fprintf(stderr, "The server exited before it was listening\n");
+      return -1;
+    }
+    usleep(50000);
+  }
+  fprintf(stderr, "The server never started listening\n");
+  kill(server, SIGKILL);
+  waitpid(server, NULL, 0);
+  return -1;
+}
+
+// SIGTERM may be taken by a thread blocked elsewhere than accept, so connect
+// once more to wake up the acceptor
+static int stop_server(pid_t server, const struct sockaddr_in *address) {
+  kill(server, SIGTERM);
+  const int fd = connect_to_server(address);
+  if (fd != -1) {
+    close(fd);
+  }
+  int status;
+  if (waitpid(server, &status, 0) != server) {
+    return EXIT_FAILURE;
+  }
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? EXIT_SUCCESS
+                                                       : EXIT_FAILURE;
+}
+
+static void usage(const char *program) {
+  fprintf(stderr,
+          "Usage: %s [-a address] [-p port] [-c connections] [-n messages] "
+          "[-s line size] [-R messages/s] [-k] [-v] [-- server command...]\n"
+          "  -a  server IPv4 address (default %s)\n"
+          "  -p  server port (default %d)\n"
+          "  -c  concurrent connections (default %d)\n"
+          "  -n  messages per connection (default %d)\n"
+          "  -s  line size in bytes, newline included (default %d, at least "
+          "%d)\n"
+          "  -R  total messages per second, 0 for as fast as possible "
+          "(default 0)\n"
+          "  -k  send every message on one connection (server run with -s)\n"
+          "  -v  print the whole latency distribution\n",
+          program, DEFAULT_ADDRESS, DEFAULT_PORT, DEFAULT_CONNECTIONS,
+          DEFAULT_MESSAGES, DEFAULT_LINE_SIZE, MIN_LINE_SIZE);
+}
+
+static int parse_options(int argc, char **argv, load_options_t *out_options) {
+  *out_options = (load_options_t){
+      .address = {.sin_family = AF_INET, .sin_port = htons(DEFAULT_PORT)},
+      .connections = DEFAULT_CONNECTIONS,
+      .messages = DEFAULT_MESSAGES,
+      .lineSize = DEFAULT_LINE_SIZE,
+  };
+  const char *address = DEFAULT_ADDRESS;
+  int opt;
+  while ((opt = getopt(argc, argv, "a:p:c:n:s:R:kv")) != -1) {
+    switch (opt) {
+    case 'a':
+      address = optarg;
+      break;
+    case 'p':
+      out_options->address.sin_port = htons(strtoul(optarg, NULL, 0));
+      break;
+    case 'c':
+      out_options->connections = strtoul(optarg, NULL, 0);
+      break;
+    case 'n':
+      out_options->messages = strtoul(optarg, NULL, 0);
+      break;
+    case 's':
+      out_options->lineSize = strtoul(optarg, NULL, 0);
+      break;
+    case 'R':
+      out_options->rate = strtod(optarg, NULL);
+      break;
+    case 'k':
+      out_options->keepAlive = true;
+      break;
+    case 'v':
+      out_options->verbose = true;
+      break;
+    default:
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (inet_pton(AF_INET, address, &out_options->address.sin_addr) != 1 ||
+      out_options->connections == 0 || out_options->messages == 0 ||
+      out_options->lineSize < MIN_LINE_SIZE || out_options->rate < 0) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  out_options->serverCommand = optind < argc ? argv + optind : NULL;
+  return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv) {
+  load_options_t options;
+  if (parse_options(argc, argv, &options) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+
+  client_t *clients = calloc(options.connections, sizeof(*clients));
+  pthread_t *threads = calloc(options.connections, sizeof(*threads));
+  if (clients == NULL || threads == NULL) {
+    fprintf(stderr, "Could not allocate %u clients\n", options.connections);
+    return EXIT_FAILURE;
+  }
+  for (unsigned i = 0; i < options.connections; ++i) {
+    clients[i] = (client_t){.options = &options, .id = i};
+    if (hdr_histogram_init(&clients[i].latencies, HIGHEST_LATENCY_NS,
+                           SIGNIFICANT_FIGURES) != EXIT_SUCCESS) {
+      fprintf(stderr, "Could not allocate the latency histograms\n");
+      return EXIT_FAILURE;
+    }
+  }
+
+  pid_t server = -1;
+  if (options.serverCommand != NULL &&
+      (server = start_server(options.serverCommand, &options.address)) == -1) {
+    return EXIT_FAILURE;
+  }
+
+  printf("%u connections x %u messages of %zu bytes, %s, ",
+         options.connections, options.messages, options.lineSize,
+         options.keepAlive ? "kept alive" : "one connection per message");
+  if (options.rate > 0) {
+    printf("%.0f msgs/s\n", options.rate);
+  } else {
+    printf("unlimited rate\n");
+  }
+  fflush(stdout);
+
+  // the main thread joins the barrier last and sets the schedule origin
+  pthread_barrier_init(&startBarrier, NULL, options.connections + 1);
+  for (unsigned i = 0; i < options.connections; ++i) {
+    pthread_create(&threads[i], NULL, client_thread, &clients[i]);
+  }
+  startTime = now_nanos();
+  pthread_barrier_wait(&startBarrier);
+
+  hdr_histogram_t latencies;
+  hdr_histogram_init(&latencies, HIGHEST_LATENCY_NS, SIGNIFICANT_FIGURES);
+  unsigned long valid = 0, invalid = 0, failed = 0;
+  unsigned long long replayBytes = 0;
+  for (unsigned i = 0; i < options.connections; ++i) {
+    pthread_join(threads[i], NULL);
+    hdr_histogram_add(&latencies, &clients[i].latencies);
+    valid += clients[i].valid;
+    invalid += clients[i].invalid;
+    failed += clients[i].failed;
+    replayBytes += clients[i].replayBytes;
+    hdr_histogram_destroy(&clients[i].latencies);
+  }
+  const double seconds = (now_nanos() - startTime) / (double)NANOS_PER_SECOND;
+  pthread_barrier_destroy(&startBarrier);
+
+  int result = EXIT_SUCCESS;
+  if (server != -1 && stop_server(server, &options.address) != EXIT_SUCCESS) {
+    fprintf(stderr, "The server did not exit cleanly\n");
+    result = EXIT_FAILURE;
+  }
+
+  printf("%lu valid, %lu invalid, %lu failed in %.2f s\n", valid, invalid,
+         failed, seconds);
+  printf("throughput %.0f msgs/s, replayed %.1f MiB/s\n",
+         (valid + invalid) / seconds, replayBytes / seconds / (1024 * 1024));
+  printf("latency us: p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+         hdr_histogram_value_at(&latencies, 50) / 1e3,
+         hdr_histogram_value_at(&latencies, 90) / 1e3,
+         hdr_histogram_value_at(&latencies, 99) / 1e3,
+         hdr_histogram_value_at(&latencies, 99.9) / 1e3,
+         latencies.maxValue / 1e3);
+  if (options.verbose) {
+    printf("\n");
+    hdr_histogram_print(&latencies, stdout, 1e3, 5);
+  }
+
+  hdr_histogram_destroy(&latencies);
+  free(clients);
+  free(threads);
+  if (invalid != 0 || failed != 0) {
+    result = EXIT_FAILURE;
+  }
+  return result;
+}
@@ -0,0 +1,378 @@
+#define _GNU_SOURCE // accept4
+#include "metrics.h"
+#include "buffer_pool.h"
+#include "async_log.h"
+#include "cleanup.h"
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SHARD_COUNT (32)
+#define SUB_BUCKET_BITS (2) // 4 linear steps per power of two, 25% accurate
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define MAX_MAGNITUDE (40) // 2^40 ns, about 18 minutes, larger is clamped
+#define BUCKET_COUNT ((MAX_MAGNITUDE - SUB_BUCKET_BITS + 1) * SUB_BUCKETS)
+#define REPORT_SIZE (4096)
+
+static const char *const STAGE_NAMES[METRICS_STAGE_COUNT] = {
+    [METRICS_ACCEPT] = "accept",       [METRICS_RECEIVE] = "receive",
+    [METRICS_APPEND] = "append",       [METRICS_SYNC] = "sync",
+    [METRICS_REPLAY] = "replay",       [METRICS_LOCK_WAIT] = "lock_wait",
+};
+
+static const char *const COUNTER_NAMES[METRICS_COUNTER_COUNT] = {
+    [METRICS_CONNECTIONS_OPENED] = "connections_opened",
+    [METRICS_CONNECTIONS_CLOSED] = "connections_closed",
+    [METRICS_PACKETS] = "packets",
+    [METRICS_BYTES_IN] = "bytes_in",
+    [METRICS_BYTES_OUT] = "bytes_out",
+    [METRICS_LOCK_ACQUIRED] = "lock_acquired",
+    [METRICS_LOG_DROPPED] = "log_dropped",
+    [METRICS_CONNECTIONS_TIMED_OUT] = "connections_timed_out",
+    [METRICS_MEMORY_REJECTED] = "memory_rejected",
+    [METRICS_REPLAY_SENDS] = "replay_sends",
+};
+
+typedef struct {
+  atomic_uint_fast64_t count;
+  atomic_uint_fast64_t totalNs;
+  atomic_uint_fast64_t maxNs;
+  atomic_uint_fast64_t buckets[BUCKET_COUNT];
+} stage_metrics_t;
+
+// one thread's metrics, on its own cache lines
+typedef struct {
+  atomic_uint_fast64_t counters[METRICS_COUNTER_COUNT];
+  stage_metrics_t stages[METRICS_STAGE_COUNT];
+} __attribute__((aligned(64))) metrics_shard_t;
+
+static metrics_shard_t shards[SHARD_COUNT];
+static atomic_uint nextShard = 0;
+static _Thread_local metrics_shard_t *threadShard = NULL;
+
+struct metrics_reporter {
+  pthread_t thread;
+  int signalFd;
+  int stopFd;   // eventfd, readable once the reporter should stop
+  int listenFd; // -1 without a socket path
+  char *socketPath;
+  bool running; // the thread was started and must be joined
+};
+
+static metrics_shard_t *shard(void) {
+  if (threadShard == NULL) {
+    threadShard = &shards[atomic_fetch_add_explicit(&nextShard, 1,
+                                                    memory_order_relaxed) %
+                          SHARD_COUNT];
+  }
+  return threadShard;
+}
+
+// log-linear: exact below SUB_BUCKETS, then SUB_BUCKETS steps per power of two
+static unsigned bucket_index(uint64_t value) {
+  if (value < SUB_BUCKETS) {
+    return (unsigned)value;
+  }
+  const unsigned magnitude = 63 - __builtin_clzll(value);
+  if (magnitude >= MAX_MAGNITUDE) {
+    return BUCKET_COUNT - 1;
+  }
+  const unsigned subBucket =
+      (value >> (magnitude - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+  return (magnitude - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + subBucket;
+}
+
+// largest value counted in a bucket
+static uint64_t bucket_upper_bound(unsigned index) {
+  if (index < SUB_BUCKETS) {
+    return index;
+  }
+  const unsigned magnitude = index / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+  const uint64_t step = (uint64_t)1 << (magnitude - SUB_BUCKET_BITS);
+  return (SUB_BUCKETS + index % SUB_BUCKETS + 1) * step - 1;
+}
+
+uint64_t metrics_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void metrics_record(metrics_stage_t stage, uint64_t start) {
+  const uint64_t elapsed = metrics_now() - start;
+  stage_metrics_t *metrics = &shard()->stages[stage];
+  atomic_fetch_add_explicit(&metrics->count, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&metrics->totalNs, elapsed, memory_order_relaxed);
+  atomic_fetch_add_explicit(&metrics->buckets[bucket_index(elapsed)], 1,
+                            memory_order_relaxed);
+  uint_fast64_t max =
+      atomic_load_explicit(&metrics->maxNs, memory_order_relaxed);
+  while (elapsed > max &&
+         !atomic_compare_exchange_weak_explicit(&metrics->maxNs, &max, elapsed,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+  }
+}
+
+void metrics_count(metrics_counter_t counter, uint64_t amount) {
+  atomic_fetch_add_explicit(&shard()->counters[counter], amount,
+                            memory_order_relaxed);
+}
+
+void metrics_received(uint64_t *packetStart, size_t bytes) {
+  metrics_count(METRICS_BYTES_IN, bytes);
+  if (*packetStart == 0) {
+    *packetStart = metrics_now();
+  }
+}
+
+void metrics_packet_received(uint64_t *packetStart, bool morePending) {
+  if (*packetStart != 0) {
+    metrics_record(METRICS_RECEIVE, *packetStart);
+  }
+  // pipelined bytes already arrived, count the next packet from now
+  *packetStart = morePending ? metrics_now() : 0;
+}
+
+void metrics_lock(pthread_mutex_t *mutex) {
+  metrics_count(METRICS_LOCK_ACQUIRED, 1);
+  if (pthread_mutex_trylock(mutex) == 0) {
+    return; // uncontended, not worth a clock read
+  }
+  const uint64_t start = metrics_now();
+  pthread_mutex_lock(mutex);
+  metrics_record(METRICS_LOCK_WAIT, start);
+}
+
+// value at a percentile of the summed buckets, in microseconds.  Bucket
+// bounds may overshoot the largest value seen, so that caps it
+static double percentile_us(const uint64_t *buckets, uint64_t count,
+                            uint64_t maxNs, double percentile) {
+  const uint64_t target = (uint64_t)(count * percentile / 100.0 + 0.5);
+  uint64_t seen = 0;
+  for (unsigned i = 0; i < BUCKET_COUNT; ++i) {
+    seen += buckets[i];
+    if (seen >= target && seen > 0) {
+      const uint64_t bound = bucket_upper_bound(i);
+      return (bound < maxNs ? bound : maxNs) / 1e3;
+    }
+  }
+  return 0;
+}
+
+size_t metrics_format(char *buffer, size_t bufferSize) {
+  size_t length = 0;
+#define APPEND(...)                                                            \
+  do {                                                                         \
+    if (length < bufferSize) {                                                 \
+      const int written =                                                      \
+          snprintf(buffer + length, bufferSize - length, __VA_ARGS__);         \
+      length += written > 0 ? (size_t)written : 0;                             \
+    }                                                                          \
+  } while (0)
+
+  uint64_t counters[METRICS_COUNTER_COUNT] = {0};
+  for (unsigned s = 0; s < SHARD_COUNT; ++s) {
+    for (unsigned c = 0; c < METRICS_COUNTER_COUNT; ++c) {
+      counters[c] += atomic_load_explicit(&shards[s].counters[c],
+                                          memory_order_relaxed);
+    }
+  }
+  for (unsigned c = 0; c < METRICS_COUNTER_COUNT; ++c) {
+    APPEND("%s %llu\n", COUNTER_NAMES[c], (unsigned long long)counters[c]);
+  }
+  // closes may be summed before the opens they follow, don't go negative
+  const uint64_t active =
+      counters[METRICS_CONNECTIONS_OPENED] > counters[METRICS_CONNECTIONS_CLOSED]
+          ? counters[METRICS_CONNECTIONS_OPENED] -
+                counters[METRICS_CONNECTIONS_CLOSED]
+          : 0;
+  APPEND("connections_active %llu\n", (unsigned long long)active);
+  APPEND("buffer_pool_bytes %zu\n", buffer_pool_in_use());
+
+  APPEND("%-10s %10s %12s %10s %10s %10s %10s %10s\n", "stage", "count",
+         "total_ms", "mean_us", "p50_us", "p99_us", "p99.9_us", "max_us");
+  for (unsigned stage = 0; stage < METRICS_STAGE_COUNT; ++stage) {
+    uint64_t buckets[BUCKET_COUNT] = {0};
+    uint64_t count = 0, totalNs = 0, maxNs = 0;
+    for (unsigned s = 0; s < SHARD_COUNT; ++s) {
+      const stage_metrics_t *metrics = &shards[s].stages[stage];
+      count += atomic_load_explicit(&metrics->count, memory_order_relaxed);
+      totalNs +=
+          atomic_load_explicit(&metrics->totalNs, memory_order_relaxed);
+      const uint64_t shardMax =
+          atomic_load_explicit(&metrics->maxNs, memory_order_relaxed);
+      maxNs = shardMax > maxNs ? shardMax : maxNs;
+      for (unsigned i = 0; i < BUCKET_COUNT; ++i) {
+        buckets[i] +=
+            atomic_load_explicit(&metrics->buckets[i], memory_order_relaxed);
+      }
+    }
+    APPEND("%-10s %10llu %12.3f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+           STAGE_NAMES[stage], (unsigned long long)count, totalNs / 1e6,
+           count > 0 ? totalNs / 1e3 / count : 0.0,
+           percentile_us(buckets, count, maxNs, 50),
+           percentile_us(buckets, count, maxNs, 99),
+           percentile_us(buckets, count, maxNs, 99.9), maxNs / 1e3);
+  }
+#undef APPEND
+  return length < bufferSize ? length : bufferSize - 1;
+}
+
+void metrics_log_report(void) {
+  char report[REPORT_SIZE];
+  metrics_format(report, sizeof(report));
+  for (char *line = strtok(report, "\n"); line != NULL;
+       line = strtok(NULL, "\n")) {
+    async_log(LOG_INFO, "metrics: %s", line);
+  }
+}
+
+static void report_to_client(int listenFd) {
+  const int clientFd CLEANUP(cleanup_fd) =
+      accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+  if (clientFd == -1) {
+    return;
+  }
+  char report[REPORT_SIZE];
+  const size_t length = metrics_format(report, sizeof(report));
+  // a report fits the socket buffer, so this doesn't wait on the client
+  if (send(clientFd, report, length, MSG_NOSIGNAL | MSG_DONTWAIT) !=
+      (ssize_t)length) {
+    async_log(LOG_WARNING, "Could not send the metrics report");
+  }
+}
+
+static void *reporter_thread(void *param) {
+  metrics_reporter_t *reporter = param;
+  struct pollfd fds[] = {
+      {.fd = reporter->stopFd, .events = POLLIN},
+      {.fd = reporter->signalFd, .events = POLLIN},
+      {.fd = reporter->listenFd, .events = POLLIN}, // ignored if -1
+  };
+  while (true) {
+    if (poll(fds, sizeof(fds) / sizeof(fds[0]), -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      async_log(LOG_ERR, "Metrics reporter failed, reports are disabled");
+      return NULL;
+    }
+    if (fds[0].revents != 0) {
+      return NULL;
+    }
+    if (fds[1].revents & POLLIN) {
+      struct signalfd_siginfo info;
+      if (read(reporter->signalFd, &info, sizeof(info)) == sizeof(info)) {
+        metrics_log_report();
+      }
+    }
+    if (fds[2].revents & POLLIN) {
+      report_to_client(reporter->listenFd);
+    }
+  }
+}
+
+static int open_report_socket(const char *path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    async_log(LOG_ERR, "Metrics socket path is too long: %s", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int socketFd CLEANUP(cleanup_fd) =
+      socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (socketFd == -1) {
+    async_log(LOG_ERR, "Could not open the metrics socket");
+    return -1;
+  }
+  unlink(path); // left behind by a server that didn't stop cleanly
+  if (bind(socketFd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(socketFd, SOMAXCONN) != 0) {
+    async_log(LOG_ERR, "Could not listen for metrics on %s", path);
+    return -1;
+  }
+  const int listenFd = socketFd;
+  socketFd = -1;
+  return listenFd;
+}
+
+metrics_reporter_t *metrics_reporter_start(const char *socketPath) {
+  metrics_reporter_t *reporter = calloc(1, sizeof(*reporter));
+  if (reporter == NULL) {
+    async_log(LOG_ERR, "Could not allocate the metrics reporter");
+    return NULL;
+  }
+  reporter->stopFd = -1;
+  reporter->signalFd = -1;
+  reporter->listenFd = -1;
+
+  // every thread started from here on keeps SIGUSR1 blocked, so it is only
+  // ever consumed through the signalfd
+  sigset_t reportSignals;
+  sigemptyset(&reportSignals);
+  sigaddset(&reportSignals, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &reportSignals, NULL);
+
+  reporter->stopFd = eventfd(0, EFD_CLOEXEC);
+  reporter->signalFd = signalfd(-1, &reportSignals, SFD_CLOEXEC);
+  if (reporter->stopFd == -1 || reporter->signalFd == -1) {
+    async_log(LOG_ERR, "Could not set up metrics reporting");
+    metrics_reporter_stop(reporter);
+    return NULL;
+  }
+  if (socketPath != NULL) {
+    reporter->socketPath = strdup(socketPath);
+    reporter->listenFd = open_report_socket(socketPath);
+    if (reporter->socketPath == NULL || reporter->listenFd == -1) {
+      metrics_reporter_stop(reporter);
+      return NULL;
+    }
+  }
+
+  // keep every signal away from the reporter thread, so a stop signal wakes
+  // the thread that waits for it.  SIGUSR1 still reaches it via the signalfd
+  sigset_t allSignals;
+  sigset_t previousMask;
+  sigfillset(&allSignals);
+  pthread_sigmask(SIG_BLOCK, &allSignals, &previousMask);
+  const int created =
+      pthread_create(&reporter->thread, NULL, reporter_thread, reporter);
+  pthread_sigmask(SIG_SETMASK, &previousMask, NULL);
+  if (created != 0) {
+    async_log(LOG_ERR, "Could not start the metrics reporter");
+    metrics_reporter_stop(reporter);
+    return NULL;
+  }
+  reporter->running = true;
+  return reporter;
+}
+
+void metrics_reporter_stop(metrics_reporter_t *reporter) {
+  if (reporter == NULL) {
+    return;
+  }
+  if (reporter->running) {
+    eventfd_write(reporter->stopFd, 1);
+    pthread_join(reporter->thread, NULL);
+  }
+  if (reporter->socketPath != NULL && reporter->listenFd != -1) {
+    unlink(reporter->socketPath);
+  }
+  cleanup_fd(&reporter->listenFd);
+  cleanup_fd(&reporter->signalFd);
+  cleanup_fd(&reporter->stopFd);
+  free(reporter->socketPath);
+  free(reporter);
+}
@@ -0,0 +1,129 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Stages of handling a connection that are timed
+ */
+typedef enum {
+  METRICS_ACCEPT,    // accept returning until the connection is being served
+  METRICS_RECEIVE,   // first byte of a packet until its newline arrives
+  METRICS_APPEND,    // storing a packet, durability included
+  METRICS_SYNC,      // fsync/fdatasync/msync of stored data
+  METRICS_REPLAY,    // one replay call, until it completes or would block
+  METRICS_LOCK_WAIT, // blocked on a contended storage lock
+  METRICS_STAGE_COUNT,
+} metrics_stage_t;
+
+/**
+ * @brief Event counters
+ */
+typedef enum {
+  METRICS_CONNECTIONS_OPENED,
+  METRICS_CONNECTIONS_CLOSED,
+  METRICS_PACKETS,
+  METRICS_BYTES_IN,
+  METRICS_BYTES_OUT,
+  METRICS_LOCK_ACQUIRED, // storage lock acquisitions, contended or not
+  METRICS_LOG_DROPPED,   // log records lost to a full log ring
+  METRICS_CONNECTIONS_TIMED_OUT, // closed for missing a read or write deadline
+  METRICS_MEMORY_REJECTED, // connections closed for going over a memory cap
+  METRICS_REPLAY_SENDS,    // send and sendfile calls made by replays
+  METRICS_COUNTER_COUNT,
+} metrics_counter_t;
+
+/**
+ * @brief Server metrics, always collected.
+ *
+ * Every thread updates its own shard of counters and log-linear latency
+ * histograms with relaxed atomic adds, so recording takes no lock and shares
+ * no cache line with other threads (unless there are more threads than
+ * shards).  Reports sum the shards, so they are approximate while the server
+ * is busy, and latency percentiles are accurate to within 25%.
+ */
+
+/**
+ * @brief Current monotonic time, the start point for @ref metrics_record
+ *
+ * @return nanoseconds
+ */
+uint64_t metrics_now(void);
+
+/**
+ * @brief Record how long a stage took, from @ref start until now
+ *
+ * @param stage the timed stage
+ * @param start @ref metrics_now when the stage began
+ */
+void metrics_record(metrics_stage_t stage, uint64_t start);
+
+/**
+ * @brief Add to an event counter
+ */
+void metrics_count(metrics_counter_t counter, uint64_t amount);
+
+/**
+ * @brief Count received bytes, and note when a packet's first bytes arrived
+ *
+ * @param packetStart per connection receive state, 0 while no packet is
+ * partially received
+ * @param bytes number of bytes received
+ */
+void metrics_received(uint64_t *packetStart, size_t bytes);
+
+/**
+ * @brief Record the receive time of a packet whose newline just arrived
+ *
+ * @param packetStart the connection's receive state
+ * @param morePending whether bytes of the next packet are already buffered
+ */
+void metrics_packet_received(uint64_t *packetStart, bool morePending);
+
+/**
+ * @brief Lock a storage mutex, recording the wait if another thread held it
+ *
+ * @param mutex the mutex to lock
+ */
+void metrics_lock(pthread_mutex_t *mutex);
+
+/**
+ * @brief Write a text report of every counter and stage
+ *
+ * @param buffer where to write, always NUL terminated
+ * @param bufferSize size of @ref buffer
+ * @return length of the report, truncated to fit
+ */
+size_t metrics_format(char *buffer, size_t bufferSize);
+
+/**
+ * @brief Log the text report, one line per message
+ */
+void metrics_log_report(void);
+
+typedef struct metrics_reporter metrics_reporter_t;
+
+/**
+ * @brief Start reporting metrics: to the log on SIGUSR1 and, if
+ * @ref socketPath is given, to every client of a Unix stream socket.
+ *
+ * Blocks SIGUSR1 in the calling thread, so it must be called before any other
+ * thread is started; they inherit the mask and leave the signal to the
+ * reporter.
+ *
+ * @param socketPath path to serve reports on, or NULL
+ * @return the reporter, or NULL on error
+ */
+metrics_reporter_t *metrics_reporter_start(const char *socketPath);
+
+/**
+ * @brief Stop the reporter and remove its socket
+ *
+ * @param reporter the reporter, may be NULL
+ */
+void metrics_reporter_stop(metrics_reporter_t *reporter);
+
+#endif
@@ -0,0 +1,202 @@
+#include "mmap_log.h"
+#include "async_log.h"
+#include "metrics.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Address space set aside for the log, only touched pages cost memory
+#define RESERVED_SIZE                                                          \
+  (sizeof(void *) >= 8 ? ((size_t)1 << 40) : ((size_t)1 << 30))
+// First file size, grown by doubling
+#define INITIAL_CAPACITY ((size_t)1 << 20)
+// Largest request handed to one send call
+#define SEND_MAX_CHUNK ((size_t)1 << 30)
+
+struct mmap_log {
+  int fd;
+  char *base; // start of the reserved range, never moves
+  bool syncEachAppend;
+  size_t pageSize;
+  pthread_mutex_t growLock; // serializes growing the file and mapping
+  _Atomic size_t capacity;  // bytes of the file mapped at base
+  _Atomic size_t tail;      // bytes reserved by appenders
+  _Atomic size_t published; // bytes fully copied in, readable
+};
+
+// map more of the file so that at least @ref needed bytes are usable
+static int grow(mmap_log_t *log, size_t needed) {
+  pthread_mutex_lock(&log->growLock);
+  size_t capacity = atomic_load(&log->capacity);
+  if (capacity >= needed) {
+    pthread_mutex_unlock(&log->growLock); // another appender grew it
+    return EXIT_SUCCESS;
+  }
+
+  size_t newCapacity = capacity;
+  while (newCapacity < needed) {
+    newCapacity *= 2;
+  }
+  if (newCapacity > RESERVED_SIZE) {
+    async_log(LOG_ERR, "The log is out of reserved address space");
+    pthread_mutex_unlock(&log->growLock);
+    return EXIT_FAILURE;
+  }
+  // allocate the blocks rather than leave a hole, so a full disk fails here
+  // instead of raising SIGBUS when an appender copies into the mapping
+  if (posix_fallocate(log->fd, capacity, newCapacity - capacity) != 0) {
+    async_log(LOG_ERR, "Could not extend the log file");
+    pthread_mutex_unlock(&log->growLock);
+    return EXIT_FAILURE;
+  }
+  // capacities are page multiples, so the new piece lines up with the file
+  if (mmap(log->base + capacity, newCapacity - capacity,
+           PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, log->fd,
+           capacity) == MAP_FAILED) {
+    async_log(LOG_ERR, "Could not map the extended log file");
+    pthread_mutex_unlock(&log->growLock);
+    return EXIT_FAILURE;
+  }
+  atomic_store(&log->capacity, newCapacity);
+  pthread_mutex_unlock(&log->growLock);
+  return EXIT_SUCCESS;
+}
+
+mmap_log_t *mmap_log_open(int fd, bool syncEachAppend) {
+  mmap_log_t *log = calloc(1, sizeof(*log));
+  if (log == NULL) {
+    async_log(LOG_ERR, "Could not allocate the log");
+    return NULL;
+  }
+  log->fd = fd;
+  log->syncEachAppend = syncEachAppend;
+  log->pageSize = sysconf(_SC_PAGESIZE);
+  pthread_mutex_init(&log->growLock, NULL);
+
+  // reserve the whole range now, file pages are mapped over it as it grows
+  log->base = mmap(NULL, RESERVED_SIZE, PROT_NONE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (log->base == MAP_FAILED) {
+    async_log(LOG_ERR, "Could not reserve address space for the log");
+    pthread_mutex_destroy(&log->growLock);
+    free(log);
+    return NULL;
+  }
+
+  if (posix_fallocate(fd, 0, INITIAL_CAPACITY) != 0 ||
+      mmap(log->base, INITIAL_CAPACITY, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+    async_log(LOG_ERR, "Could not map the log file");
+    munmap(log->base, RESERVED_SIZE);
+    pthread_mutex_destroy(&log->growLock);
+    free(log);
+    return NULL;
+  }
+  atomic_store(&log->capacity, INITIAL_CAPACITY);
+  return log;
+}
+
+int mmap_log_append(mmap_log_t *log, const char *data, size_t dataSize,
+                    off_t *out_end) {
+  // reserve [start, start + dataSize), growing the mapping first if needed
+  size_t start = atomic_load(&log->tail);
+  while (true) {
+    if (start + dataSize > atomic_load(&log->capacity)) {
+      if (grow(log, start + dataSize) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+      }
+      start = atomic_load(&log->tail);
+      continue;
+    }
+    if (atomic_compare_exchange_weak(&log->tail, &start, start + dataSize)) {
+      break;
+    }
+  }
+
+  memcpy(log->base + start, data, dataSize);
+
+  // publish in reservation order, so published bytes never have holes.  Only
+  // waits on appenders that reserved earlier and are still copying
+  while (atomic_load(&log->published) != start) {
+    sched_yield();
+  }
+  atomic_store(&log->published, start + dataSize);
+
+  if (log->syncEachAppend) {
+    const size_t syncStart = start - start % log->pageSize;
+    const uint64_t syncBegan = metrics_now();
+    const int syncResult =
+        msync(log->base + syncStart, start + dataSize - syncStart, MS_SYNC);
+    metrics_record(METRICS_SYNC, syncBegan);
+    if (syncResult != 0) {
+      async_log(LOG_ERR, "Could not sync the log");
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (out_end != NULL) {
+    *out_end = start + dataSize;
+  }
+  return EXIT_SUCCESS;
+}
+
+replay_status_t mmap_log_replay(mmap_log_t *log, int socketFd, off_t *offset,
+                                off_t end) {
+  if (end < 0) {
+    end = atomic_load(&log->published);
+  }
+  while (*offset < end) {
+    size_t chunk = end - *offset;
+    if (chunk > SEND_MAX_CHUNK) {
+      chunk = SEND_MAX_CHUNK;
+    }
+    const ssize_t bytesSent =
+        replay_send(socketFd, log->base + *offset, chunk, 0);
+    if (bytesSent < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return REPLAY_WOULD_BLOCK;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      async_log(LOG_ERR, "Could not send data to client");
+      return REPLAY_FAILED;
+    }
+    *offset += bytesSent;
+  }
+  return REPLAY_COMPLETE;
+}
+
+off_t mmap_log_published(mmap_log_t *log) {
+  return atomic_load(&log->published);
+}
+
+int mmap_log_sync(mmap_log_t *log) {
+  const size_t published = atomic_load(&log->published);
+  if (published > 0 && msync(log->base, published, MS_SYNC) != 0) {
+    async_log(LOG_ERR, "Could not sync the log");
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+void mmap_log_close(mmap_log_t *log) {
+  if (log == NULL) {
+    return;
+  }
+  munmap(log->base, RESERVED_SIZE);
+  // drop the unused, zeroed tail so the file holds just the log
+  if (ftruncate(log->fd, atomic_load(&log->published)) != 0) {
+    async_log(LOG_WARNING, "Could not trim the log file");
+  }
+  pthread_mutex_destroy(&log->growLock);
+  free(log);
+}
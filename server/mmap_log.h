@@ -0,0 +1,81 @@
+#ifndef MMAP_LOG_H
+#define MMAP_LOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "replay.h"
+
+/**
+ * @brief Append-only log kept in a memory-mapped file.
+ *
+ * The file is mapped into one fixed address range reserved up front, and grows
+ * in place, so mapped data never moves and can be read without a lock.
+ * Appenders reserve their byte range with an atomic update of the tail, copy
+ * their data in concurrently, and publish it in reservation order.  Replays
+ * send straight from the mapping, the page cache backs it, so the log can be
+ * much larger than RAM.
+ */
+typedef struct mmap_log mmap_log_t;
+
+/**
+ * @brief Map an empty log onto a file
+ *
+ * @param fd read/write file descriptor of the (empty) backing file, not owned.
+ * The file is truncated to the log length on @ref mmap_log_close
+ * @param syncEachAppend msync every append before it returns
+ * @return the log, or NULL on error
+ */
+mmap_log_t *mmap_log_open(int fd, bool syncEachAppend);
+
+/**
+ * @brief Append data to the end of the log, safe to call from any thread
+ *
+ * @param log the log
+ * @param data bytes to append
+ * @param dataSize number of bytes in @ref data
+ * @param out_end if not NULL, the log offset just past the appended data.
+ * Everything before it is published once this returns
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if the log couldn't grow
+ */
+int mmap_log_append(mmap_log_t *log, const char *data, size_t dataSize,
+                    off_t *out_end);
+
+/**
+ * @brief Send a byte range of the log to a socket, straight from the mapping
+ *
+ * @param log the log
+ * @param socketFd connected socket, blocking or non-blocking
+ * @param offset first byte to send, advanced past everything that was sent
+ * @param end offset to stop at, or -1 to send everything published so far
+ * @return the replay status, REPLAY_WOULD_BLOCK only for non-blocking sockets
+ */
+replay_status_t mmap_log_replay(mmap_log_t *log, int socketFd, off_t *offset,
+                                off_t end);
+
+/**
+ * @brief Offset just past the last published byte
+ *
+ * @param log the log
+ * @return bytes published so far
+ */
+off_t mmap_log_published(mmap_log_t *log);
+
+/**
+ * @brief Sync everything published so far to the backing file
+ *
+ * @param log the log
+ * @return EXIT_SUCCESS on pass, else EXIT_FAILURE
+ */
+int mmap_log_sync(mmap_log_t *log);
+
+/**
+ * @brief Unmap the log and trim the backing file to the published data.  No
+ * appends or replays may be running or made afterwards
+ *
+ * @param log the log, may be NULL
+ */
+void mmap_log_close(mmap_log_t *log);
+
+#endif
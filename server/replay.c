@@ -0,0 +1,175 @@
+#include "replay.h"
+#include "async_log.h"
+#include "buffer_pool.h"
+#include "metrics.h"
+#include <errno.h>
+#include <linux/sockios.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Largest request handed to one sendfile call, the kernel caps it anyway
+#define SENDFILE_MAX_CHUNK ((size_t)1 << 30)
+
+static size_t chunk_size(off_t offset, off_t end, size_t limit) {
+  if (end >= 0 && (off_t)limit > end - offset) {
+    return end - offset;
+  }
+  return limit;
+}
+
+static bool would_block(void) { return errno == EAGAIN || errno == EWOULDBLOCK; }
+
+// free space in the socket's send buffer, what one send can take without
+// blocking
+static size_t send_space(int socketFd) {
+  int sendBufferSize = 0;
+  int queued = 0;
+  if (getsockopt(socketFd, SOL_SOCKET, SO_SNDBUF, &sendBufferSize,
+                 &(socklen_t){sizeof(sendBufferSize)}) != 0 ||
+      ioctl(socketFd, SIOCOUTQ, &queued) != 0 || queued >= sendBufferSize) {
+    return 0;
+  }
+  return sendBufferSize - queued;
+}
+
+size_t replay_buffer_reserve(replay_buffer_t *buffer, int socketFd,
+                             size_t wanted) {
+  if (wanted <= buffer->capacity) {
+    return buffer->capacity;
+  }
+  size_t target = send_space(socketFd);
+  if (target > wanted) {
+    target = wanted;
+  }
+  if (target < REPLAY_BUFFER_MIN) {
+    target = REPLAY_BUFFER_MIN;
+  }
+  if (target > REPLAY_BUFFER_MAX) {
+    target = REPLAY_BUFFER_MAX;
+  }
+  if (target <= buffer->capacity) {
+    return buffer->capacity;
+  }
+
+  size_t capacity = 0;
+  char *data = buffer_pool_alloc(target, &capacity);
+  if (data == NULL) {
+    // a smaller buffer still works, just with more sends
+    if (buffer->capacity == 0) {
+      async_log(LOG_ERR, "Could not allocate a replay buffer");
+    }
+    return buffer->capacity;
+  }
+  buffer_pool_free(buffer->data, buffer->capacity);
+  buffer->data = data;
+  buffer->capacity = capacity;
+  return capacity;
+}
+
+void replay_buffer_release(replay_buffer_t *buffer) {
+  buffer_pool_free(buffer->data, buffer->capacity);
+  buffer->data = NULL;
+  buffer->capacity = 0;
+}
+
+ssize_t replay_send(int socketFd, const void *data, size_t size, int flags) {
+  metrics_count(METRICS_REPLAY_SENDS, 1);
+  return send(socketFd, data, size, flags | MSG_NOSIGNAL);
+}
+
+replay_status_t replay_send_all(int socketFd, const char *data, size_t size,
+                                off_t *offset) {
+  size_t sent = 0;
+  while (sent < size) {
+    const ssize_t bytesSent = replay_send(socketFd, data + sent, size - sent, 0);
+    if (bytesSent < 0) {
+      if (would_block()) {
+        return REPLAY_WOULD_BLOCK;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      async_log(LOG_ERR, "Could not send data to client");
+      return REPLAY_FAILED;
+    }
+    sent += bytesSent;
+    *offset += bytesSent;
+  }
+  return REPLAY_COMPLETE;
+}
+
+replay_status_t replay_copy_range(int socketFd, int fileFd, off_t *offset,
+                                  off_t end, replay_buffer_t *scratch) {
+  while (end < 0 || *offset < end) {
+    const size_t capacity = replay_buffer_reserve(
+        scratch, socketFd, end < 0 ? SIZE_MAX : (size_t)(end - *offset));
+    if (capacity == 0) {
+      return REPLAY_FAILED;
+    }
+
+    // fill the buffer before sending, a device may return short reads
+    size_t filled = 0;
+    bool endOfFile = false;
+    while (filled < capacity && (end < 0 || *offset + (off_t)filled < end)) {
+      const off_t readOffset = *offset + filled;
+      const ssize_t bytesRead =
+          pread(fileFd, scratch->data + filled,
+                chunk_size(readOffset, end, capacity - filled), readOffset);
+      if (bytesRead < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        async_log(LOG_ERR, "Could not read the tempfile for replay");
+        return REPLAY_FAILED;
+      }
+      if (bytesRead == 0) {
+        endOfFile = true;
+        break;
+      }
+      filled += bytesRead;
+    }
+
+    // what a non-blocking socket didn't take is read again on the next call
+    const replay_status_t status =
+        replay_send_all(socketFd, scratch->data, filled, offset);
+    if (status != REPLAY_COMPLETE || endOfFile) {
+      return status;
+    }
+  }
+
+  return REPLAY_COMPLETE;
+}
+
+replay_status_t replay_file_range(int socketFd, int fileFd, off_t *offset,
+                                  off_t end, replay_buffer_t *scratch) {
+  while (end < 0 || *offset < end) {
+    metrics_count(METRICS_REPLAY_SENDS, 1);
+    const ssize_t bytesSent = sendfile(
+        socketFd, fileFd, offset, chunk_size(*offset, end, SENDFILE_MAX_CHUNK));
+    if (bytesSent < 0) {
+      if (would_block()) {
+        return REPLAY_WOULD_BLOCK;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP) {
+        break; // this file can't be spliced, copy it instead
+      }
+      async_log(LOG_ERR, "Could not send data to client");
+      return REPLAY_FAILED;
+    }
+    if (bytesSent == 0) {
+      return REPLAY_COMPLETE; // end of file
+    }
+  }
+  if (end >= 0 && *offset >= end) {
+    return REPLAY_COMPLETE;
+  }
+
+  return replay_copy_range(socketFd, fileFd, offset, end, scratch);
+}
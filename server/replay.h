@@ -0,0 +1,94 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define REPLAY_BUFFER_MIN (4096)
+#define REPLAY_BUFFER_MAX (256 * 1024)
+
+typedef enum {
+  REPLAY_COMPLETE,    // everything up to the end was sent
+  REPLAY_WOULD_BLOCK, // non-blocking socket is full, call again when writable
+  REPLAY_FAILED,      // read or send error, already logged
+} replay_status_t;
+
+/**
+ * @brief Copy space for replays that can't send straight from storage.
+ *
+ * Zero-initialize it; only the backends that copy allocate it, and then at
+ * the size the socket can take in one send, so a replay is gathered into as
+ * few sends as possible.
+ */
+typedef struct {
+  char *data;
+  size_t capacity;
+} replay_buffer_t;
+
+/**
+ * @brief Make room to copy up to @ref wanted bytes in one go.
+ *
+ * A buffer too small for them grows to the free space in the socket's send
+ * buffer, between REPLAY_BUFFER_MIN and REPLAY_BUFFER_MAX.  It never shrinks,
+ * so once it is big enough this makes no system calls.
+ *
+ * @param buffer the buffer, kept as it is if growing fails
+ * @param socketFd socket the copy will be sent to
+ * @param wanted bytes left to replay, SIZE_MAX if unknown
+ * @return usable capacity, 0 if nothing could be allocated
+ */
+size_t replay_buffer_reserve(replay_buffer_t *buffer, int socketFd,
+                             size_t wanted);
+
+/**
+ * @brief Free the buffer's memory, leaving it empty
+ */
+void replay_buffer_release(replay_buffer_t *buffer);
+
+/**
+ * @brief send(2) one piece of a replay, counted in the replay_sends metric
+ *
+ * @param flags send flags, MSG_NOSIGNAL is always added
+ * @return as for send(2)
+ */
+ssize_t replay_send(int socketFd, const void *data, size_t size, int flags);
+
+/**
+ * @brief Send a whole buffer, for copies taken out of storage
+ *
+ * @param offset advanced past everything that was sent
+ * @return the replay status, REPLAY_WOULD_BLOCK only for non-blocking sockets
+ */
+replay_status_t replay_send_all(int socketFd, const char *data, size_t size,
+                                off_t *offset);
+
+/**
+ * @brief Send a byte range of a file to a socket.
+ *
+ * Regular files are sent with sendfile(2), straight from the page cache to the
+ * socket without a user-space copy.  Files that can't be spliced (such as the
+ * aesdchar device) fall back to pread()/send() through @ref scratch.
+ *
+ * @param socketFd connected socket, blocking or non-blocking
+ * @param fileFd file to replay from, its file position is not used or changed
+ * @param offset first byte to send, advanced past everything that was sent
+ * @param end offset to stop at, or -1 to send until end of file
+ * @param scratch copy buffer for the fallback path
+ * @return the replay status, REPLAY_WOULD_BLOCK only for non-blocking sockets
+ */
+replay_status_t replay_file_range(int socketFd, int fileFd, off_t *offset,
+                                  off_t end, replay_buffer_t *scratch);
+
+/**
+ * @brief Send a byte range of a file to a socket with pread()/send() copies,
+ * for files known not to support sendfile(2).
+ *
+ * Reads are gathered until @ref scratch is full before anything is sent, so
+ * a device that returns short reads still goes out in few sends.
+ *
+ * Parameters and result as for @ref replay_file_range.
+ */
+replay_status_t replay_copy_range(int socketFd, int fileFd, off_t *offset,
+                                  off_t end, replay_buffer_t *scratch);
+
+#endif
@@ -1,8 +1,11 @@
 #include "server_behavior.h"
-#if USE_AESD_CHAR_DEVICE
-#include "aesd_ioctl.h"
-#endif
+#include "async_log.h"
+#include "buffer_pool.h"
 #include "cleanup.h"
+#include "command_parser.h"
+#include "line_framer.h"
+#include "metrics.h"
+#include "replay.h"
 #include <bits/pthreadtypes.h>
 #include <bits/time.h>
 #include <bits/types/sigset_t.h>
@@ -11,409 +14,452 @@
 #include <pthread.h>
 #include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
-#include <sys/syslog.h>
-#include <sys/ioctl.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
 
 const size_t BUFFER_SIZE_INCREMENT = 1024;
 
+#define NS_PER_MS (1000000)
+#define NS_PER_US (1000)
+#define US_PER_SEC (1000000)
+
 typedef struct {
   int connectionFd;                 // unique per connection - no locking
-  FILE *tmpFile;                    // shared across connections - LOCK
-  pthread_mutex_t *tmpFileMutex;    // locks above variable
+  storage_t *storage;               // shared across connections - locks itself
   char clientAddr[INET_ADDRSTRLEN]; // copied per connection - no locking
   atomic_flag *completeFlag;        // unique per connection - no locking
-  int *returnCode;                  // unique per connection - no locking
+  const server_options_t *options;  // read-only for the program lifetime
 } server_thread_param_t;
 
-#define _THREAD_RETURN(x)                                                      \
-  do {                                                                         \
-    *returnCode = x;                                                           \
-    return returnCode;                                                         \
-  } while (false)
+void cleanup_client_addr(char **addr) {
+  metrics_count(METRICS_CONNECTIONS_CLOSED, 1);
+  async_log(LOG_INFO, "Closed connection from %s", *addr);
+}
 
-#define THREAD_RETURN_FAILURE _THREAD_RETURN(EXIT_FAILURE)
-#define THREAD_RETURN_SUCCESS _THREAD_RETURN(EXIT_SUCCESS)
+void cleanup_completion_flag(atomic_flag **flag) { atomic_flag_clear(*flag); }
 
-#if USE_AESD_CHAR_DEVICE
-#define IOCTL_CMD_STRING ("AESDCHAR_IOCSEEKTO:")
-static const char* ioctl_cmd_string = IOCTL_CMD_STRING;
-#endif
+// A connection on a server_handle_connection thread, so a stop can shut it down
+// and free the thread from a recv or send that would otherwise never return
+struct served_connection_t {
+  int fd;
+  bool tracked;
+  LIST_ENTRY(served_connection_t) _entry;
+};
+
+static LIST_HEAD(served_list_head_t, served_connection_t) servedConnections =
+    LIST_HEAD_INITIALIZER(servedConnections);
+static pthread_mutex_t servedConnectionsLock = PTHREAD_MUTEX_INITIALIZER;
+static bool servingStopped = false; // guarded by servedConnectionsLock
+
+// false once the server is stopping, the connection should close at once
+static bool track_connection(struct served_connection_t *connection) {
+  pthread_mutex_lock(&servedConnectionsLock);
+  connection->tracked = !servingStopped;
+  if (connection->tracked) {
+    LIST_INSERT_HEAD(&servedConnections, connection, _entry);
+  }
+  pthread_mutex_unlock(&servedConnectionsLock);
+  return connection->tracked;
+}
 
-void cleanup_client_addr(char **addr) {
-  syslog(LOG_INFO, "Closed connection from %s", *addr);
+// before the socket is closed, so a stop never shuts down a reused fd
+static void untrack_connection(struct served_connection_t *connection) {
+  if (connection->tracked) {
+    pthread_mutex_lock(&servedConnectionsLock);
+    LIST_REMOVE(connection, _entry);
+    pthread_mutex_unlock(&servedConnectionsLock);
+  }
 }
 
-void cleanup_completion_flag(atomic_flag **flag) { atomic_flag_clear(*flag); }
+void server_stop_connections(void) {
+  pthread_mutex_lock(&servedConnectionsLock);
+  servingStopped = true;
+  struct served_connection_t *connection;
+  LIST_FOREACH(connection, &servedConnections, _entry) {
+    shutdown(connection->fd, SHUT_RDWR);
+  }
+  pthread_mutex_unlock(&servedConnectionsLock);
+}
 
-/**
- * @brief Write to the end of a file, guarded by a mutex
- *
- * @param data character buffer to write
- * @param dataSize number of characters to wrilte
- * @param file FILE* to the output file
- * @param write_guard guard mutex (locked/unlocked around write)
- * @return int EXIT_SUCCESS on pass, else EXIT_FAILURE
- */
-static int write_safe_to_file_end(char *data, size_t dataSize, FILE *file,
-                                  pthread_mutex_t *write_guard) {
-  // guard use of the file
-  pthread_mutex_lock(write_guard);
-  // write buffer to file
-  fseek(file, 0, SEEK_END);
-  if (fwrite(data, sizeof(char), dataSize, file) != dataSize) {
-    syslog(LOG_ERR, "Could not write data to file");
-    pthread_mutex_unlock(write_guard);
+// what a command acts on
+typedef struct {
+  storage_t *storage;
+  replay_cursor_t *cursor;
+} command_context_t;
+
+static bool seek_enabled(const void *context) {
+  return storage_supports_seek(((const command_context_t *)context)->storage);
+}
+
+// "AESDCHAR_IOCSEEKTO:X,Y": seek the storage to the requested command, then
+// replay from wherever that left it until its end
+static int seek_to_command(command_args_t *args, void *context) {
+  command_context_t *command = context;
+  uint64_t X = 0;
+  uint64_t Y = 0;
+  if (command_parse_uint(args, UINT32_MAX, &X) != EXIT_SUCCESS ||
+      command_expect(args, ',') != EXIT_SUCCESS ||
+      command_parse_uint(args, UINT32_MAX, &Y) != EXIT_SUCCESS ||
+      !command_args_done(args)) {
+    async_log(LOG_ERR, "Could not parse the seek command");
     return EXIT_FAILURE;
   }
-  // flush data to disc, avoid relying on OS synchronization for the FS
-  fflush(file);
-  
-  const int tmpFileFd = fileno(file);
-  fsync(tmpFileFd);
-  pthread_mutex_unlock(write_guard);
-  return EXIT_SUCCESS;
+  command->cursor->end = -1;
+  return storage_seek_to_command(command->storage, X, Y,
+                                 &command->cursor->offset);
 }
 
-#if USE_AESD_CHAR_DEVICE
-// helper function, like strstr but without 0-termination assumptions
-// based off of memmem(3)
-static void* memmem(const void* haystack, size_t haystackSize, const void* needle, size_t needleSize){
-    const char* haystackData = haystack;
-    const char* needleData = needle;
-    size_t index = 0;
-    size_t matchSize = 0;
-
-    if(needleSize > haystackSize)
-      return NULL;
-
-    while(index < (haystackSize - needleSize + 1)){
-        while(matchSize < needleSize && (*(haystackData + index + matchSize) == *(needleData + matchSize))){
-            ++matchSize;
-        }
-        if(matchSize == needleSize){
-            return (void*)(haystackData + index);
-        }
-        matchSize = 0;
-        ++index;
-    }
-    return NULL;
+static bool resume_enabled(const void *context) {
+  return storage_supports_resume(
+      ((const command_context_t *)context)->storage);
 }
 
-static int ioctl_handling(const char* data, size_t dataSize, FILE* tmpFile, pthread_mutex_t* tmpFileMutex, int connectionFd){
-  const char* xStartPtr = data + sizeof(IOCTL_CMD_STRING) - 1; // drop null-termination
-  size_t xStrLen = 0;
-  const char* yStartPtr = NULL;
-  size_t yStrLen = 0;
-  const char* currDataPtr = xStartPtr;
-
-  while(true){
-    if((currDataPtr - data) >= dataSize)
-      break;
-    if((*currDataPtr < '0' || *currDataPtr > '9') && *currDataPtr != ',')
-      return 1;
-
-    if(*currDataPtr == ','){
-      yStartPtr = currDataPtr + 1;
-    }else{
-      if(yStartPtr == NULL)
-        ++xStrLen;
-      else
-        ++yStrLen;
-    }
-    ++currDataPtr;
+// "AESDSOCKET_RESUME:N": replay everything stored from offset N on
+static int resume_from_offset(command_args_t *args, void *context) {
+  command_context_t *command = context;
+  uint64_t resumeOffset = 0;
+  if (command_parse_uint(args, INT64_MAX, &resumeOffset) != EXIT_SUCCESS ||
+      !command_args_done(args)) {
+    async_log(LOG_ERR, "Could not parse the resume offset");
+    return EXIT_FAILURE;
   }
 
-  if(yStartPtr == NULL){
-    // could not parse the second value
-    return 1;
-  }
-  
-  // databuffers to hold each number
-  char xStr[100] = {0};
-  char yStr[100] = {0};
-  memcpy(xStr, xStartPtr, xStrLen);
-  memcpy(yStr, yStartPtr, yStrLen);
-
-  errno = 0;
-  const uint32_t X = strtoul(xStr, NULL, 10);
-  if(errno != 0){
-    syslog(LOG_ERR, "Could not parse the X value");
-    return 1;
+  off_t oldest = 0;
+  off_t end = 0;
+  if (storage_bounds(command->storage, &oldest, &end) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
   }
-  errno = 0;
-  const uint32_t Y = strtoul(yStr, NULL, 10);
-  if(errno != 0){
-    syslog(LOG_ERR, "Could not parse the Y value");
-    return 1;
+  // older data may have been dropped, and a client can't be ahead of the log
+  replay_cursor_t *cursor = command->cursor;
+  cursor->offset = (off_t)resumeOffset < oldest ? oldest : (off_t)resumeOffset;
+  if (cursor->offset > end) {
+    cursor->offset = end;
   }
+  cursor->end = end;
+  cursor->headerSize = snprintf(
+      cursor->header, sizeof(cursor->header), "AESDSOCKET_RANGE:%lld,%lld\n",
+      (long long)cursor->offset, (long long)end);
+  return EXIT_SUCCESS;
+}
 
-  struct aesd_seekto cmd={
-    .write_cmd = X,
-    .write_cmd_offset = Y
-  };
-  if(ioctl(fileno(tmpFile), AESDCHAR_IOCSEEKTO, (long)(&cmd)) != 0){
-    syslog(LOG_WARNING, "IOCTL to aesdchar device failed, returning undefined file contents");
+// in-band commands, sorted by prefix.  A packet is only a command while its
+// storage supports it, otherwise it is stored as data like any other
+static const command_t COMMANDS[] = {
+    COMMAND("AESDCHAR_IOCSEEKTO:", seek_enabled, seek_to_command),
+    COMMAND("AESDSOCKET_RESUME:", resume_enabled, resume_from_offset),
+};
+
+int server_store_packet(const char *data, size_t dataSize, storage_t *storage,
+                        replay_cursor_t *out_cursor) {
+  metrics_count(METRICS_PACKETS, 1);
+  out_cursor->headerSize = 0;
+  out_cursor->headerSent = 0;
+  command_args_t args;
+  const command_t *command =
+      command_find(COMMANDS, sizeof(COMMANDS) / sizeof(COMMANDS[0]), data,
+                   dataSize - 1, &args); // drop the newline
+  command_context_t context = {.storage = storage, .cursor = out_cursor};
+  if (command != NULL &&
+      (command->enabled == NULL || command->enabled(&context))) {
+    return command->run(&args, &context);
   }
 
-  // guard use of the file
-  pthread_mutex_lock(tmpFileMutex);
-  // write file to socket
-  char *fileBuf CLEANUP(cleanup_databuffer) = malloc(BUFFER_SIZE_INCREMENT);
-  if (fileBuf == NULL) {
-    syslog(LOG_ERR, "Could not malloc initial buffer resource");
-    pthread_mutex_unlock(tmpFileMutex);
-    return 1;
+  // the stored data is append-only where the backend allows it: everything
+  // before the end of this packet is a stable snapshot that later appends
+  // never touch
+  if (storage_append(storage, data, dataSize, &out_cursor->end) !=
+      EXIT_SUCCESS) {
+    async_log(LOG_ERR, "Could not write packet data to file");
+    return EXIT_FAILURE;
   }
-  size_t bytesRead = 0;
-  while ((bytesRead = fread(fileBuf, sizeof(char), BUFFER_SIZE_INCREMENT,
-                            tmpFile)) != 0) {
-    // More data to read
-    if (send(connectionFd, fileBuf, bytesRead, 0) != bytesRead) {
-      syslog(LOG_ERR, "Could not send data to client");
-      pthread_mutex_unlock(tmpFileMutex);
-      return 1;
+  out_cursor->offset = 0;
+  return EXIT_SUCCESS;
+}
+
+replay_status_t server_replay(storage_t *storage, int socketFd,
+                              replay_cursor_t *cursor,
+                              replay_buffer_t *scratch) {
+  // hold the header back until the data behind it goes out, so the two share
+  // a segment
+  const int headerFlags =
+      cursor->end < 0 || cursor->offset < cursor->end ? MSG_MORE : 0;
+  while (cursor->headerSent < cursor->headerSize) {
+    const ssize_t bytesSent = replay_send(
+        socketFd, cursor->header + cursor->headerSent,
+        cursor->headerSize - cursor->headerSent, headerFlags);
+    if (bytesSent < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return REPLAY_WOULD_BLOCK;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      async_log(LOG_ERR, "Could not send data to client");
+      return REPLAY_FAILED;
     }
+    cursor->headerSent += bytesSent;
   }
+  return storage_replay(storage, socketFd, &cursor->offset, cursor->end,
+                        scratch);
+}
 
-  pthread_mutex_unlock(tmpFileMutex);
+void server_connection_timed_out(const char *clientAddr, bool reading) {
+  metrics_count(METRICS_CONNECTIONS_TIMED_OUT, 1);
+  async_log(LOG_INFO, "Connection from %s timed out %s", clientAddr,
+            reading ? "sending a packet" : "reading its replay");
+}
 
-  return 0;
+void server_memory_rejected(const char *clientAddr) {
+  metrics_count(METRICS_MEMORY_REJECTED, 1);
+  async_log(LOG_WARNING,
+            "Connection from %s went over the memory limits, closing it",
+            clientAddr);
 }
-#endif
 
-static void *server_work_thread(void *param) {
-  // Parse the thread params
-  const server_thread_param_t *parsedParams = (server_thread_param_t *)param;
-  int connectionFd CLEANUP(cleanup_socket) =
-      parsedParams->connectionFd; // Have the thread own the connection lifetime
-  FILE *tmpFile = parsedParams->tmpFile;
-  char clientAddr[INET_ADDRSTRLEN];
-  memcpy(clientAddr, parsedParams->clientAddr, INET_ADDRSTRLEN);
+// set SO_RCVTIMEO or SO_SNDTIMEO, 0 for no timeout
+static int set_socket_timeout(int socketFd, int option, uint64_t timeoutNs) {
+  struct timeval timeout = {
+      .tv_sec = timeoutNs / NS_PER_US / US_PER_SEC,
+      .tv_usec = timeoutNs / NS_PER_US % US_PER_SEC,
+  };
+  if (timeoutNs > 0 && timeout.tv_sec == 0 && timeout.tv_usec == 0) {
+    timeout.tv_usec = 1; // not quite expired, don't turn it into no timeout
+  }
+  return setsockopt(socketFd, SOL_SOCKET, option, &timeout, sizeof(timeout));
+}
+
+/**
+ * @brief Handle one complete packet on a blocking connection: store it, then
+ * send back the stored data
+ *
+ * @return REPLAY_COMPLETE on packet handled, REPLAY_WOULD_BLOCK if the client
+ * stopped reading for longer than the send timeout, else REPLAY_FAILED
+ */
+static replay_status_t handle_packet(int connectionFd, const char *packet,
+                                     size_t packetSize, storage_t *storage,
+                                     replay_buffer_t *replayBuffer) {
+  replay_cursor_t cursor;
+  if (server_store_packet(packet, packetSize, storage, &cursor) !=
+      EXIT_SUCCESS) {
+    return REPLAY_FAILED;
+  }
+
+  // write the data to the socket, zero-copy where the backend allows it.
+  // Appends carry on while a slow client drains its snapshot
+  return server_replay(storage, connectionFd, &cursor, replayBuffer);
+}
+
+int server_handle_connection(int connection, storage_t *storage,
+                             const char clientAddr[INET_ADDRSTRLEN],
+                             const server_options_t *options) {
+  const int connectionFd CLEANUP(cleanup_socket) =
+      connection; // Own the connection lifetime
+  char closedAddr[INET_ADDRSTRLEN];
+  memcpy(closedAddr, clientAddr, INET_ADDRSTRLEN);
+  metrics_count(METRICS_CONNECTIONS_OPENED, 1);
   char *clientAddrBegin CLEANUP(cleanup_client_addr) =
-      clientAddr; // Token variable to print out the client address on
+      closedAddr; // Token variable to print out the client address on
                   // closing the connection
-  int *returnCode = parsedParams->returnCode;
-  pthread_mutex_t *tmpFileMutex = parsedParams->tmpFileMutex;
-  // autoclear flag on exit
-  atomic_flag *completionFlag CLEANUP(cleanup_completion_flag) =
-      parsedParams->completeFlag;
-  // All parameter data copied, we can free the parameter block
-  free(param);
+  struct served_connection_t served CLEANUP(untrack_connection) = {
+      .fd = connectionFd};
+  if (!track_connection(&served)) {
+    return EXIT_SUCCESS; // the server is stopping
+  }
 
-  // Scoped block to free resources for reading the packet
   // packet will be smaller than ram, but might not be small enough for the
   // writeback buffering also
-  {
-    char *dataBuf CLEANUP(cleanup_databuffer) = malloc(BUFFER_SIZE_INCREMENT);
-    if (dataBuf == NULL) {
-      syslog(LOG_ERR, "Could not malloc read buffer resource");
-      THREAD_RETURN_FAILURE;
-    }
-    size_t dataBufferAllocationSize = BUFFER_SIZE_INCREMENT;
-    size_t dataBufferSize = 0;
-    bzero(dataBuf, BUFFER_SIZE_INCREMENT);
-    bool packetComplete = false;
-
-    // Read loop: read network packets until we find a newline.  Keep the buffer
-    // in-memory
-    while (!packetComplete) {
-      ssize_t recvDataSize = 0;
-      // Leave space for a null-termination character
-      if ((recvDataSize = recv(connectionFd, dataBuf + dataBufferSize,
-                               BUFFER_SIZE_INCREMENT - 1, 0)) < 0) {
-        syslog(LOG_ERR, "Failed to get received data from socket!");
-        THREAD_RETURN_FAILURE;
+  line_framer_t framer CLEANUP(line_framer_destroy);
+  // grown on first use, by backends that copy
+  replay_buffer_t replayBuffer CLEANUP(replay_buffer_release) = {0};
+  if (line_framer_init(&framer, BUFFER_SIZE_INCREMENT,
+                       options->connectionBufferLimit) != EXIT_SUCCESS) {
+    // out of budget, not a server failure
+    server_memory_rejected(closedAddr);
+    return EXIT_SUCCESS;
+  }
+
+  // A send that makes no progress for the write timeout fails with EAGAIN,
+  // the kernel keeps the timer
+  if (options->writeTimeoutMs > 0 &&
+      set_socket_timeout(connectionFd, SO_SNDTIMEO,
+                         (uint64_t)options->writeTimeoutMs * NS_PER_MS) != 0) {
+    async_log(LOG_ERR, "Could not set the connection's write timeout");
+    return EXIT_FAILURE;
+  }
+
+  // Read loop: read network packets until we find a newline.  Keep the buffer
+  // in-memory.  Sessions keep going, in order, until the client hangs up
+  uint64_t packetStart = 0;
+  // each packet must be complete by its deadline, however it trickles in
+  uint64_t readDeadline =
+      metrics_now() + (uint64_t)options->readTimeoutMs * NS_PER_MS;
+  while (true) {
+    const char *packet = NULL;
+    size_t packetSize = 0;
+    if (line_framer_next(&framer, &packet, &packetSize)) {
+      metrics_packet_received(&packetStart, line_framer_pending(&framer) > 0);
+      switch (handle_packet(connectionFd, packet, packetSize, storage,
+                            &replayBuffer)) {
+      case REPLAY_COMPLETE:
+        break;
+      case REPLAY_WOULD_BLOCK:
+        server_connection_timed_out(closedAddr, false);
+        return EXIT_SUCCESS;
+      default:
+        return EXIT_FAILURE;
       }
-      dataBufferSize += recvDataSize;
-      const char *const endOfPacket = strstr(dataBuf, "\n");
-      if (endOfPacket == NULL) {
-        // Did not hear a newline yet; keep searching
-        dataBuf =
-            realloc(dataBuf, dataBufferAllocationSize + BUFFER_SIZE_INCREMENT);
-        if (dataBuf == NULL) {
-          syslog(LOG_ERR, "Reallocating packet buffer failed");
-          THREAD_RETURN_FAILURE;
-        }
-        dataBufferAllocationSize += BUFFER_SIZE_INCREMENT;
-        bzero(dataBuf + dataBufferSize,
-              dataBufferAllocationSize - dataBufferSize);
-      } else {
-        // We found the packet end!  Progress to the next step
-        dataBufferSize = endOfPacket - dataBuf + 1; // Incl. newline
-        packetComplete = true;
+      if (!options->persistentSessions) {
+        return EXIT_SUCCESS;
       }
+      readDeadline =
+          metrics_now() + (uint64_t)options->readTimeoutMs * NS_PER_MS;
+      continue; // pipelined packets may already be buffered
     }
 
-#if USE_AESD_CHAR_DEVICE
-    if(memmem(dataBuf, dataBufferSize, ioctl_cmd_string, sizeof(IOCTL_CMD_STRING) - 1) == dataBuf){ // drop null-termination
-      if(ioctl_handling(dataBuf, dataBufferSize-1, tmpFile, tmpFileMutex, connectionFd) == 0) {// drop the newline
-        THREAD_RETURN_SUCCESS;
-      }else{
-        THREAD_RETURN_FAILURE;
+    if (options->readTimeoutMs > 0) {
+      const uint64_t now = metrics_now();
+      if (now >= readDeadline ||
+          set_socket_timeout(connectionFd, SO_RCVTIMEO,
+                             readDeadline - now) != 0) {
+        server_connection_timed_out(closedAddr, true);
+        return EXIT_SUCCESS;
       }
     }
-#endif
 
-    if (write_safe_to_file_end(dataBuf, dataBufferSize, tmpFile,
-                               tmpFileMutex) != EXIT_SUCCESS) {
-      syslog(LOG_ERR, "Could not write packet data to file");
-      THREAD_RETURN_FAILURE;
+    size_t recvSpace = 0;
+    char *recvBuf =
+        line_framer_reserve(&framer, BUFFER_SIZE_INCREMENT, &recvSpace);
+    if (recvBuf == NULL) {
+      // the packet is longer than this connection may buffer
+      server_memory_rejected(closedAddr);
+      return EXIT_SUCCESS;
     }
-  } // Clean up inbound packet resources
-
-  // guard use of the file
-  pthread_mutex_lock(tmpFileMutex);
-  // write file to socket
-  char *fileBuf CLEANUP(cleanup_databuffer) = malloc(BUFFER_SIZE_INCREMENT);
-  if (fileBuf == NULL) {
-    syslog(LOG_ERR, "Could not malloc initial buffer resource");
-    pthread_mutex_unlock(tmpFileMutex);
-    THREAD_RETURN_FAILURE;
-  }
-  size_t bytesRead = 0;
-  fseek(tmpFile, 0, SEEK_SET);
-  while ((bytesRead = fread(fileBuf, sizeof(char), BUFFER_SIZE_INCREMENT,
-                            tmpFile)) != 0) {
-    // More data to read
-    if (send(connectionFd, fileBuf, bytesRead, 0) != bytesRead) {
-      syslog(LOG_ERR, "Could not send data to client");
-      pthread_mutex_unlock(tmpFileMutex);
-      THREAD_RETURN_FAILURE;
+    const ssize_t recvDataSize = recv(connectionFd, recvBuf, recvSpace, 0);
+    if (recvDataSize < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      server_connection_timed_out(closedAddr, true);
+      return EXIT_SUCCESS;
     }
-  }
-
-  pthread_mutex_unlock(tmpFileMutex);
-  // Clean up the writeback buffer on function scope end
-
-  THREAD_RETURN_SUCCESS;
-}
-
-typedef struct {
-  pthread_mutex_t *tmpFileMutex;
-  FILE *tmpFile;
-  pthread_mutex_t *endTimestamping;
-} timestamp_params_t;
-
-#define MS_PER_SEC (1000)
-#define NS_PER_MS (1000000)
-
-// Sleep for 10s
-#define SLEEP_TIME_MS (10000)
-
-static void *record_timestamp(void *param) {
-  const timestamp_params_t *parsedParams = (timestamp_params_t *)param;
-  FILE *tmpFile = parsedParams->tmpFile;
-  pthread_mutex_t *tmpFileMutex = parsedParams->tmpFileMutex;
-  pthread_mutex_t *endTimestamping = parsedParams->endTimestamping;
-  free(param);
-
-  while (true) {
-    struct timespec currTime;
-    clock_gettime(CLOCK_REALTIME, &currTime);
-    currTime.tv_sec += 10;
-    if (pthread_mutex_timedlock(endTimestamping, &currTime) != ETIMEDOUT) {
-      break;
+    if (recvDataSize < 0) {
+      async_log(LOG_ERR, "Failed to get received data from socket!");
+      return EXIT_FAILURE;
     }
-
-    time_t wallTime = time(NULL);
-    struct tm *timestamp = localtime(&wallTime);
-    char timeString[1024] = "timestamp: "; // buffer for time string
-    // parse the time into a string, after the 'timestamp:' label
-    if (strftime(timeString + 11, 1024, "%a, %d %b %Y %T %z", timestamp) == 0) {
-      syslog(LOG_ERR, "Could not log time, try again later...");
-      continue;
-    }
-    const size_t timeString_len = strlen(timeString) + 1;
-    timeString[timeString_len - 1] =
-        '\n'; // replace null-terminator with newline
-
-    if (write_safe_to_file_end(timeString, timeString_len, tmpFile,
-                               tmpFileMutex) != EXIT_SUCCESS) {
-      syslog(LOG_ERR,
-             "Could not write timestamp data to file, try again later...");
-      continue;
+    if (recvDataSize == 0) {
+      // client hung up, any unfinished packet is dropped
+      return EXIT_SUCCESS;
     }
+    line_framer_commit(&framer, recvDataSize);
+    metrics_received(&packetStart, recvDataSize);
   }
+}
 
-  return NULL;
+static void *server_work_thread(void *param) {
+  // Parse the thread params
+  const server_thread_param_t *parsedParams = (server_thread_param_t *)param;
+  const int connectionFd = parsedParams->connectionFd;
+  storage_t *storage = parsedParams->storage;
+  char clientAddr[INET_ADDRSTRLEN];
+  memcpy(clientAddr, parsedParams->clientAddr, INET_ADDRSTRLEN);
+  const server_options_t *options = parsedParams->options;
+  // autoclear flag on exit
+  atomic_flag *completionFlag CLEANUP(cleanup_completion_flag) =
+      parsedParams->completeFlag;
+  // All parameter data copied, we can free the parameter block
+  buffer_pool_free(param, sizeof(server_thread_param_t));
+
+  // the result travels in the pointer itself, nothing to allocate
+  return (void *)(intptr_t)server_handle_connection(connectionFd, storage,
+                                                    clientAddr, options);
 }
 
-int on_server_initialize(pthread_mutex_t *out_tmpFileMutex,
-                         pthread_t *out_timestampThread, FILE *tmpFile,
-                         pthread_mutex_t *endTimestamping) {
-  if (pthread_mutex_init(out_tmpFileMutex, NULL) != 0) {
-    syslog(LOG_ERR, "Could not initialize the mutex for the tempFile");
-    return EXIT_FAILURE;
+// append a "timestamp:" line to the storage
+static void record_timestamp(void *param) {
+  storage_t *storage = param;
+  const time_t wallTime = time(NULL);
+  struct tm timestamp;
+  localtime_r(&wallTime, &timestamp);
+  char timeString[1024] = "timestamp: "; // buffer for time string
+  const size_t labelSize = strlen(timeString);
+  // parse the time into a string, after the 'timestamp:' label
+  const size_t timeSize =
+      strftime(timeString + labelSize, sizeof(timeString) - labelSize - 1,
+               "%a, %d %b %Y %T %z", &timestamp);
+  if (timeSize == 0) {
+    async_log(LOG_ERR, "Could not log time, try again later...");
+    return;
   }
+  const size_t timeString_len = labelSize + timeSize + 1;
+  timeString[timeString_len - 1] = '\n';
 
-  if (pthread_mutex_init(endTimestamping, NULL) != 0) {
-    syslog(LOG_ERR,
-           "Could not initialize the mutex for the ending the timestamping");
-    return EXIT_FAILURE;
+  if (storage_append(storage, timeString, timeString_len, NULL) !=
+      EXIT_SUCCESS) {
+    async_log(LOG_ERR,
+           "Could not write timestamp data to file, try again later...");
   }
-  pthread_mutex_lock(endTimestamping);
+}
 
-  timestamp_params_t *param = malloc(sizeof(timestamp_params_t));
-  if (param == NULL) {
-    syslog(LOG_ERR, "Could not allocate space for thread parameters");
+static void log_metrics(void *param) {
+  (void)param;
+  metrics_log_report();
+}
+
+int on_server_initialize(storage_t *storage, const server_options_t *options,
+                         timer_service_t *timers) {
+  if (storage_records_timestamps(storage) &&
+      options->timestampIntervalMs > 0 &&
+      timer_service_schedule(timers, options->timestampIntervalMs,
+                             record_timestamp, storage) == NULL) {
+    async_log(LOG_ERR, "Could not schedule timestamps");
     return EXIT_FAILURE;
   }
-
-  param->tmpFile = tmpFile;
-  param->tmpFileMutex = out_tmpFileMutex;
-  param->endTimestamping = endTimestamping;
-
-  if (pthread_create(out_timestampThread, NULL, record_timestamp, param) != 0) {
-    syslog(LOG_ERR, "Could not start timestamping thread");
-    free(param);
+  if (options->metricsIntervalMs > 0 &&
+      timer_service_schedule(timers, options->metricsIntervalMs, log_metrics,
+                             NULL) == NULL) {
+    async_log(LOG_ERR, "Could not schedule metrics snapshots");
     return EXIT_FAILURE;
   }
-
-  // From here, the thread must free the parameters
-
   return EXIT_SUCCESS;
 }
 
-int on_server_connection(int connectionFd, FILE *tmpFile,
-                         pthread_mutex_t *tmpFileMutex,
+int on_server_connection(int connectionFd, storage_t *storage,
                          char clientAddr[INET_ADDRSTRLEN],
+                         const server_options_t *options,
                          pthread_t *out_thread, atomic_flag *out_flag) {
 
-  server_thread_param_t *param = malloc(sizeof(server_thread_param_t));
+  server_thread_param_t *param =
+      buffer_pool_alloc(sizeof(server_thread_param_t), NULL);
   if (param == NULL) {
-    syslog(LOG_ERR, "Could not allocate space for thread parameters");
+    // out of budget, turn the client away
+    server_memory_rejected(clientAddr);
+    cleanup_socket(&connectionFd);
     return EXIT_FAILURE;
   }
 
   param->connectionFd = connectionFd;
-  param->tmpFile = tmpFile;
-  param->tmpFileMutex = tmpFileMutex;
+  param->storage = storage;
+  param->options = options;
   bzero(param->clientAddr, INET_ADDRSTRLEN);
   if (snprintf(param->clientAddr, INET_ADDRSTRLEN, "%s", clientAddr) < 0) {
-    syslog(LOG_ERR, "Could not write client addr to thread");
-    return EXIT_FAILURE;
-  }
-  param->returnCode = malloc(sizeof(*(param->returnCode)));
-  if (param->returnCode == NULL) {
-    syslog(LOG_ERR, "Could not allocate space for thread return code");
-    free(param);
+    async_log(LOG_ERR, "Could not write client addr to thread");
+    buffer_pool_free(param, sizeof(server_thread_param_t));
+    cleanup_socket(&connectionFd);
     return EXIT_FAILURE;
   }
-  *(param->returnCode) = EXIT_FAILURE;      // assume failure
   (void)atomic_flag_test_and_set(out_flag); // assume incomplete
   param->completeFlag = out_flag;
 
   if (pthread_create(out_thread, NULL, server_work_thread, (void *)param) !=
       0) {
-    syslog(LOG_ERR, "Could not start the worker thread");
-    free(param->returnCode);
-    free(param);
+    async_log(LOG_ERR, "Could not start the worker thread");
+    buffer_pool_free(param, sizeof(server_thread_param_t));
+    cleanup_socket(&connectionFd);
     return EXIT_FAILURE;
   }
 
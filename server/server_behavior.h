@@ -3,35 +3,134 @@
 
 #include <netinet/in.h>
 #include <stdatomic.h>
-#include <stdio.h>
+#include <stdbool.h>
 #include <pthread.h>
+#include <sys/types.h>
+
+#include "replay.h"
+#include "server_options.h"
+#include "storage.h"
+#include "timer_service.h"
+
+#define REPLAY_HEADER_SIZE (64)
+
+/**
+ * @brief What is left to send back for one packet: an optional header line,
+ * then a byte range of the storage
+ */
+typedef struct {
+  off_t offset; // next stored byte to send
+  off_t end;    // stop replaying here, -1 to replay until the end
+  char header[REPLAY_HEADER_SIZE]; // sent before the stored bytes
+  size_t headerSize;
+  size_t headerSent;
+} replay_cursor_t;
 
 /**
  * @brief Perform the server action of reading in a packet, appending it to the
- * tempfile, and sending back the tempfile.
+ * storage, and sending back the stored data.
  *
  * @param connectionFd A file descriptor for the active connection
- * @param tmpFile A FILE pointer to the tempfile (needs RW access)
- * @param tmpFileMutex A mutex to protect I/O to the @ref tmpFile
+ * @param storage the storage backend, shared by every connection
  * @param clientAddr The client address, reported on connection closure
+ * @param options server options, must outlive the thread
  * @param out_thread A pthread that can be joined when work is complete.  
- * Joining returns EXIT_SUCCESS on packet handled or else EXIT_FAILURE (as int*, memory must be freed by the joiner)
+ * Joining returns EXIT_SUCCESS on packet handled or else EXIT_FAILURE (as an
+ * intptr_t cast to void*)
  * @param out_flag a completion_flag, cleared on thread finalization
- * @return EXIT_SUCCESS if the thread was started, EXIT_FAILURE on error.  The
- * program should clean up and close on EXIT_FAILURE
+ * @return EXIT_SUCCESS if the thread was started, EXIT_FAILURE if it wasn't,
+ * for instance because the memory budget is spent.  The connection is closed
+ * then, and the server can keep accepting
+ */
+int on_server_connection(int connectionFd, storage_t *storage, char clientAddr[INET_ADDRSTRLEN], const server_options_t* options, pthread_t* out_thread, atomic_flag* out_flag);
+
+/**
+ * @brief Serve one connection on the calling thread: read in a packet, append
+ * it to the storage, and send back the stored data.  With persistent sessions
+ * this repeats for every packet, in order, until the client hangs up.
+ *
+ * @param connectionFd A file descriptor for the active connection.  Ownership
+ * is taken, the connection is closed before returning
+ * @param storage the storage backend, shared by every connection
+ * @param clientAddr The client address, reported on connection closure
+ * @param options server options
+ * @return EXIT_SUCCESS on packet handled, else EXIT_FAILURE
+ */
+int server_handle_connection(int connectionFd, storage_t *storage,
+                             const char clientAddr[INET_ADDRSTRLEN],
+                             const server_options_t *options);
+
+/**
+ * @brief Stop every connection served by @ref server_handle_connection: those
+ * open are shut down, so their threads return from a blocked recv or send, and
+ * any started later close at once.  Call before joining those threads
+ */
+void server_stop_connections(void);
+
+/**
+ * @brief Handle one complete packet without touching the connection: append it
+ * to the storage (or apply it, for in-band commands) and set up what should
+ * be replayed to the client.
+ *
+ * Besides data, a packet may be one of these commands, if the backend
+ * supports it:
+ * - "AESDCHAR_IOCSEEKTO:X,Y" replays from offset Y of write command X
+ * - "AESDSOCKET_RESUME:N" replays only what was stored from log offset N on,
+ *   after a "AESDSOCKET_RANGE:start,end" header line giving the range that
+ *   follows.  start is past N if older data was dropped, and end is the
+ *   offset to resume from next time
+ *
+ * @param data packet data, including the terminating newline
+ * @param dataSize number of bytes in @ref data
+ * @param storage the storage backend
+ * @param out_cursor what to replay, for @ref server_replay
+ * @return EXIT_SUCCESS if the packet was handled, else EXIT_FAILURE
+ */
+int server_store_packet(const char *data, size_t dataSize, storage_t *storage,
+                        replay_cursor_t *out_cursor);
+
+/**
+ * @brief Send what is left of a replay
+ *
+ * @param storage the storage backend
+ * @param socketFd connected socket, blocking or non-blocking
+ * @param cursor the replay, advanced past everything that was sent
+ * @param scratch copy buffer, for backends that can't send directly
+ * @return the replay status, REPLAY_WOULD_BLOCK only for non-blocking sockets
+ */
+replay_status_t server_replay(storage_t *storage, int socketFd,
+                              replay_cursor_t *cursor,
+                              replay_buffer_t *scratch);
+
+/**
+ * @brief Count and log a connection that is being closed for missing its
+ * read or write deadline
+ *
+ * @param clientAddr the client address
+ * @param reading whether it missed the read deadline, else the write one
+ */
+void server_connection_timed_out(const char *clientAddr, bool reading);
+
+/**
+ * @brief Count and log a connection that is being closed for going over the
+ * per-connection buffer limit or the server's memory budget
+ *
+ * @param clientAddr the client address
  */
-int on_server_connection(int connectionFd, FILE *tmpFile, pthread_mutex_t* tmpFileMutex,  char clientAddr[INET_ADDRSTRLEN], pthread_t* out_thread, atomic_flag* out_flag);
+void server_memory_rejected(const char *clientAddr);
 
 /**
- * @brief Setup the server's multithreading implementation
- * 
- * @param out_tmpFileMutex a mutex to protect the temp file for the server.  Used on thread creation
- * @param out_timestampThread a thread recording timestamps to the tempFile.  Should be joined separately before general resource cleanup
- * @param tmpFile the temporary file for logging (required by timestamping thread)
- * @param endTimestamping a flag to signal the timestamp thread to stop.  Should be cleared before joining
+ * @brief Schedule the server's periodic jobs: timestamps, if the storage
+ * wants them, and metrics snapshots, if enabled
+ *
+ * @param storage the storage backend, timestamps are recorded into it.  The
+ * timer service must be stopped before it is closed
+ * @param options the intervals of the jobs
+ * @param timers the timer service running the jobs
  * @return EXIT_SUCCESS if success, EXIT_FAILURE on error.  The
  * program should clean up and close on EXIT_FAILURE
  */
-int on_server_initialize(pthread_mutex_t *out_tmpFileMutex, pthread_t *out_timestampThread, FILE* tmpFile, pthread_mutex_t* endTimestamping);
+int on_server_initialize(storage_t *storage, const server_options_t *options,
+                         timer_service_t *timers);
 
 #endif
@@ -0,0 +1,351 @@
+#include "server_options.h"
+#include "async_log.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#define DEFAULT_QUEUE_DEPTH (64)
+#define DEFAULT_LISTEN_BACKLOG (20)
+#define DEFAULT_DURABILITY_INTERVAL_MS (1000)
+#define DEFAULT_RING_CAPACITY (1024 * 1024)
+#define DEFAULT_TIMESTAMP_INTERVAL_S (10)
+#define DEFAULT_READ_TIMEOUT_S (0)
+#define DEFAULT_WRITE_TIMEOUT_S (0)
+#define DEFAULT_CONNECTION_BUFFER_LIMIT (16 * 1024 * 1024)
+#define DEFAULT_MEMORY_BUDGET (256 * 1024 * 1024)
+#define MAX_INTERVAL_S (UINT_MAX / 1000)
+
+// The build picks the default backend, -b overrides it at runtime
+#if USE_AESD_CHAR_DEVICE
+#define DEFAULT_STORAGE_BACKEND (STORAGE_CHARDEV)
+#else
+#define DEFAULT_STORAGE_BACKEND (STORAGE_FILE)
+#endif
+
+static void print_usage(const char *program) {
+  fprintf(stderr,
+          "Usage: %s [-d] [-s] [-l backlog] [-b backend] [-D mode] [-m path]\n"
+          "          [-v level] [-o path] [-t seconds] [-M seconds]\n"
+          "          [-T seconds] [-W seconds] [-L bytes] [-G bytes]\n"
+          "          [-e threads [-r] [-p] | -w threads [-q depth] | -u]\n"
+          "  -d          run as a daemon\n"
+          "  -s          keep connections open, answering each packet in turn\n"
+          "  -l backlog  pending connections per listening socket "
+          "(default %d)\n"
+          "  -e threads  serve connections from epoll event loops instead of "
+          "a thread per connection\n"
+          "  -r          give each event loop its own SO_REUSEPORT socket, "
+          "accepting and\n"
+          "              serving its connections on one thread\n"
+          "  -p          pin each event loop to its own CPU, and steer its "
+          "socket's\n"
+          "              connections to that CPU\n"
+          "  -w threads  serve connections from a fixed worker pool, 0 for "
+          "one worker per core\n"
+          "  -q depth    accepted connections that may wait for a worker "
+          "(default %u)\n"
+          "  -u          serve connections from an io_uring, falling back to "
+          "a thread\n"
+          "              per connection if the kernel can't\n"
+          "  -D mode     tempfile durability: write (fsync every packet, "
+          "default),\n"
+          "              group (batch concurrent packets into one sync) or\n"
+          "              interval[:ms] (sync every ms, default %u)\n"
+          "  -b backend  packet storage (default %s):\n"
+          "              file (tempfile, the only backend -D applies to),\n"
+          "              mmap (append log replayed from a memory mapping),\n"
+          "              chardev (the aesdchar device) or\n"
+          "              ring[:bytes] (in-memory ring, default %u bytes)\n"
+          "  -m path     also serve the metrics report on a Unix socket, "
+          "besides\n"
+          "              logging it on SIGUSR1\n"
+          "  -v level    most verbose messages to log: err, warning, notice, "
+          "info\n"
+          "              (default) or debug\n"
+          "  -o path     append the log to a file instead of syslog\n"
+          "  -t seconds  append a timestamp line this often, 0 for never "
+          "(default %u)\n"
+          "  -M seconds  log a metrics snapshot this often (default never)\n"
+          "  -T seconds  close connections that take longer to send a "
+          "packet, 0 for\n"
+          "              no limit (default %u)\n"
+          "  -W seconds  close connections that stop reading their replay "
+          "this long,\n"
+          "              0 for no limit (default %u)\n"
+          "  -L bytes    receive buffer limit per connection, longer packets "
+          "close the\n"
+          "              connection (default %u)\n"
+          "  -G bytes    memory budget for all connections, 0 for no limit "
+          "(default %u)\n",
+          program, DEFAULT_LISTEN_BACKLOG, DEFAULT_QUEUE_DEPTH,
+          DEFAULT_DURABILITY_INTERVAL_MS,
+          DEFAULT_STORAGE_BACKEND == STORAGE_CHARDEV ? "chardev" : "file",
+          DEFAULT_RING_CAPACITY, DEFAULT_TIMESTAMP_INTERVAL_S,
+          DEFAULT_READ_TIMEOUT_S, DEFAULT_WRITE_TIMEOUT_S,
+          DEFAULT_CONNECTION_BUFFER_LIMIT, DEFAULT_MEMORY_BUDGET);
+}
+
+// parse a non-negative decimal option argument
+static int parse_unsigned(const char *arg, unsigned *out_value) {
+  char *end = NULL;
+  errno = 0;
+  const unsigned long value = strtoul(arg, &end, 10);
+  if (errno != 0 || end == arg || *end != '\0' || value > UINT_MAX ||
+      arg[0] == '-') {
+    return EXIT_FAILURE;
+  }
+  *out_value = (unsigned)value;
+  return EXIT_SUCCESS;
+}
+
+// parse a period in seconds, kept in milliseconds
+static int parse_interval(const char *arg, unsigned *out_intervalMs) {
+  unsigned seconds = 0;
+  if (parse_unsigned(arg, &seconds) != EXIT_SUCCESS ||
+      seconds > MAX_INTERVAL_S) {
+    return EXIT_FAILURE;
+  }
+  *out_intervalMs = seconds * 1000;
+  return EXIT_SUCCESS;
+}
+
+// parse "write", "group" or "interval[:ms]"
+static int parse_durability(const char *arg, server_options_t *out_options) {
+  if (strcmp(arg, "write") == 0) {
+    out_options->durabilityMode = DURABILITY_PER_WRITE;
+  } else if (strcmp(arg, "group") == 0) {
+    out_options->durabilityMode = DURABILITY_GROUP_COMMIT;
+  } else if (strncmp(arg, "interval", strlen("interval")) == 0) {
+    const char *interval = arg + strlen("interval");
+    if (*interval == ':') {
+      if (parse_unsigned(interval + 1, &out_options->durabilityIntervalMs) !=
+              EXIT_SUCCESS ||
+          out_options->durabilityIntervalMs == 0) {
+        return EXIT_FAILURE;
+      }
+    } else if (*interval != '\0') {
+      return EXIT_FAILURE;
+    }
+    out_options->durabilityMode = DURABILITY_INTERVAL;
+  } else {
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+// parse "file", "mmap", "chardev" or "ring[:bytes]"
+static int parse_storage(const char *arg, server_options_t *out_options) {
+  if (strcmp(arg, "file") == 0) {
+    out_options->storageBackend = STORAGE_FILE;
+  } else if (strcmp(arg, "mmap") == 0) {
+    out_options->storageBackend = STORAGE_MMAP;
+  } else if (strcmp(arg, "chardev") == 0) {
+    out_options->storageBackend = STORAGE_CHARDEV;
+  } else if (strncmp(arg, "ring", strlen("ring")) == 0) {
+    const char *capacity = arg + strlen("ring");
+    if (*capacity == ':') {
+      unsigned ringCapacity = 0;
+      if (parse_unsigned(capacity + 1, &ringCapacity) != EXIT_SUCCESS ||
+          ringCapacity == 0) {
+        return EXIT_FAILURE;
+      }
+      out_options->ringCapacity = ringCapacity;
+    } else if (*capacity != '\0') {
+      return EXIT_FAILURE;
+    }
+    out_options->storageBackend = STORAGE_RING;
+  } else {
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+int parse_server_options(int argc, char **argv, server_options_t *out_options) {
+  bzero(out_options, sizeof(*out_options));
+  out_options->queueDepth = DEFAULT_QUEUE_DEPTH;
+  out_options->listenBacklog = DEFAULT_LISTEN_BACKLOG;
+  out_options->durabilityMode = DURABILITY_PER_WRITE;
+  out_options->durabilityIntervalMs = DEFAULT_DURABILITY_INTERVAL_MS;
+  out_options->storageBackend = DEFAULT_STORAGE_BACKEND;
+  out_options->ringCapacity = DEFAULT_RING_CAPACITY;
+  out_options->logLevel = LOG_INFO;
+  out_options->timestampIntervalMs = DEFAULT_TIMESTAMP_INTERVAL_S * 1000;
+  out_options->readTimeoutMs = DEFAULT_READ_TIMEOUT_S * 1000;
+  out_options->writeTimeoutMs = DEFAULT_WRITE_TIMEOUT_S * 1000;
+  out_options->connectionBufferLimit = DEFAULT_CONNECTION_BUFFER_LIMIT;
+  out_options->memoryBudget = DEFAULT_MEMORY_BUDGET;
+
+  int option;
+  while ((option = getopt(argc, argv, "dsl:e:rpw:q:uD:b:m:v:o:t:M:T:W:L:G:")) != -1) {
+    switch (option) {
+    case 'd':
+      out_options->isDaemon = true;
+      break;
+    case 's':
+      out_options->persistentSessions = true;
+      break;
+    case 'l': {
+      unsigned backlog = 0;
+      if (parse_unsigned(optarg, &backlog) != EXIT_SUCCESS || backlog == 0 ||
+          backlog > INT_MAX) {
+        fprintf(stderr, "Invalid listen backlog: %s\n", optarg);
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      out_options->listenBacklog = (int)backlog;
+      break;
+    }
+    case 'r':
+      out_options->reusePort = true;
+      break;
+    case 'p':
+      out_options->pinThreads = true;
+      break;
+    case 'e':
+      if (parse_unsigned(optarg, &out_options->eventLoopThreads) !=
+          EXIT_SUCCESS) {
+        fprintf(stderr, "Invalid event loop thread count: %s\n", optarg);
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'w':
+      if (parse_unsigned(optarg, &out_options->workerThreads) !=
+          EXIT_SUCCESS) {
+        fprintf(stderr, "Invalid worker thread count: %s\n", optarg);
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      out_options->useWorkerPool = true;
+      break;
+    case 'q':
+      if (parse_unsigned(optarg, &out_options->queueDepth) != EXIT_SUCCESS ||
+          out_options->queueDepth == 0) {
+        fprintf(stderr, "Invalid queue depth: %s\n", optarg);
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'u':
+      out_options->useIoUring = true;
+      break;
+    case 'D':
+      if (parse_durability(optarg, out_options) != EXIT_SUCCESS) {
+        fprintf(stderr, "Invalid durability mode: %s\n", optarg);
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'b':
+      if (parse_storage(optarg, out_options) != EXIT_SUCCESS) {
+        fprintf(stderr, "Invalid storage backend: %s\n", optarg);
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'm':
+      out_options->metricsSocket = optarg;
+      break;
+    case 'v':
+      if (async_log_parse_level(optarg, &out_options->logLevel) !=
+          EXIT_SUCCESS) {
+        fprintf(stderr, "Invalid log level: %s\n", optarg);
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'o':
+      out_options->logFile = optarg;
+      break;
+    case 't':
+      if (parse_interval(optarg, &out_options->timestampIntervalMs) !=
+          EXIT_SUCCESS) {
+        fprintf(stderr, "Invalid timestamp interval: %s\n", optarg);
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'M':
+      if (parse_interval(optarg, &out_options->metricsIntervalMs) !=
+          EXIT_SUCCESS) {
+        fprintf(stderr, "Invalid metrics interval: %s\n", optarg);
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'T':
+      if (parse_interval(optarg, &out_options->readTimeoutMs) !=
+          EXIT_SUCCESS) {
+        fprintf(stderr, "Invalid read timeout: %s\n", optarg);
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'W':
+      if (parse_interval(optarg, &out_options->writeTimeoutMs) !=
+          EXIT_SUCCESS) {
+        fprintf(stderr, "Invalid write timeout: %s\n", optarg);
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'L': {
+      unsigned limit = 0;
+      if (parse_unsigned(optarg, &limit) != EXIT_SUCCESS || limit == 0) {
+        fprintf(stderr, "Invalid connection buffer limit: %s\n", optarg);
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      out_options->connectionBufferLimit = limit;
+      break;
+    }
+    case 'G': {
+      unsigned budget = 0;
+      if (parse_unsigned(optarg, &budget) != EXIT_SUCCESS) {
+        fprintf(stderr, "Invalid memory budget: %s\n", optarg);
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      out_options->memoryBudget = budget;
+      break;
+    }
+    default:
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if ((out_options->useWorkerPool ? 1 : 0) +
+          (out_options->eventLoopThreads > 0 ? 1 : 0) +
+          (out_options->useIoUring ? 1 : 0) >
+      1) {
+    fprintf(stderr, "-e, -w and -u select different serving modes\n");
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if ((out_options->reusePort || out_options->pinThreads) &&
+      out_options->eventLoopThreads == 0) {
+    fprintf(stderr, "-r and -p apply to the event loops, they need -e\n");
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (out_options->storageBackend != STORAGE_FILE &&
+      out_options->durabilityMode != DURABILITY_PER_WRITE) {
+    fprintf(stderr, "-D only applies to the file backend\n");
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (optind != argc) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,71 @@
+#ifndef SERVER_OPTIONS_H
+#define SERVER_OPTIONS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "durable_writer.h"
+
+/**
+ * @brief Where the packet data is kept
+ */
+typedef enum {
+  STORAGE_FILE,    // stdio appends to the tempfile, replayed with sendfile
+  STORAGE_MMAP,    // append log mapped over the tempfile, replayed from memory
+  STORAGE_CHARDEV, // the aesdchar driver, handles AESDCHAR_IOCSEEKTO
+  STORAGE_RING,    // fixed-size in-memory ring, drops the oldest lines
+} storage_backend_t;
+
+/**
+ * @brief Runtime configuration of the server, parsed from the command line
+ */
+typedef struct {
+  bool isDaemon;              // -d: fork into the background after binding
+  unsigned eventLoopThreads;  // -e N: serve on N epoll loops, 0 for a thread
+                              // per connection
+  bool reusePort;             // -r: each event loop accepts on its own
+                              // SO_REUSEPORT socket
+  bool pinThreads;            // -p: pin each event loop to its own CPU
+  int listenBacklog;          // -l N: pending connections per socket
+  bool useWorkerPool;         // -w N: serve from a pool of worker threads
+  unsigned workerThreads;     // pool size, 0 for one per online core
+  unsigned queueDepth;        // -q N: connections waiting for a pool worker
+  bool useIoUring;            // -u: serve from an io_uring, if the kernel
+                              // supports it
+  bool persistentSessions;    // -s: answer every packet until the client
+                              // hangs up, instead of one per connection
+  durability_mode_t durabilityMode; // -D mode: how appends reach the disk
+  unsigned durabilityIntervalMs;    // sync period for -D interval[:ms]
+  storage_backend_t storageBackend; // -b file|mmap|chardev|ring[:bytes]
+  size_t ringCapacity;              // ring size for -b ring
+  const char *metricsSocket;        // -m path: serve metrics on a Unix
+                                    // socket, NULL for SIGUSR1 only
+  int logLevel;                     // -v level: most verbose syslog
+                                    // priority that is logged
+  const char *logFile;              // -o path: log to a file, NULL for
+                                    // syslog
+  unsigned timestampIntervalMs;     // -t s: timestamp period, 0 for none
+  unsigned metricsIntervalMs;       // -M s: metrics snapshot period, 0 for
+                                    // none
+  unsigned readTimeoutMs;           // -T s: time allowed to receive each
+                                    // packet, 0 for no limit
+  unsigned writeTimeoutMs;          // -W s: time a replay may go without
+                                    // progress, 0 for no limit
+  size_t connectionBufferLimit;     // -L bytes: receive buffer cap per
+                                    // connection, bounds the packet size
+  size_t memoryBudget;              // -G bytes: cap on all connection
+                                    // state and buffers, 0 for none
+} server_options_t;
+
+/**
+ * @brief Parse the server command line
+ *
+ * @param argc argument count, as passed to main
+ * @param argv argument vector, as passed to main
+ * @param out_options parsed options, defaults filled in for anything not given
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on an invalid command line
+ * (usage is printed to stderr)
+ */
+int parse_server_options(int argc, char **argv, server_options_t *out_options);
+
+#endif
@@ -0,0 +1,102 @@
+#include "storage.h"
+#include "async_log.h"
+#include "storage_backends.h"
+#include "metrics.h"
+#include <stdlib.h>
+
+#define FILE_STORAGE_PATH ("/var/tmp/aesdsocket")
+#define CHARDEV_STORAGE_PATH ("/dev/aesdchar")
+
+storage_t *storage_open(const server_options_t *options) {
+  storage_t *storage = NULL;
+  switch (options->storageBackend) {
+  case STORAGE_FILE:
+    storage = storage_file_open(FILE_STORAGE_PATH, options->durabilityMode,
+                                options->durabilityIntervalMs);
+    break;
+  case STORAGE_MMAP:
+    storage = storage_mmap_open(FILE_STORAGE_PATH);
+    break;
+  case STORAGE_CHARDEV:
+    storage = storage_chardev_open(CHARDEV_STORAGE_PATH);
+    break;
+  case STORAGE_RING:
+    storage = storage_ring_open(options->ringCapacity);
+    break;
+  }
+
+  if (storage == NULL) {
+    async_log(LOG_ERR, "Could not open the storage backend");
+    return NULL;
+  }
+  async_log(LOG_INFO, "Storing data with the %s backend", storage->ops->name);
+  return storage;
+}
+
+void storage_close(storage_t *storage) {
+  if (storage == NULL) {
+    return;
+  }
+  if (storage_flush(storage) != EXIT_SUCCESS) {
+    async_log(LOG_WARNING, "Could not flush the %s backend", storage->ops->name);
+  }
+  storage->ops->close(storage);
+}
+
+int storage_append(storage_t *storage, const char *data, size_t dataSize,
+                   off_t *out_end) {
+  const uint64_t start = metrics_now();
+  const int result = storage->ops->append(storage, data, dataSize, out_end);
+  metrics_record(METRICS_APPEND, start);
+  return result;
+}
+
+replay_status_t storage_replay(storage_t *storage, int socketFd, off_t *offset,
+                               off_t end, replay_buffer_t *scratch) {
+  const uint64_t start = metrics_now();
+  const off_t startOffset = *offset;
+  const replay_status_t status = storage->ops->replay(
+      storage, socketFd, offset, end, scratch);
+  metrics_record(METRICS_REPLAY, start);
+  // what the replay advanced over.  That is what was sent, unless a ring
+  // dropped lines from under a slow client
+  if (*offset > startOffset) {
+    metrics_count(METRICS_BYTES_OUT, *offset - startOffset);
+  }
+  return status;
+}
+
+bool storage_supports_seek(const storage_t *storage) {
+  return storage->ops->seek_to_command != NULL;
+}
+
+int storage_seek_to_command(storage_t *storage, uint32_t command,
+                            uint32_t commandOffset, off_t *out_offset) {
+  if (!storage_supports_seek(storage)) {
+    return EXIT_FAILURE;
+  }
+  return storage->ops->seek_to_command(storage, command, commandOffset,
+                                       out_offset);
+}
+
+bool storage_supports_resume(const storage_t *storage) {
+  return storage->ops->bounds != NULL;
+}
+
+int storage_bounds(storage_t *storage, off_t *out_oldest, off_t *out_end) {
+  if (!storage_supports_resume(storage)) {
+    return EXIT_FAILURE;
+  }
+  return storage->ops->bounds(storage, out_oldest, out_end);
+}
+
+int storage_flush(storage_t *storage) {
+  const uint64_t start = metrics_now();
+  const int result = storage->ops->flush(storage);
+  metrics_record(METRICS_SYNC, start);
+  return result;
+}
+
+bool storage_records_timestamps(const storage_t *storage) {
+  return storage->ops->recordsTimestamps;
+}
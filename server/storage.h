@@ -0,0 +1,150 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "replay.h"
+#include "server_options.h"
+
+typedef struct storage storage_t;
+
+/**
+ * @brief Operations a storage backend implements.  Every operation may be
+ * called from any thread, backends do their own locking
+ */
+typedef struct {
+  const char *name;
+  bool recordsTimestamps; // the server appends a timestamp line periodically
+
+  /**
+   * @brief Append data to the end of the stored log
+   *
+   * @param out_end if not NULL, the offset to stop replaying this append's
+   * snapshot at, or -1 if the backend has no stable snapshot
+   * @return EXIT_SUCCESS on pass, else EXIT_FAILURE
+   */
+  int (*append)(storage_t *storage, const char *data, size_t dataSize,
+                off_t *out_end);
+
+  /**
+   * @brief Send a byte range of the log to a socket
+   *
+   * @param offset first byte to send, advanced past everything that was sent
+   * @param end offset to stop at, or -1 to send until the end of the log
+   * @param scratch copy buffer, for backends that can't send directly
+   * @return the replay status, REPLAY_WOULD_BLOCK only for non-blocking
+   * sockets
+   */
+  replay_status_t (*replay)(storage_t *storage, int socketFd, off_t *offset,
+                            off_t end, replay_buffer_t *scratch);
+
+  /**
+   * @brief Find where a stored write command starts, for
+   * AESDCHAR_IOCSEEKTO requests.  NULL if the backend doesn't support it, the
+   * request is then stored like any other packet
+   *
+   * @param command zero referenced write command
+   * @param commandOffset zero referenced offset within the command
+   * @param out_offset log offset to replay from
+   * @return EXIT_SUCCESS on pass, else EXIT_FAILURE
+   */
+  int (*seek_to_command)(storage_t *storage, uint32_t command,
+                         uint32_t commandOffset, off_t *out_offset);
+
+  /**
+   * @brief Range of offsets the log holds right now, for AESDSOCKET_RESUME
+   * requests.  NULL if offsets aren't stable, the request is then stored like
+   * any other packet
+   *
+   * @param out_oldest first offset still held
+   * @param out_end offset just past the newest complete append
+   * @return EXIT_SUCCESS on pass, else EXIT_FAILURE
+   */
+  int (*bounds)(storage_t *storage, off_t *out_oldest, off_t *out_end);
+
+  /**
+   * @brief Make everything appended so far durable
+   *
+   * @return EXIT_SUCCESS on pass, else EXIT_FAILURE
+   */
+  int (*flush)(storage_t *storage);
+
+  /**
+   * @brief Release the backend.  No other operation may be running
+   */
+  void (*close)(storage_t *storage);
+} storage_ops_t;
+
+/**
+ * @brief Common head of every backend's state
+ */
+struct storage {
+  const storage_ops_t *ops;
+};
+
+/**
+ * @brief Open the storage backend selected by the options
+ *
+ * @param options server options: storageBackend and its settings
+ * @return the backend, or NULL on error
+ */
+storage_t *storage_open(const server_options_t *options);
+
+/**
+ * @brief Flush and close a backend
+ *
+ * @param storage the backend, may be NULL
+ */
+void storage_close(storage_t *storage);
+
+/**
+ * @brief @ref storage_ops_t::append
+ */
+int storage_append(storage_t *storage, const char *data, size_t dataSize,
+                   off_t *out_end);
+
+/**
+ * @brief @ref storage_ops_t::replay
+ */
+replay_status_t storage_replay(storage_t *storage, int socketFd, off_t *offset,
+                               off_t end, replay_buffer_t *scratch);
+
+/**
+ * @brief Whether the backend handles AESDCHAR_IOCSEEKTO requests
+ */
+bool storage_supports_seek(const storage_t *storage);
+
+/**
+ * @brief @ref storage_ops_t::seek_to_command
+ *
+ * @return EXIT_FAILURE as well if the backend doesn't support seeking
+ */
+int storage_seek_to_command(storage_t *storage, uint32_t command,
+                            uint32_t commandOffset, off_t *out_offset);
+
+/**
+ * @brief Whether the backend handles AESDSOCKET_RESUME requests
+ */
+bool storage_supports_resume(const storage_t *storage);
+
+/**
+ * @brief @ref storage_ops_t::bounds
+ *
+ * @return EXIT_FAILURE as well if the backend's offsets aren't stable
+ */
+int storage_bounds(storage_t *storage, off_t *out_oldest, off_t *out_end);
+
+/**
+ * @brief @ref storage_ops_t::flush
+ */
+int storage_flush(storage_t *storage);
+
+/**
+ * @brief Whether the server should record timestamps into this backend
+ */
+bool storage_records_timestamps(const storage_t *storage);
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef STORAGE_BACKENDS_H
+#define STORAGE_BACKENDS_H
+
+#include <stddef.h>
+
+#include "durable_writer.h"
+#include "storage.h"
+
+/**
+ * @brief Constructors of the concrete storage backends, used by
+ * @ref storage_open
+ */
+
+/**
+ * @brief Regular file appended through stdio and replayed with sendfile.
+ * The file is created empty and removed on close
+ *
+ * @param path file to store into
+ * @param mode how appends are made durable
+ * @param intervalMs time between syncs, for DURABILITY_INTERVAL
+ * @return the backend, or NULL on error
+ */
+storage_t *storage_file_open(const char *path, durability_mode_t mode,
+                             unsigned intervalMs);
+
+/**
+ * @brief Append log in a memory-mapped file, replayed straight from the
+ * mapping.  The file is created empty and removed on close
+ *
+ * @param path file to map
+ * @return the backend, or NULL on error
+ */
+storage_t *storage_mmap_open(const char *path);
+
+/**
+ * @brief The aesdchar driver.  The device is opened on first use, and handles
+ * AESDCHAR_IOCSEEKTO requests
+ *
+ * @param path device node
+ * @return the backend, or NULL on error
+ */
+storage_t *storage_chardev_open(const char *path);
+
+/**
+ * @brief Fixed-size in-memory ring.  The oldest lines are dropped to make room
+ * for new ones
+ *
+ * @param capacity ring size in bytes, the longest line that can be stored
+ * @return the backend, or NULL on error
+ */
+storage_t *storage_ring_open(size_t capacity);
+
+#endif
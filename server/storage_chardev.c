@@ -0,0 +1,147 @@
+#include "aesd_ioctl.h"
+#include "async_log.h"
+#include "cleanup.h"
+#include "metrics.h"
+#include "storage_backends.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+typedef struct {
+  storage_t base;
+  const char *path;
+  int fd;                      // -1 until first use
+  pthread_mutex_t deviceMutex; // guards opening fd, appends and the device
+                               // file position, not replays
+} chardev_storage_t;
+
+// open the device on first use, the driver may be loaded after the server
+// starts.  Called with deviceMutex held
+static int ensure_open(chardev_storage_t *device) {
+  if (device->fd != -1) {
+    return EXIT_SUCCESS;
+  }
+  device->fd = open(device->path, O_RDWR | O_CLOEXEC);
+  if (device->fd == -1) {
+    async_log(LOG_ERR, "Could not open %s", device->path);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+static int chardev_append(storage_t *storage, const char *data,
+                          size_t dataSize, off_t *out_end) {
+  chardev_storage_t *device = (chardev_storage_t *)storage;
+  metrics_lock(&device->deviceMutex);
+  if (ensure_open(device) != EXIT_SUCCESS) {
+    pthread_mutex_unlock(&device->deviceMutex);
+    return EXIT_FAILURE;
+  }
+  // the driver assembles partial writes into one entry, keep them together
+  size_t written = 0;
+  while (written < dataSize) {
+    const ssize_t result =
+        write(device->fd, data + written, dataSize - written);
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      async_log(LOG_ERR, "Could not write data to the device");
+      pthread_mutex_unlock(&device->deviceMutex);
+      return EXIT_FAILURE;
+    }
+    written += result;
+  }
+  pthread_mutex_unlock(&device->deviceMutex);
+
+  // the device drops its oldest entries as new ones arrive, so there is no
+  // stable snapshot
+  if (out_end != NULL) {
+    *out_end = -1;
+  }
+  return EXIT_SUCCESS;
+}
+
+static replay_status_t chardev_replay(storage_t *storage, int socketFd,
+                                      off_t *offset, off_t end,
+                                      replay_buffer_t *scratch) {
+  chardev_storage_t *device = (chardev_storage_t *)storage;
+  // the lock only covers opening: the fd stays open until the storage is
+  // closed, and preads leave the shared file position alone
+  metrics_lock(&device->deviceMutex);
+  if (ensure_open(device) != EXIT_SUCCESS) {
+    pthread_mutex_unlock(&device->deviceMutex);
+    return REPLAY_FAILED;
+  }
+  const int fd = device->fd;
+  pthread_mutex_unlock(&device->deviceMutex);
+
+  // the driver reads without a lock, so a slow client stalls nobody.  Entries
+  // dropped by writers meanwhile shift what later preads see, as they would
+  // for any reader of the device
+  return replay_copy_range(socketFd, fd, offset, end, scratch);
+}
+
+static int chardev_seek_to_command(storage_t *storage, uint32_t command,
+                                   uint32_t commandOffset, off_t *out_offset) {
+  chardev_storage_t *device = (chardev_storage_t *)storage;
+  metrics_lock(&device->deviceMutex);
+  if (ensure_open(device) != EXIT_SUCCESS) {
+    pthread_mutex_unlock(&device->deviceMutex);
+    return EXIT_FAILURE;
+  }
+
+  struct aesd_seekto cmd = {
+      .write_cmd = command,
+      .write_cmd_offset = commandOffset,
+  };
+  if (ioctl(device->fd, AESDCHAR_IOCSEEKTO, (long)(&cmd)) != 0) {
+    async_log(LOG_WARNING, "IOCTL to aesdchar device failed, returning undefined "
+                        "file contents");
+  }
+  // replay from wherever the device was seeked to
+  *out_offset = lseek(device->fd, 0, SEEK_CUR);
+  pthread_mutex_unlock(&device->deviceMutex);
+  return *out_offset < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static int chardev_flush(storage_t *storage) {
+  (void)storage; // writes go straight to the driver, nothing is buffered
+  return EXIT_SUCCESS;
+}
+
+static void chardev_close(storage_t *storage) {
+  chardev_storage_t *device = (chardev_storage_t *)storage;
+  // the device keeps its contents, only the handle is released
+  cleanup_fd(&device->fd);
+  pthread_mutex_destroy(&device->deviceMutex);
+  free(device);
+}
+
+static const storage_ops_t CHARDEV_STORAGE_OPS = {
+    .name = "chardev",
+    .recordsTimestamps = false,
+    .append = chardev_append,
+    .replay = chardev_replay,
+    .seek_to_command = chardev_seek_to_command,
+    // the device renumbers its offsets as it drops old entries
+    .bounds = NULL,
+    .flush = chardev_flush,
+    .close = chardev_close,
+};
+
+storage_t *storage_chardev_open(const char *path) {
+  chardev_storage_t *device = calloc(1, sizeof(*device));
+  if (device == NULL) {
+    async_log(LOG_ERR, "Could not allocate the device storage");
+    return NULL;
+  }
+  device->base.ops = &CHARDEV_STORAGE_OPS;
+  device->path = path;
+  device->fd = -1;
+  pthread_mutex_init(&device->deviceMutex, NULL);
+  return &device->base;
+}
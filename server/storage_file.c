@@ -0,0 +1,138 @@
+#include "storage_backends.h"
+#include "async_log.h"
+#include "metrics.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef struct {
+  storage_t base;
+  const char *path;
+  FILE *file;
+  pthread_mutex_t fileMutex; // held only while data goes in
+  // batches appends for the group-commit and interval durability modes, NULL
+  // for fsync per write
+  durable_writer_t *durableWriter;
+} file_storage_t;
+
+static int file_append(storage_t *storage, const char *data, size_t dataSize,
+                       off_t *out_end) {
+  file_storage_t *fileStorage = (file_storage_t *)storage;
+  if (fileStorage->durableWriter != NULL) {
+    return durable_writer_append(fileStorage->durableWriter, data, dataSize,
+                                 out_end);
+  }
+
+  metrics_lock(&fileStorage->fileMutex);
+  fseek(fileStorage->file, 0, SEEK_END);
+  if (fwrite(data, sizeof(char), dataSize, fileStorage->file) != dataSize) {
+    async_log(LOG_ERR, "Could not write data to file");
+    pthread_mutex_unlock(&fileStorage->fileMutex);
+    return EXIT_FAILURE;
+  }
+  // hand the data to the OS, so readers of the file can see it
+  fflush(fileStorage->file);
+  if (out_end != NULL) {
+    *out_end = ftello(fileStorage->file);
+  }
+  pthread_mutex_unlock(&fileStorage->fileMutex);
+
+  // flush data to disc, avoid relying on OS synchronization for the FS.  This
+  // covers everything written so far, so other appenders needn't wait on it
+  const uint64_t syncStart = metrics_now();
+  fsync(fileno(fileStorage->file));
+  metrics_record(METRICS_SYNC, syncStart);
+  return EXIT_SUCCESS;
+}
+
+static replay_status_t file_replay(storage_t *storage, int socketFd,
+                                   off_t *offset, off_t end,
+                                   replay_buffer_t *scratch) {
+  // the file is append-only, the replayed range is never rewritten
+  return replay_file_range(socketFd, fileno(((file_storage_t *)storage)->file),
+                           offset, end, scratch);
+}
+
+static int file_bounds(storage_t *storage, off_t *out_oldest,
+                       off_t *out_end) {
+  file_storage_t *fileStorage = (file_storage_t *)storage;
+  // every writer holds the lock while its data goes in, so the size under the
+  // lock ends on a whole append
+  struct stat fileStat;
+  metrics_lock(&fileStorage->fileMutex);
+  const int statResult = fstat(fileno(fileStorage->file), &fileStat);
+  pthread_mutex_unlock(&fileStorage->fileMutex);
+  if (statResult != 0) {
+    async_log(LOG_ERR, "Could not get the tempfile size");
+    return EXIT_FAILURE;
+  }
+  *out_oldest = 0;
+  *out_end = fileStat.st_size;
+  return EXIT_SUCCESS;
+}
+
+static int file_flush(storage_t *storage) {
+  file_storage_t *fileStorage = (file_storage_t *)storage;
+  metrics_lock(&fileStorage->fileMutex);
+  const int flushResult = fflush(fileStorage->file);
+  pthread_mutex_unlock(&fileStorage->fileMutex);
+  if (flushResult != 0 || fsync(fileno(fileStorage->file)) != 0) {
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+static void file_close(storage_t *storage) {
+  file_storage_t *fileStorage = (file_storage_t *)storage;
+  durable_writer_destroy(fileStorage->durableWriter);
+  unlink(fileStorage->path);
+  fclose(fileStorage->file);
+  pthread_mutex_destroy(&fileStorage->fileMutex);
+  free(fileStorage);
+}
+
+static const storage_ops_t FILE_STORAGE_OPS = {
+    .name = "file",
+    .recordsTimestamps = true,
+    .append = file_append,
+    .replay = file_replay,
+    .seek_to_command = NULL,
+    .bounds = file_bounds,
+    .flush = file_flush,
+    .close = file_close,
+};
+
+storage_t *storage_file_open(const char *path, durability_mode_t mode,
+                             unsigned intervalMs) {
+  file_storage_t *fileStorage = calloc(1, sizeof(*fileStorage));
+  if (fileStorage == NULL) {
+    async_log(LOG_ERR, "Could not allocate the file storage");
+    return NULL;
+  }
+  fileStorage->base.ops = &FILE_STORAGE_OPS;
+  fileStorage->path = path;
+  pthread_mutex_init(&fileStorage->fileMutex, NULL);
+
+  // Open/clear the storage file
+  fileStorage->file = fopen(path, "w+");
+  if (fileStorage->file == NULL) {
+    async_log(LOG_ERR, "Could not open %s", path);
+    pthread_mutex_destroy(&fileStorage->fileMutex);
+    free(fileStorage);
+    return NULL;
+  }
+
+  if (mode != DURABILITY_PER_WRITE) {
+    fileStorage->durableWriter = durable_writer_create(
+        mode, intervalMs, fileStorage->file, &fileStorage->fileMutex);
+    if (fileStorage->durableWriter == NULL) {
+      async_log(LOG_ERR, "Could not start the tempfile writer");
+      file_close(&fileStorage->base);
+      return NULL;
+    }
+  }
+
+  return &fileStorage->base;
+}
@@ -0,0 +1,87 @@
+#include "mmap_log.h"
+#include "async_log.h"
+#include "storage_backends.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+typedef struct {
+  storage_t base;
+  const char *path;
+  int fd;
+  mmap_log_t *log;
+} mmap_storage_t;
+
+static int mmap_append(storage_t *storage, const char *data, size_t dataSize,
+                       off_t *out_end) {
+  return mmap_log_append(((mmap_storage_t *)storage)->log, data, dataSize,
+                         out_end);
+}
+
+static replay_status_t mmap_replay(storage_t *storage, int socketFd,
+                                   off_t *offset, off_t end,
+                                   replay_buffer_t *scratch) {
+  (void)scratch; // sent straight from the mapping
+  return mmap_log_replay(((mmap_storage_t *)storage)->log, socketFd, offset,
+                         end);
+}
+
+static int mmap_bounds(storage_t *storage, off_t *out_oldest,
+                       off_t *out_end) {
+  // appends publish in order, so the published prefix is all whole appends
+  *out_oldest = 0;
+  *out_end = mmap_log_published(((mmap_storage_t *)storage)->log);
+  return EXIT_SUCCESS;
+}
+
+static int mmap_flush(storage_t *storage) {
+  return mmap_log_sync(((mmap_storage_t *)storage)->log);
+}
+
+static void mmap_close(storage_t *storage) {
+  mmap_storage_t *mmapStorage = (mmap_storage_t *)storage;
+  mmap_log_close(mmapStorage->log);
+  unlink(mmapStorage->path);
+  close(mmapStorage->fd);
+  free(mmapStorage);
+}
+
+static const storage_ops_t MMAP_STORAGE_OPS = {
+    .name = "mmap",
+    .recordsTimestamps = true,
+    .append = mmap_append,
+    .replay = mmap_replay,
+    .seek_to_command = NULL,
+    .bounds = mmap_bounds,
+    .flush = mmap_flush,
+    .close = mmap_close,
+};
+
+storage_t *storage_mmap_open(const char *path) {
+  mmap_storage_t *mmapStorage = calloc(1, sizeof(*mmapStorage));
+  if (mmapStorage == NULL) {
+    async_log(LOG_ERR, "Could not allocate the mmap storage");
+    return NULL;
+  }
+  mmapStorage->base.ops = &MMAP_STORAGE_OPS;
+  mmapStorage->path = path;
+
+  mmapStorage->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (mmapStorage->fd == -1) {
+    async_log(LOG_ERR, "Could not open %s", path);
+    free(mmapStorage);
+    return NULL;
+  }
+
+  // the log msyncs each append itself
+  mmapStorage->log = mmap_log_open(mmapStorage->fd, true);
+  if (mmapStorage->log == NULL) {
+    async_log(LOG_ERR, "Could not map the tempfile");
+    unlink(path);
+    close(mmapStorage->fd);
+    free(mmapStorage);
+    return NULL;
+  }
+
+  return &mmapStorage->base;
+}
@@ -0,0 +1,196 @@
+#include "storage_backends.h"
+#include "async_log.h"
+#include "metrics.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Offsets are logical: they count every byte ever appended, so they keep
+// increasing as old lines are dropped.  Byte x lives at data[x % capacity]
+typedef struct {
+  storage_t base;
+  char *data;
+  size_t capacity;
+  pthread_mutex_t ringMutex; // guards everything below
+  off_t head;                // oldest byte still held, always a line start
+  off_t tail;                // one past the newest byte
+} ring_storage_t;
+
+// copy logical range [from, from + size) out of the ring
+static void ring_copy_out(const ring_storage_t *ring, off_t from, char *dest,
+                          size_t size) {
+  const size_t start = from % ring->capacity;
+  const size_t firstPart =
+      size < ring->capacity - start ? size : ring->capacity - start;
+  memcpy(dest, ring->data + start, firstPart);
+  memcpy(dest + firstPart, ring->data, size - firstPart);
+}
+
+// logical offset just past the newline ending the line at @ref from, or tail
+static off_t ring_line_end(const ring_storage_t *ring, off_t from) {
+  while (from < ring->tail) {
+    const size_t start = from % ring->capacity;
+    size_t span = ring->capacity - start;
+    if ((off_t)span > ring->tail - from) {
+      span = ring->tail - from;
+    }
+    const char *newline = memchr(ring->data + start, '\n', span);
+    if (newline != NULL) {
+      return from + (newline - (ring->data + start)) + 1;
+    }
+    from += span;
+  }
+  return ring->tail;
+}
+
+static int ring_append(storage_t *storage, const char *data, size_t dataSize,
+                       off_t *out_end) {
+  ring_storage_t *ring = (ring_storage_t *)storage;
+  if (dataSize > ring->capacity) {
+    async_log(LOG_ERR, "A %zu byte line does not fit the %zu byte ring", dataSize,
+           ring->capacity);
+    return EXIT_FAILURE;
+  }
+
+  metrics_lock(&ring->ringMutex);
+  // drop whole lines from the front until the new data fits
+  while ((size_t)(ring->tail - ring->head) + dataSize > ring->capacity) {
+    ring->head = ring_line_end(ring, ring->head);
+  }
+  const size_t start = ring->tail % ring->capacity;
+  const size_t firstPart = dataSize < ring->capacity - start
+                               ? dataSize
+                               : ring->capacity - start;
+  memcpy(ring->data + start, data, firstPart);
+  memcpy(ring->data, data + firstPart, dataSize - firstPart);
+  ring->tail += dataSize;
+  if (out_end != NULL) {
+    *out_end = ring->tail;
+  }
+  pthread_mutex_unlock(&ring->ringMutex);
+  return EXIT_SUCCESS;
+}
+
+static replay_status_t ring_replay(storage_t *storage, int socketFd,
+                                   off_t *offset, off_t end,
+                                   replay_buffer_t *scratch) {
+  ring_storage_t *ring = (ring_storage_t *)storage;
+  // the ring never holds more than its capacity, size the copy for that
+  size_t wanted = ring->capacity;
+  if (end >= 0 && end - *offset < (off_t)wanted) {
+    if (end <= *offset) {
+      return REPLAY_COMPLETE;
+    }
+    wanted = end - *offset;
+  }
+  while (true) {
+    const size_t capacity = replay_buffer_reserve(scratch, socketFd, wanted);
+    if (capacity == 0) {
+      return REPLAY_FAILED;
+    }
+    // copy a chunk out under the lock, send it without holding the ring
+    metrics_lock(&ring->ringMutex);
+    if (*offset < ring->head) {
+      *offset = ring->head; // dropped while the client was reading
+    }
+    const off_t stop = (end < 0 || end > ring->tail) ? ring->tail : end;
+    size_t chunk = 0;
+    if (*offset < stop) {
+      chunk = stop - *offset;
+      if (chunk > capacity) {
+        chunk = capacity;
+      }
+      ring_copy_out(ring, *offset, scratch->data, chunk);
+    }
+    pthread_mutex_unlock(&ring->ringMutex);
+    if (chunk == 0) {
+      return REPLAY_COMPLETE;
+    }
+
+    // what a non-blocking socket didn't take is copied again on the next call
+    const replay_status_t status =
+        replay_send_all(socketFd, scratch->data, chunk, offset);
+    if (status != REPLAY_COMPLETE) {
+      return status;
+    }
+  }
+}
+
+static int ring_seek_to_command(storage_t *storage, uint32_t command,
+                                uint32_t commandOffset, off_t *out_offset) {
+  ring_storage_t *ring = (ring_storage_t *)storage;
+  metrics_lock(&ring->ringMutex);
+  // commands are counted from the oldest line still held, like the device
+  off_t commandStart = ring->head;
+  for (uint32_t i = 0; i < command && commandStart < ring->tail; ++i) {
+    commandStart = ring_line_end(ring, commandStart);
+  }
+  const off_t commandEnd = ring_line_end(ring, commandStart);
+  const bool found =
+      commandStart < ring->tail && commandOffset < commandEnd - commandStart;
+  *out_offset = commandStart + commandOffset;
+  pthread_mutex_unlock(&ring->ringMutex);
+
+  if (!found) {
+    async_log(LOG_WARNING, "Seek to command %u offset %u is out of range",
+           command, commandOffset);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+static int ring_bounds(storage_t *storage, off_t *out_oldest,
+                       off_t *out_end) {
+  ring_storage_t *ring = (ring_storage_t *)storage;
+  metrics_lock(&ring->ringMutex);
+  *out_oldest = ring->head;
+  *out_end = ring->tail;
+  pthread_mutex_unlock(&ring->ringMutex);
+  return EXIT_SUCCESS;
+}
+
+static int ring_flush(storage_t *storage) {
+  (void)storage; // memory only, there is nothing to make durable
+  return EXIT_SUCCESS;
+}
+
+static void ring_close(storage_t *storage) {
+  ring_storage_t *ring = (ring_storage_t *)storage;
+  pthread_mutex_destroy(&ring->ringMutex);
+  free(ring->data);
+  free(ring);
+}
+
+static const storage_ops_t RING_STORAGE_OPS = {
+    .name = "ring",
+    .recordsTimestamps = true,
+    .append = ring_append,
+    .replay = ring_replay,
+    .seek_to_command = ring_seek_to_command,
+    .bounds = ring_bounds,
+    .flush = ring_flush,
+    .close = ring_close,
+};
+
+storage_t *storage_ring_open(size_t capacity) {
+  if (capacity == 0) {
+    return NULL;
+  }
+  ring_storage_t *ring = calloc(1, sizeof(*ring));
+  if (ring == NULL) {
+    async_log(LOG_ERR, "Could not allocate the ring storage");
+    return NULL;
+  }
+  ring->data = malloc(capacity);
+  if (ring->data == NULL) {
+    async_log(LOG_ERR, "Could not allocate a %zu byte ring", capacity);
+    free(ring);
+    return NULL;
+  }
+  ring->base.ops = &RING_STORAGE_OPS;
+  ring->capacity = capacity;
+  pthread_mutex_init(&ring->ringMutex, NULL);
+  return &ring->base;
+}
@@ -0,0 +1,201 @@
+#include "timer_service.h"
+#include "async_log.h"
+#include "cleanup.h"
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <sys/queue.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#define WHEEL_SLOTS (512) // power of two
+
+struct timer_job {
+  timer_job_fn run;
+  void *context;
+  uint64_t periodTicks;
+  uint64_t rounds; // wheel turns left before the job is due
+  LIST_ENTRY(timer_job) entry;
+};
+
+LIST_HEAD(timer_slot, timer_job);
+
+struct timer_service {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  unsigned tickMs;
+  uint64_t currentTick; // ticks elapsed, the wheel's hand
+  struct timer_slot slots[WHEEL_SLOTS];
+  int timerFd;
+  int stopFd;   // eventfd, readable once the service should stop
+  bool running; // the thread was started and must be joined
+};
+
+// hang a job in the slot its next expiry falls on, lock held
+static void insert_job(timer_service_t *service, timer_job_t *job) {
+  const uint64_t due = service->currentTick + job->periodTicks;
+  // the slot is only visited after the tick that inserted it is done, so a
+  // full lap is one round fewer
+  job->rounds = (job->periodTicks - 1) / WHEEL_SLOTS;
+  LIST_INSERT_HEAD(&service->slots[due & (WHEEL_SLOTS - 1)], job, entry);
+}
+
+// advance the hand one slot and run whatever is due there, lock held
+static void advance_tick(timer_service_t *service) {
+  ++service->currentTick;
+  struct timer_slot *slot =
+      &service->slots[service->currentTick & (WHEEL_SLOTS - 1)];
+  // detach the slot first, due jobs go back on the wheel as they run and may
+  // land in this same slot
+  struct timer_slot pending = LIST_HEAD_INITIALIZER(pending);
+  while (!LIST_EMPTY(slot)) {
+    timer_job_t *job = LIST_FIRST(slot);
+    LIST_REMOVE(job, entry);
+    LIST_INSERT_HEAD(&pending, job, entry);
+  }
+  while (!LIST_EMPTY(&pending)) {
+    timer_job_t *job = LIST_FIRST(&pending);
+    LIST_REMOVE(job, entry);
+    if (job->rounds > 0) {
+      --job->rounds;
+      LIST_INSERT_HEAD(slot, job, entry);
+      continue;
+    }
+    job->run(job->context);
+    insert_job(service, job);
+  }
+}
+
+static void *timer_thread(void *param) {
+  timer_service_t *service = param;
+  struct pollfd fds[] = {
+      {.fd = service->stopFd, .events = POLLIN},
+      {.fd = service->timerFd, .events = POLLIN},
+  };
+  while (true) {
+    if (poll(fds, sizeof(fds) / sizeof(fds[0]), -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      async_log(LOG_ERR, "Timer service failed, periodic jobs are stopped");
+      return NULL;
+    }
+    if (fds[0].revents != 0) {
+      return NULL;
+    }
+    uint64_t expirations = 0;
+    if (read(service->timerFd, &expirations, sizeof(expirations)) !=
+        sizeof(expirations)) {
+      continue;
+    }
+    // a late wakeup still visits every slot it skipped
+    pthread_mutex_lock(&service->lock);
+    for (uint64_t i = 0; i < expirations; ++i) {
+      advance_tick(service);
+    }
+    pthread_mutex_unlock(&service->lock);
+  }
+}
+
+timer_service_t *timer_service_start(unsigned tickMs) {
+  timer_service_t *service = calloc(1, sizeof(*service));
+  if (service == NULL) {
+    async_log(LOG_ERR, "Could not allocate the timer service");
+    return NULL;
+  }
+  service->timerFd = -1;
+  service->stopFd = -1;
+  service->tickMs = tickMs > 0 ? tickMs : 1;
+  for (unsigned i = 0; i < WHEEL_SLOTS; ++i) {
+    LIST_INIT(&service->slots[i]);
+  }
+  if (pthread_mutex_init(&service->lock, NULL) != 0) {
+    async_log(LOG_ERR, "Could not initialize the timer service lock");
+    free(service);
+    return NULL;
+  }
+
+  service->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  service->stopFd = eventfd(0, EFD_CLOEXEC);
+  const struct timespec tick = {
+      .tv_sec = service->tickMs / 1000,
+      .tv_nsec = (long)(service->tickMs % 1000) * 1000000,
+  };
+  const struct itimerspec period = {.it_interval = tick, .it_value = tick};
+  if (service->timerFd == -1 || service->stopFd == -1 ||
+      timerfd_settime(service->timerFd, 0, &period, NULL) != 0) {
+    async_log(LOG_ERR, "Could not set up the timer service");
+    timer_service_stop(service);
+    return NULL;
+  }
+
+  // keep every signal away from the timer thread
+  sigset_t allSignals;
+  sigset_t previousMask;
+  sigfillset(&allSignals);
+  pthread_sigmask(SIG_BLOCK, &allSignals, &previousMask);
+  const int created =
+      pthread_create(&service->thread, NULL, timer_thread, service);
+  pthread_sigmask(SIG_SETMASK, &previousMask, NULL);
+  if (created != 0) {
+    async_log(LOG_ERR, "Could not start the timer service");
+    timer_service_stop(service);
+    return NULL;
+  }
+  service->running = true;
+  return service;
+}
+
+timer_job_t *timer_service_schedule(timer_service_t *service,
+                                    unsigned intervalMs, timer_job_fn run,
+                                    void *context) {
+  timer_job_t *job = malloc(sizeof(*job));
+  if (job == NULL) {
+    async_log(LOG_ERR, "Could not allocate a timer job");
+    return NULL;
+  }
+  job->run = run;
+  job->context = context;
+  job->periodTicks = (intervalMs + service->tickMs - 1) / service->tickMs;
+  if (job->periodTicks == 0) {
+    job->periodTicks = 1;
+  }
+  pthread_mutex_lock(&service->lock);
+  insert_job(service, job);
+  pthread_mutex_unlock(&service->lock);
+  return job;
+}
+
+void timer_service_cancel(timer_service_t *service, timer_job_t *job) {
+  // jobs run under the lock, so this waits out a running one
+  pthread_mutex_lock(&service->lock);
+  LIST_REMOVE(job, entry);
+  pthread_mutex_unlock(&service->lock);
+  free(job);
+}
+
+void timer_service_stop(timer_service_t *service) {
+  if (service == NULL) {
+    return;
+  }
+  if (service->running) {
+    eventfd_write(service->stopFd, 1);
+    pthread_join(service->thread, NULL);
+  }
+  for (unsigned i = 0; i < WHEEL_SLOTS; ++i) {
+    while (!LIST_EMPTY(&service->slots[i])) {
+      timer_job_t *job = LIST_FIRST(&service->slots[i]);
+      LIST_REMOVE(job, entry);
+      free(job);
+    }
+  }
+  cleanup_fd(&service->timerFd);
+  cleanup_fd(&service->stopFd);
+  pthread_mutex_destroy(&service->lock);
+  free(service);
+}
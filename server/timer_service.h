@@ -0,0 +1,64 @@
+#ifndef TIMER_SERVICE_H
+#define TIMER_SERVICE_H
+
+/**
+ * @brief One thread running every periodic job of the server.
+ *
+ * Jobs hang off a hashed timing wheel that a timerfd advances one tick at a
+ * time, so adding, cancelling and expiring a job are O(1) no matter how many
+ * are scheduled, and the thread only wakes once per tick.  Intervals are
+ * rounded up to whole ticks.
+ *
+ * Jobs run one at a time on the service thread, with the service locked: they
+ * must be short, and must not schedule or cancel jobs themselves.
+ */
+typedef struct timer_service timer_service_t;
+
+typedef struct timer_job timer_job_t;
+
+/**
+ * @brief A periodic job
+ *
+ * @param context the context given to @ref timer_service_schedule
+ */
+typedef void (*timer_job_fn)(void *context);
+
+/**
+ * @brief Start the service thread.  Signals are blocked on it, so they keep
+ * going to the threads that expect them
+ *
+ * @param tickMs wheel resolution, in milliseconds
+ * @return the service, or NULL on error
+ */
+timer_service_t *timer_service_start(unsigned tickMs);
+
+/**
+ * @brief Run a job every @ref intervalMs, first after one interval
+ *
+ * @param service the timer service
+ * @param intervalMs period of the job, at least one tick
+ * @param run the job
+ * @param context passed to @ref run
+ * @return the job, for @ref timer_service_cancel, or NULL on error
+ */
+timer_job_t *timer_service_schedule(timer_service_t *service,
+                                    unsigned intervalMs, timer_job_fn run,
+                                    void *context);
+
+/**
+ * @brief Stop and free a job.  Once this returns the job isn't running and
+ * never will again, so its context may be freed
+ *
+ * @param service the timer service
+ * @param job a job scheduled on @ref service
+ */
+void timer_service_cancel(timer_service_t *service, timer_job_t *job);
+
+/**
+ * @brief Stop the service thread and free every job still scheduled
+ *
+ * @param service the timer service, may be NULL
+ */
+void timer_service_stop(timer_service_t *service);
+
+#endif
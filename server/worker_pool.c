@@ -0,0 +1,197 @@
+#include "worker_pool.h"
+#include "async_log.h"
+#include "cleanup.h"
+#include "metrics.h"
+#include "server_behavior.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+// How often a blocked acceptor re-checks for a stop request
+#define STOP_POLL_NS (100 * 1000000L)
+#define NS_PER_SEC (1000000000L)
+
+typedef struct {
+  int connectionFd;
+  char clientAddr[INET_ADDRSTRLEN];
+} queued_connection_t;
+
+typedef struct {
+  pthread_mutex_t lock;     // guards everything below
+  pthread_cond_t notEmpty;  // signalled when a connection is queued
+  pthread_cond_t notFull;   // signalled when a worker takes a connection
+  queued_connection_t *slots;
+  unsigned capacity;
+  unsigned head;            // next slot to take from
+  unsigned count;
+  bool closing;             // no more connections will be queued
+  storage_t *storage;
+  const server_options_t *options;
+} worker_pool_t;
+
+static void *worker_thread(void *param) {
+  worker_pool_t *pool = (worker_pool_t *)param;
+
+  while (true) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->count == 0 && !pool->closing) {
+      pthread_cond_wait(&pool->notEmpty, &pool->lock);
+    }
+    if (pool->count == 0) {
+      // closing, and every queued connection has been served
+      pthread_mutex_unlock(&pool->lock);
+      break;
+    }
+    const queued_connection_t next = pool->slots[pool->head];
+    pool->head = (pool->head + 1) % pool->capacity;
+    --pool->count;
+    pthread_cond_signal(&pool->notFull);
+    pthread_mutex_unlock(&pool->lock);
+
+    if (server_handle_connection(next.connectionFd, pool->storage,
+                                 next.clientAddr, pool->options) !=
+        EXIT_SUCCESS) {
+      async_log(LOG_ERR, "Connection from %s failed during processing",
+             next.clientAddr);
+    }
+  }
+
+  return NULL;
+}
+
+// Block until a queue slot is free, or a stop is requested
+static bool wait_for_slot(worker_pool_t *pool,
+                          volatile sig_atomic_t *stopFlag) {
+  pthread_mutex_lock(&pool->lock);
+  while (pool->count == pool->capacity && *stopFlag == 0) {
+    struct timespec wakeTime;
+    clock_gettime(CLOCK_REALTIME, &wakeTime);
+    wakeTime.tv_nsec += STOP_POLL_NS;
+    if (wakeTime.tv_nsec >= NS_PER_SEC) {
+      wakeTime.tv_nsec -= NS_PER_SEC;
+      ++wakeTime.tv_sec;
+    }
+    pthread_cond_timedwait(&pool->notFull, &pool->lock, &wakeTime);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return *stopFlag == 0;
+}
+
+static int accept_into_pool(int listenFd, worker_pool_t *pool,
+                            volatile sig_atomic_t *stopFlag) {
+  // only accept once a worker will be able to take the connection
+  while (wait_for_slot(pool, stopFlag)) {
+    struct sockaddr_in connectedAddr;
+    socklen_t addrLen = sizeof(connectedAddr);
+    const int connectionFd =
+        accept(listenFd, (struct sockaddr *)&connectedAddr, &addrLen);
+    if (connectionFd == -1) {
+      if (errno == EINTR) {
+        continue; // stopFlag is checked by wait_for_slot
+      }
+      async_log(LOG_ERR, "Error when waiting for a connection");
+      return EXIT_FAILURE;
+    }
+
+    const uint64_t acceptedAt = metrics_now();
+    queued_connection_t queued = {.connectionFd = connectionFd};
+    inet_ntop(AF_INET, &connectedAddr.sin_addr, queued.clientAddr,
+              sizeof(queued.clientAddr));
+    async_log(LOG_INFO, "Accepted connection from %s", queued.clientAddr);
+
+    // this is the only producer, so the slot found above is still free
+    pthread_mutex_lock(&pool->lock);
+    pool->slots[(pool->head + pool->count) % pool->capacity] = queued;
+    ++pool->count;
+    pthread_cond_signal(&pool->notEmpty);
+    pthread_mutex_unlock(&pool->lock);
+    metrics_record(METRICS_ACCEPT, acceptedAt);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int run_worker_pool(int listenFd, const server_options_t *options,
+                    storage_t *storage, volatile sig_atomic_t *stopFlag) {
+  unsigned threadCount = options->workerThreads;
+  unsigned queueDepth = options->queueDepth;
+  if (threadCount == 0) {
+    const long onlineCores = sysconf(_SC_NPROCESSORS_ONLN);
+    threadCount = onlineCores > 0 ? (unsigned)onlineCores : 1;
+  }
+  if (queueDepth == 0) {
+    queueDepth = 1;
+  }
+
+  worker_pool_t pool = {
+      .lock = PTHREAD_MUTEX_INITIALIZER,
+      .notEmpty = PTHREAD_COND_INITIALIZER,
+      .notFull = PTHREAD_COND_INITIALIZER,
+      .capacity = queueDepth,
+      .storage = storage,
+      .options = options,
+  };
+  pool.slots = calloc(queueDepth, sizeof(queued_connection_t));
+  pthread_t *threads = calloc(threadCount, sizeof(pthread_t));
+  if (pool.slots == NULL || threads == NULL) {
+    async_log(LOG_ERR, "Could not allocate worker pool storage");
+    free(pool.slots);
+    free(threads);
+    return EXIT_FAILURE;
+  }
+
+  // Keep SIGINT/SIGTERM on this thread, so they interrupt accept()
+  sigset_t stopSignals;
+  sigemptyset(&stopSignals);
+  sigaddset(&stopSignals, SIGINT);
+  sigaddset(&stopSignals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &stopSignals, NULL);
+
+  int result = EXIT_SUCCESS;
+  unsigned threadsStarted = 0;
+  for (; threadsStarted < threadCount; ++threadsStarted) {
+    if (pthread_create(&threads[threadsStarted], NULL, worker_thread, &pool) !=
+        0) {
+      async_log(LOG_ERR, "Could not start a worker thread");
+      result = EXIT_FAILURE;
+      break;
+    }
+  }
+  pthread_sigmask(SIG_UNBLOCK, &stopSignals, NULL);
+  async_log(LOG_INFO, "Serving with %u worker threads", threadsStarted);
+
+  if (result == EXIT_SUCCESS) {
+    result = accept_into_pool(listenFd, &pool, stopFlag);
+  }
+
+  // let the workers drain the queue and exit, closing what they were serving
+  server_stop_connections();
+  pthread_mutex_lock(&pool.lock);
+  pool.closing = true;
+  pthread_cond_broadcast(&pool.notEmpty);
+  pthread_mutex_unlock(&pool.lock);
+  for (unsigned i = 0; i < threadsStarted; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+
+  // nobody left to serve these if the workers failed to start
+  for (unsigned i = 0; i < pool.count; ++i) {
+    cleanup_socket(&pool.slots[(pool.head + i) % pool.capacity].connectionFd);
+  }
+
+  free(pool.slots);
+  free(threads);
+  pthread_mutex_destroy(&pool.lock);
+  pthread_cond_destroy(&pool.notEmpty);
+  pthread_cond_destroy(&pool.notFull);
+  return result;
+}
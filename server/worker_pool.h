@@ -0,0 +1,28 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <signal.h>
+
+#include "server_options.h"
+#include "storage.h"
+
+/**
+ * @brief Serve connections from a fixed pool of pre-spawned worker threads.
+ *
+ * The calling thread accepts connections and feeds them to the workers through
+ * a bounded queue.  While the queue is full no more connections are accepted,
+ * leaving new clients waiting in the listen backlog.  Only returns once the
+ * server is stopped; queued connections are served before the workers exit.
+ *
+ * @param listenFd a listening socket
+ * @param options server options: workerThreads (0 for one per online core),
+ * queueDepth and the connection behavior.  Must outlive the pool
+ * @param storage the storage backend, shared by every worker
+ * @param stopFlag set by the SIGINT/SIGTERM handler to stop the server
+ * @return EXIT_SUCCESS when stopped by a signal, EXIT_FAILURE on error.  The
+ * program should clean up and close on EXIT_FAILURE
+ */
+int run_worker_pool(int listenFd, const server_options_t *options,
+                    storage_t *storage, volatile sig_atomic_t *stopFlag);
+
+#endif